@@ -42,10 +42,12 @@ ModuleGraph BuildModuleGraph(objprof::PageData const &page)
 	return mg;
 }
 
-static void AOTCompilePage(CompilerRuntime *aotrt, objprof::PageData const &page)
+static void AOTCompilePage(CompilerRuntime *aotrt, std::vector<AOTSymbol> &aot_symbols,
+			   objprof::PageData const &page)
 {
 	auto mg = BuildModuleGraph(page);
 	auto regions = mg.ComputeRegions();
+	auto livein = mg.ComputeLiveness();
 
 #if 1
 	for (auto const &r : regions) {
@@ -55,8 +57,13 @@ static void AOTCompilePage(CompilerRuntime *aotrt, objprof::PageData const &page
 			ipranges.push_back({n->ip, n->ip_end});
 		}
 
+		u32 gip_end = GetRegionGipEnd(ipranges);
 		qir::CompilerJob job(aotrt, (uptr)mmu::base, mg.segment, std::move(ipranges));
+		job.gregs_livein = &livein;
 		qir::CompilerDoJob(job);
+		// Appended by AnnounceRegion
+		assert(aot_symbols.back().gip == r[0]->ip);
+		aot_symbols.back().gip_end = gip_end;
 	}
 #else
 	for (auto const &e : mg.ip_map) {
@@ -67,10 +74,10 @@ static void AOTCompilePage(CompilerRuntime *aotrt, objprof::PageData const &page
 #endif
 }
 
-void AOTCompileObject(CompilerRuntime *aotrt)
+void AOTCompileObject(CompilerRuntime *aotrt, std::vector<AOTSymbol> &aot_symbols)
 {
 	for (auto const &page : objprof::GetProfile()) {
-		AOTCompilePage(aotrt, page);
+		AOTCompilePage(aotrt, aot_symbols, page);
 	}
 }
 
@@ -4,33 +4,53 @@
 #include "dbt/qmc/compile.h"
 #include "dbt/tcache/objprof.h"
 
+#include <algorithm>
 #include <sstream>
 
 namespace dbt
 {
 
+struct LLVMAOTOptions {
+	bool time_passes{false};
+	uint n_hot_regs{6}; // guest gprs passed in registers between aot regions
+};
+
 void AOTCompileELF();
-void LLVMAOTCompileELF();
+void LLVMAOTCompileELF(LLVMAOTOptions const &opts);
 void BootAOTFile();
 
 static constexpr char const *AOT_O_EXTENSION = ".aot.o";
 static constexpr char const *AOT_SO_EXTENSION = ".aot.so";
 static constexpr char const *AOT_SYM_AOTTAB = "_aot_tab";
+// i32 pc-relative references to lazy BranchSlots, resolved by LinkAOTObject
+static constexpr char const *AOT_SEC_BRSLOTS = ".aotslots";
 
 struct AOTSymbol {
 	u32 gip;
+	u32 gip_end; // guest code the region is translated from ends here
 	u64 aot_vaddr;
 };
 
+inline u32 GetRegionGipEnd(qir::CompilerJob::IpRangesSet const &ipranges)
+{
+	u32 res = 0;
+	for (auto const &r : ipranges) {
+		res = std::max(res, r.second);
+	}
+	return res;
+}
+
 struct AOTTabHeader {
 	u64 n_sym;
+	// Code syncs guest state before memory accesses (qcg), faults in it are recoverable
+	u64 precise_faults;
 	AOTSymbol sym[];
 };
 
 ModuleGraph BuildModuleGraph(objprof::PageData const &page);
-void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols);
+void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols, bool precise_faults);
 
-void AOTCompileObject(CompilerRuntime *aotrt);
+void AOTCompileObject(CompilerRuntime *aotrt, std::vector<AOTSymbol> &aot_symbols);
 
 void ProcessLLVMStackmaps(std::vector<AOTSymbol> &aot_symbols);
 
@@ -1,9 +1,14 @@
 #include "dbt/aot/aot.h"
 #include "dbt/qmc/compile.h"
+#include "dbt/qmc/qcg/jitabi.h"
 #include "dbt/tcache/objprof.h"
+#include "dbt/tcache/perfmap.h"
 #include "dbt/util/fsmanager.h"
 
+#include <algorithm>
+#include <cstring>
 #include <sstream>
+#include <vector>
 
 extern "C" {
 #include <dlfcn.h>
@@ -18,16 +23,100 @@ namespace dbt
 {
 LOG_STREAM(aot)
 
+// End of the executable segments of the image loaded at l_addr
+static u8 *GetAOTTextEnd(u8 *l_addr)
+{
+	std::pair<uptr, uptr> text{(uptr)l_addr, 0}; // l_addr, text end
+	dl_iterate_phdr(
+	    [](dl_phdr_info *info, size_t, void *data) {
+		    auto text = (std::pair<uptr, uptr> *)data;
+		    if (info->dlpi_addr != text->first) {
+			    return 0;
+		    }
+		    for (int i = 0; i < info->dlpi_phnum; ++i) {
+			    auto const &ph = info->dlpi_phdr[i];
+			    if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+				    text->second = std::max(text->second, (uptr)(ph.p_vaddr + ph.p_memsz));
+			    }
+		    }
+		    return 1;
+	    },
+	    &text);
+	return l_addr + text.second;
+}
+
+// aottab has no sizes, code of a symbol extends to the next one or to the end of the text segment
+static void AnnounceAOTCode(AOTTabHeader const *aottab, u8 *l_addr, u8 *text_end)
+{
+	std::vector<AOTSymbol> syms(&aottab->sym[0], &aottab->sym[aottab->n_sym]);
+	auto by_vaddr = [](auto const &a, auto const &b) { return a.aot_vaddr < b.aot_vaddr; };
+	std::sort(syms.begin(), syms.end(), by_vaddr);
+	for (size_t i = 0; i < syms.size(); ++i) {
+		u64 vaddr = syms[i].aot_vaddr;
+		u64 end = i + 1 < syms.size() ? syms[i + 1].aot_vaddr : text_end - l_addr;
+		if (end > vaddr) {
+			perfmap::AnnounceCode(syms[i].gip, l_addr + vaddr, end - vaddr);
+		}
+	}
+}
+
+// LinkAOTObject turned slots targeting aot regions into jumps, tcache must know them to unlink on SMC.
+// .aotslots is loaded, its address is found in the section headers of the file
+static void RecordAOTLinks(std::string const &aot_path, AOTTabHeader const *aottab, u8 *l_addr)
+{
+	int fd = open(aot_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		Panic(strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		Panic(strerror(errno));
+	}
+	auto fmap = (u8 *)host_mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (fmap == MAP_FAILED) {
+		Panic(strerror(errno));
+	}
+	close(fd);
+
+	auto ehdr = (ElfW(Ehdr) const *)fmap;
+	auto shtab = (ElfW(Shdr) const *)(fmap + ehdr->e_shoff);
+	auto shstr = (char const *)fmap + shtab[ehdr->e_shstrndx].sh_offset;
+	std::vector<jitabi::ppoint::BranchSlot *> linked;
+
+	for (size_t i = 0; i < ehdr->e_shnum; ++i) {
+		if (strcmp(shstr + shtab[i].sh_name, AOT_SEC_BRSLOTS)) {
+			continue;
+		}
+		auto brslots = (i32 const *)(l_addr + shtab[i].sh_addr);
+		size_t const n_brslots = shtab[i].sh_size / sizeof(i32);
+		for (size_t idx = 0; idx < n_brslots; ++idx) {
+			auto slot = (jitabi::ppoint::BranchSlot *)((uptr)&brslots[idx] + brslots[idx]);
+			auto cmp = [](AOTSymbol const &sym, u32 val) { return sym.gip < val; };
+			auto end = &aottab->sym[aottab->n_sym];
+			auto sym = std::lower_bound(&aottab->sym[0], end, (u32)slot->gip, cmp);
+			if (sym != end && sym->gip == slot->gip) {
+				linked.push_back(slot);
+			}
+		}
+	}
+	munmap(fmap, st.st_size);
+
+	log_aot("record %zu static branch links", linked.size());
+	tcache::RecordAOTLinks(linked);
+}
+
 void BootAOTFile()
 {
 	void *so_handle;
 	link_map *lmap;
+	std::string aot_path;
 	{
 		DBT_FS_LOCK();
-		auto aot_path = objprof::GetCachePath(AOT_SO_EXTENSION);
+		aot_path = objprof::GetCachePath(AOT_SO_EXTENSION);
 
 		if (so_handle = dlopen(aot_path.c_str(), RTLD_NOW); !so_handle) {
 			log_aot("failed to open %s: %s, skip aot boot", aot_path.c_str(), dlerror());
+			return;
 		}
 		if (dlinfo(so_handle, RTLD_DI_LINKMAP, (void *)&lmap) < 0) {
 			Panic();
@@ -39,18 +128,16 @@ void BootAOTFile()
 	auto aottab = (AOTTabHeader const *)dlsym(so_handle, AOT_SYM_AOTTAB);
 	assert(aottab);
 
-	auto announce = [l_addr](AOTSymbol const *sym) {
-		auto tb = tcache::AllocateTBlock();
-		if (tb == nullptr) {
-			Panic();
-		}
-		tb->ip = sym->gip;
-		tb->tcode = TBlock::TCode{l_addr + sym->aot_vaddr, 0};
-		tcache::Insert(tb);
-	};
-
-	for (u64 idx = 0; idx < aottab->n_sym; ++idx) {
-		announce(&aottab->sym[idx]);
+	// .aottab is sorted by gip at link time, tcache materializes TBlocks on demand
+	log_aot("attach aottab, %zu entries", (size_t)aottab->n_sym);
+	auto text_end = GetAOTTextEnd(l_addr);
+	tcache::AttachAOTTab(aottab, l_addr, text_end);
+	{
+		DBT_FS_LOCK();
+		RecordAOTLinks(aot_path, aottab, l_addr);
+	}
+	if (perfmap::IsEnabled()) {
+		AnnounceAOTCode(aottab, l_addr, text_end);
 	}
 }
 
@@ -1,6 +1,8 @@
 #include "dbt/aot/aot.h"
 #include "dbt/qmc/compile.h"
+#include "dbt/qmc/qcg/jitabi.h"
 #include "dbt/tcache/objprof.h"
+#include <algorithm>
 #include <sstream>
 
 #include "elfio/elfio.hpp"
@@ -16,9 +18,11 @@ LOG_STREAM(aot)
 
 struct AOTCompilerRuntime final : CompilerRuntime {
 	AOTCompilerRuntime(elfio::section *elf_text_, const elfio::string_section_accessor &elf_stra_,
-			   const elfio::symbol_section_accessor &elf_syma_, std::vector<AOTSymbol> &aotsyms_)
+			   const elfio::symbol_section_accessor &elf_syma_,
+			   const elfio::relocation_section_accessor &elf_brslots_rela_,
+			   elfio::Elf_Word text_sym_, std::vector<AOTSymbol> &aotsyms_)
 	    : code_arena(256_MB), elf_text(elf_text_), elf_stra(elf_stra_), elf_syma(elf_syma_),
-	      aotsyms(aotsyms_)
+	      elf_brslots_rela(elf_brslots_rela_), text_sym(text_sym_), aotsyms(aotsyms_)
 	{
 	}
 
@@ -39,15 +43,32 @@ struct AOTCompilerRuntime final : CompilerRuntime {
 
 		elf_syma.add_symbol(str_idx, code_offs, code.size(), elfio::STB_GLOBAL, elfio::STT_FUNC, 0,
 				    elf_text->get_index());
-		aotsyms.push_back({ip, 0});
+		aotsyms.push_back({.gip = ip});
 
 		return nullptr;
 	}
 
+	void AnnounceBranchSlot(void *slot) override
+	{
+		// Section symbol: ld rejects pc-relative relocations against preemptible _x<ip>
+		uptr slot_offs = (uptr)slot - (uptr)code_arena.BaseAddr();
+		elf_brslots_rela.add_entry(n_brslots * sizeof(i32), text_sym, elfio::R_X86_64_PC32,
+					   slot_offs);
+		n_brslots++;
+	}
+
+	void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) override
+	{
+		unreachable("");
+	}
+
 	MemArena code_arena;
 	elfio::section *elf_text;
 	elfio::string_section_accessor elf_stra;
 	elfio::symbol_section_accessor elf_syma;
+	elfio::relocation_section_accessor elf_brslots_rela;
+	elfio::Elf_Word text_sym;
+	u32 n_brslots{0};
 	std::vector<AOTSymbol> &aotsyms;
 };
 
@@ -82,18 +103,37 @@ void AOTCompileELF()
 	str_sec->set_type(elfio::SHT_STRTAB);
 	elfio::section *sym_sec = writer.sections.add(".symtab");
 	sym_sec->set_type(elfio::SHT_SYMTAB);
-	sym_sec->set_info(1);
+	sym_sec->set_info(2);
 	sym_sec->set_addr_align(0x4);
 	sym_sec->set_entry_size(writer.get_default_entry_size(elfio::SHT_SYMTAB));
 	sym_sec->set_link(str_sec->get_index());
 
+	elfio::section *brslots_sec = writer.sections.add(AOT_SEC_BRSLOTS);
+	brslots_sec->set_type(elfio::SHT_PROGBITS);
+	brslots_sec->set_flags(elfio::SHF_ALLOC);
+	brslots_sec->set_addr_align(sizeof(i32));
+
+	elfio::section *brslots_rela_sec = writer.sections.add(std::string(".rela") + AOT_SEC_BRSLOTS);
+	brslots_rela_sec->set_type(elfio::SHT_RELA);
+	brslots_rela_sec->set_info(brslots_sec->get_index());
+	brslots_rela_sec->set_link(sym_sec->get_index());
+	brslots_rela_sec->set_addr_align(0x8);
+	brslots_rela_sec->set_entry_size(writer.get_default_entry_size(elfio::SHT_RELA));
+
 	elfio::string_section_accessor stra(str_sec);
 	elfio::symbol_section_accessor syma(writer, sym_sec);
-	AOTCompilerRuntime aotrt(aot_sec, stra, syma, aot_symbols);
+	elfio::relocation_section_accessor brslots_rela(writer, brslots_rela_sec);
+
+	// The only local symbol
+	auto text_sym =
+	    syma.add_symbol(0, 0, 0, elfio::STB_LOCAL, elfio::STT_SECTION, 0, aot_sec->get_index());
+	AOTCompilerRuntime aotrt(aot_sec, stra, syma, brslots_rela, text_sym, aot_symbols);
 
-	AOTCompileObject(&aotrt);
+	AOTCompileObject(&aotrt, aot_symbols);
 
 	aot_sec->set_data((char const *)aotrt.code_arena.BaseAddr(), aotrt.code_arena.GetUsedSize());
+	std::vector<char> brslots_data(aotrt.n_brslots * sizeof(i32), 0);
+	brslots_sec->set_data(brslots_data.data(), brslots_data.size());
 
 	aottab_sec->set_size(sizeof(AOTTabHeader) + sizeof(AOTSymbol) * aot_symbols.size());
 	syma.add_symbol(stra.add_string(AOT_SYM_AOTTAB), 0, aottab_sec->get_size(), elfio::STB_GLOBAL,
@@ -104,10 +144,52 @@ void AOTCompileELF()
 	auto obj_path = objprof::GetCachePath(AOT_O_EXTENSION);
 	writer.save(obj_path);
 
-	LinkAOTObject(aot_symbols);
+	LinkAOTObject(aot_symbols, true);
 }
 
-void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols)
+// Turn lazy BranchSlots targeting AOT regions into direct jumps, the rest is linked at runtime
+static void LinkAOTBranchSlots(elfio::elfio &elf, elfio::section *brslots_sec,
+			       std::vector<AOTSymbol> const &aot_symbols, u8 *fmap)
+{
+	auto vaddr2fmap = [&](uptr vaddr) -> u8 * {
+		for (auto const &seg : elf.segments) {
+			if (seg->get_type() != elfio::PT_LOAD) {
+				continue;
+			}
+			uptr offs = vaddr - seg->get_virtual_address();
+			if (offs < seg->get_file_size()) {
+				return fmap + seg->get_offset() + offs;
+			}
+		}
+		Panic("bad vaddr in " + std::string(AOT_SEC_BRSLOTS));
+	};
+
+	auto resolve_gip = [&](u32 gip) -> AOTSymbol const * {
+		auto cmp = [](AOTSymbol const &sym, u32 val) { return sym.gip < val; };
+		auto it = std::lower_bound(aot_symbols.begin(), aot_symbols.end(), gip, cmp);
+		return (it != aot_symbols.end() && it->gip == gip) ? &*it : nullptr;
+	};
+
+	auto const *brslots = (i32 const *)brslots_sec->get_data();
+	size_t const n_brslots = brslots_sec->get_size() / sizeof(i32);
+	size_t n_linked = 0;
+
+	for (size_t idx = 0; idx < n_brslots; ++idx) {
+		uptr slot_vaddr = brslots_sec->get_address() + idx * sizeof(i32) + brslots[idx];
+		auto *slot = (jitabi::ppoint::BranchSlot *)vaddr2fmap(slot_vaddr);
+
+		auto *tgt = resolve_gip(slot->gip);
+		if (!tgt) {
+			continue;
+		}
+		// Link as if the image was mapped at fmap, rel32 does not depend on load address
+		slot->Link((u8 *)slot + (tgt->aot_vaddr - slot_vaddr));
+		n_linked++;
+	}
+	log_aot("linked %zu of %zu branch slots", n_linked, n_brslots);
+}
+
+void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols, bool precise_faults)
 {
 	auto obj_path = objprof::GetCachePath(AOT_O_EXTENSION);
 	auto aot_path = objprof::GetCachePath(AOT_SO_EXTENSION);
@@ -124,6 +206,7 @@ void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols)
 	}
 
 	elfio::section *sym_sec = nullptr;
+	elfio::section *brslots_sec = nullptr;
 
 	for (const auto &section : elf.sections) {
 		auto test_sec = [&section](elfio::section **res, elfio::Elf_Word type, char const *name) {
@@ -133,6 +216,7 @@ void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols)
 			}
 		};
 		test_sec(&sym_sec, elfio::SHT_SYMTAB, ".symtab");
+		test_sec(&brslots_sec, elfio::SHT_PROGBITS, AOT_SEC_BRSLOTS);
 	}
 
 	elfio::symbol_section_accessor syma(elf, sym_sec);
@@ -166,16 +250,19 @@ void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols)
 
 	for (u64 idx = 0; idx < aottab_sz; ++idx) {
 		auto gip = aottab->sym[idx].gip;
-		aottab_res->sym[idx] = {gip, resolve_sym(MakeAotSymbol(gip)).first};
+		aottab_res->sym[idx] = {.gip = gip, .aot_vaddr = resolve_sym(MakeAotSymbol(gip)).first};
 	}
 #else
 	for (auto &sym : aot_symbols) {
-		auto gip = sym.gip;
-		// log_aot("found aottab[%08x]", gip);
-		sym = {gip, resolve_sym(MakeAotSymbol(gip)).first};
+		// log_aot("found aottab[%08x]", sym.gip);
+		sym.aot_vaddr = resolve_sym(MakeAotSymbol(sym.gip)).first;
 	}
+	// Lookup structure for tcache, used in-place at boot
+	std::sort(aot_symbols.begin(), aot_symbols.end(),
+		  [](auto const &a, auto const &b) { return a.gip < b.gip; });
 	AOTTabHeader aottab_header;
 	aottab_header.n_sym = aot_symbols.size();
+	aottab_header.precise_faults = precise_faults;
 
 	size_t aottab_offs;
 	{
@@ -223,6 +310,9 @@ void LinkAOTObject(std::vector<AOTSymbol> &aot_symbols)
 				phdr->p_flags |= elfio::PF_W;
 			}
 		}
+		if (brslots_sec) {
+			LinkAOTBranchSlots(elf, brslots_sec, aot_symbols, (u8 *)fmap);
+		}
 		munmap(fmap, st.st_size);
 	}
 
@@ -300,4 +300,38 @@ std::vector<std::vector<ModuleGraphNode *>> ModuleGraph::ComputeRegions()
 	return regions;
 }
 
+qir::CompilerJob::LiveInMap ModuleGraph::ComputeLiveness()
+{
+	auto const live_out = [](ModuleGraphNode *n) {
+		if (n->flags.is_brind_source || n->flags.is_crosssegment_br) {
+			return GREGS_ALL;
+		}
+		u32 live = 0;
+		for (auto s : n->succs) {
+			live |= s->greg_livein;
+		}
+		return live;
+	};
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto it = ip_map.rbegin(); it != ip_map.rend(); ++it) {
+			auto n = it->second.get();
+			u32 livein = (n->greg_use | (live_out(n) & ~n->greg_def)) & GREGS_ALL;
+			if (livein != n->greg_livein) {
+				n->greg_livein = livein;
+				changed = true;
+			}
+		}
+	}
+
+	qir::CompilerJob::LiveInMap res;
+	for (auto const &e : ip_map) {
+		res.insert({e.first, e.second->greg_livein});
+		log_aot("livein %08x: %08x", e.first, e.second->greg_livein);
+	}
+	return res;
+}
+
 } // namespace dbt
@@ -3,6 +3,7 @@
 #include "dbt/qmc/compile.h"
 #include "dbt/qmc/marker.h"
 #include "dbt/util/logger.h"
+#include <array>
 #include <map>
 #include <memory>
 #include <set>
@@ -40,6 +41,11 @@ struct ModuleGraphNode {
 
 	ModuleGraphNode *link{};
 
+	// Guest register masks: read before written, written, live at entry
+	u32 greg_use{0};
+	u32 greg_def{0};
+	u32 greg_livein{0};
+
 	std::vector<ModuleGraphNode *> succs;
 	std::vector<ModuleGraphNode *> preds;
 
@@ -126,12 +132,24 @@ struct ModuleGraph {
 		GetNode(ip)->link = GetNode(linkip);
 	}
 
+	void RecordGRegRef(u8 reg)
+	{
+		greg_refs[reg]++;
+	}
+
+	static void RecordGRegUseDef(ModuleGraphNode *node, u32 use, u32 def)
+	{
+		node->greg_use |= use & ~node->greg_def;
+		node->greg_def |= def;
+	}
+
 	void ComputeDomTree();
 	void ComputeDomFrontier();
 	void ComputeRegionIDF();
 	std::vector<std::vector<ModuleGraphNode *>> ComputeRegionDomSets();
 
 	std::vector<std::vector<ModuleGraphNode *>> ComputeRegions();
+	qir::CompilerJob::LiveInMap ComputeLiveness();
 	void Dump(FILE *f, std::vector<std::vector<ModuleGraphNode *>> const *regions = nullptr);
 
 	qir::CodeSegment segment;
@@ -142,6 +160,11 @@ struct ModuleGraph {
 	RegionMap ip_map;
 
 	qir::MarkerKeeper markers;
+
+	// Static guest register references in analysed code
+	static constexpr u8 MAX_GREGS = 32;
+	static constexpr u32 GREGS_ALL = ~(u32)1;
+	std::array<u32, MAX_GREGS> greg_refs{};
 };
 
 void InitModuleGraphDump(char const *dir);
@@ -5,6 +5,7 @@
 #include "dbt/tcache/objprof.h"
 
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/MC/SubtargetFeature.h"
 #include "llvm/MC/TargetRegistry.h"
@@ -16,6 +17,12 @@
 #include "llvm/Target/TargetIntrinsicInfo.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/DeadStoreElimination.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
 
 namespace dbt
 {
@@ -38,6 +45,16 @@ struct LLVMAOTCompilerRuntime final : CompilerRuntime {
 	{
 		unreachable("");
 	}
+
+	void AnnounceBranchSlot(void *slot) override
+	{
+		unreachable("");
+	}
+
+	void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) override
+	{
+		unreachable("");
+	}
 };
 
 static void DeclareKnownRegionEntries(qir::LLVMGenCtx *ctx, objprof::PageData const &page)
@@ -56,11 +73,38 @@ static void DeclareKnownRegionEntries(qir::LLVMGenCtx *ctx, objprof::PageData co
 	}
 }
 
-static void LLVMAOTTranslatePage(qir::LLVMGenCtx *ctx, std::vector<AOTSymbol> *aot_symbols,
-				 objprof::PageData const &page)
+// Most referenced guest gprs in profiled code
+static std::vector<u16> SelectHotRegs(std::vector<ModuleGraph> const &mgs, uint n_hot)
+{
+	std::array<u64, ModuleGraph::MAX_GREGS> refs{};
+	for (auto const &mg : mgs) {
+		for (uint r = 0; r < refs.size(); ++r) {
+			refs[r] += mg.greg_refs[r];
+		}
+	}
+
+	std::vector<u8> regs;
+	for (u8 r = 1; r < CPUState::gpr_num; ++r) { // x0 is constant
+		if (refs[r]) {
+			regs.push_back(r);
+		}
+	}
+	std::stable_sort(regs.begin(), regs.end(), [&](u8 a, u8 b) { return refs[a] > refs[b]; });
+	regs.resize(std::min<size_t>(regs.size(), n_hot));
+
+	std::vector<u16> state_offs;
+	for (auto r : regs) {
+		log_aot("hot reg x%u: %lu refs", r, refs[r]);
+		state_offs.push_back(offsetof(CPUState, gpr) + sizeof(CPUState::gpr_t) * r);
+	}
+	return state_offs;
+}
+
+static void LLVMAOTTranslateModule(qir::LLVMGenCtx *ctx, std::vector<AOTSymbol> *aot_symbols,
+				   ModuleGraph &mg)
 {
-	auto mg = BuildModuleGraph(page);
 	auto regions = mg.ComputeRegions();
+	auto livein = mg.ComputeLiveness();
 
 	for (auto const &r : regions) {
 		ctx->AddFunction(r[0]->ip, mg.segment);
@@ -75,7 +119,9 @@ static void LLVMAOTTranslatePage(qir::LLVMGenCtx *ctx, std::vector<AOTSymbol> *a
 
 		auto aotrt = LLVMAOTCompilerRuntime{};
 
+		u32 gip_end = GetRegionGipEnd(ipranges);
 		qir::CompilerJob job(&aotrt, (uptr)mmu::base, mg.segment, std::move(ipranges));
+		job.gregs_livein = &livein;
 
 		auto arena = MemArena(1_MB);
 		auto *region = qir::CompilerGenRegionIR(&arena, job);
@@ -83,7 +129,7 @@ static void LLVMAOTTranslatePage(qir::LLVMGenCtx *ctx, std::vector<AOTSymbol> *a
 		auto entry_ip = r[0]->ip;
 		qir::QIRToLLVM llvm_gen(*ctx, &mg.segment, region, entry_ip);
 		llvm_gen.Run();
-		aot_symbols->push_back({entry_ip, 0});
+		aot_symbols->push_back({.gip = entry_ip, .gip_end = gip_end});
 	}
 }
 
@@ -159,62 +205,99 @@ static void GenerateObjectFile(llvm::Module *cmodule, std::string const &filenam
 	dest.flush();
 }
 
-void LLVMAOTCompileELF()
+// Lifted GHC-cc code mostly needs state/vmem memory ops cleanup and intrinsics expansion, O3 is
+// too expensive for that
+static void AddCleanupPasses(llvm::FunctionPassManager &fpm)
 {
-	auto cmodule = llvm::Module("qcg_module", qir::g_llvm_ctx);
-	qir::LLVMGenCtx ctx(&cmodule);
-
-	std::vector<AOTSymbol> aot_symbols;
-	aot_symbols.reserve(64_KB);
+	fpm.addPass(llvm::SROAPass());
+	fpm.addPass(llvm::EarlyCSEPass(true));
+	fpm.addPass(llvm::InstCombinePass());
+	fpm.addPass(llvm::SimplifyCFGPass());
+	fpm.addPass(llvm::GVNPass());
+	fpm.addPass(llvm::DSEPass());
+	fpm.addPass(llvm::InstCombinePass());
+	fpm.addPass(llvm::SimplifyCFGPass());
+}
 
-	for (auto const &page : objprof::GetProfile()) {
-		DeclareKnownRegionEntries(&ctx, page);
-	}
-	for (auto const &page : objprof::GetProfile()) {
-		LLVMAOTTranslatePage(&ctx, &aot_symbols, page);
-	}
-	assert(!verifyModule(cmodule, &llvm::errs()));
+static void OptimizeModule(llvm::Module &cmodule, qir::LLVMGenCtx &ctx, LLVMAOTOptions const &opts)
+{
+	llvm::PassInstrumentationCallbacks pic;
+	llvm::TimePassesHandler time_passes(opts.time_passes);
+	time_passes.registerCallbacks(pic);
 
 	llvm::LoopAnalysisManager lam;
 	llvm::FunctionAnalysisManager fam;
 	llvm::CGSCCAnalysisManager cgam;
 	llvm::ModuleAnalysisManager mam;
 
-	llvm::PassBuilder pb;
+	llvm::PassBuilder pb(nullptr, llvm::PipelineTuningOptions(), llvm::None, &pic);
 	pb.registerModuleAnalyses(mam);
 	pb.registerCGSCCAnalyses(cgam);
 	pb.registerFunctionAnalyses(fam);
 	pb.registerLoopAnalyses(lam);
 	pb.crossRegisterProxies(lam, fam, cgam, mam);
 
-	auto optlevel = llvm::OptimizationLevel::O3;
+	auto run_pipeline = [&](bool is_final) {
+		llvm::FunctionPassManager fpm;
+		if (is_final) {
+			fpm.addPass(qir::IntrinsicExpansionPass(ctx, true));
+			AddCleanupPasses(fpm);
+		} else {
+			AddCleanupPasses(fpm);
+			fpm.addPass(qir::IntrinsicExpansionPass(ctx, false));
+		}
+		if constexpr (config::debug) {
+			fpm.addPass(llvm::VerifierPass());
+		}
+		llvm::ModulePassManager mpm;
+		mpm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+
+		u64 expanded_before = ctx.n_intrin_expanded;
+		mpm.run(cmodule, mam);
+		return ctx.n_intrin_expanded - expanded_before;
+	};
+
+	// Expansion of gbrind exposes new constants, stop at fixed point
+	static constexpr uint max_iterations = 8;
+	for (uint i = 0; i < max_iterations; ++i) {
+		auto n_expanded = run_pipeline(false);
+		log_aot("Optimize+expand iteration %u: %lu intrinsics expanded", i, n_expanded);
+		if (!n_expanded) {
+			break;
+		}
+	}
+	log_aot("Run final expansion pipeline");
+	run_pipeline(true);
 
-	llvm::ModulePassManager mpm_final_expand;
-	mpm_final_expand.addPass(
-	    llvm::createModuleToFunctionPassAdaptor(qir::IntrinsicExpansionPass(ctx, true)));
-	if constexpr (config::debug) {
-		mpm_final_expand.addPass(llvm::VerifierPass());
+	if (opts.time_passes) {
+		time_passes.print();
 	}
+}
 
-	pb.registerOptimizerEarlyEPCallback([&](llvm::ModulePassManager &mpm, llvm::OptimizationLevel optl) {
-		mpm.addPass(llvm::createModuleToFunctionPassAdaptor(qir::IntrinsicExpansionPass(ctx, false)));
-		if constexpr (config::debug) {
-			mpm.addPass(llvm::VerifierPass());
-		}
-	});
+void LLVMAOTCompileELF(LLVMAOTOptions const &opts)
+{
+	auto cmodule = llvm::Module("qcg_module", qir::g_llvm_ctx);
+	qir::LLVMGenCtx ctx(&cmodule);
 
-	static constexpr uint n_expands = 4;
+	std::vector<AOTSymbol> aot_symbols;
+	aot_symbols.reserve(64_KB);
 
-	for (int i = 0; i < n_expands; ++i) {
-		if (i == n_expands - 1) {
-			log_aot("Run final expansion pipeline");
-			mpm_final_expand.run(cmodule, mam);
-		}
-		log_aot("Run optimize+expand pipeline");
-		// TODO: something breaks, invalidating all analyses dont help, create pipeline again
-		llvm::ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(optlevel);
-		mpm.run(cmodule, mam);
+	std::vector<ModuleGraph> mgs;
+	for (auto const &page : objprof::GetProfile()) {
+		mgs.push_back(BuildModuleGraph(page));
 	}
+	auto n_hot = std::min<uint>(opts.n_hot_regs, qir::LLVMGenCtx::MAX_HOT_REGS);
+	ctx.SetHotRegs(SelectHotRegs(mgs, n_hot));
+
+	for (auto const &page : objprof::GetProfile()) {
+		DeclareKnownRegionEntries(&ctx, page);
+	}
+	for (auto &mg : mgs) {
+		LLVMAOTTranslateModule(&ctx, &aot_symbols, mg);
+	}
+	assert(!verifyModule(cmodule, &llvm::errs()));
+
+	OptimizeModule(cmodule, ctx, opts);
 
 	// cmodule.print(llvm::errs(), nullptr);
 	AddAOTTabSection(cmodule, aot_symbols);
@@ -222,7 +305,7 @@ void LLVMAOTCompileELF()
 	auto obj_path = objprof::GetCachePath(AOT_O_EXTENSION);
 	GenerateObjectFile(&cmodule, obj_path);
 	// ProcessLLVMStackmaps(aot_symbols);
-	LinkAOTObject(aot_symbols);
+	LinkAOTObject(aot_symbols, false);
 }
 
 } // namespace dbt
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "dbt/util/common.h"
+#include <utility>
 
 extern "C" {
 #include <sys/mman.h>
@@ -71,6 +72,13 @@ struct MemArena {
 		return pool;
 	}
 
+	friend void swap(MemArena &a, MemArena &b)
+	{
+		std::swap(a.pool, b.pool);
+		std::swap(a.pool_sz, b.pool_sz);
+		std::swap(a.used, b.used);
+	}
+
 private:
 	u8 *pool{nullptr};
 	size_t pool_sz{0};
@@ -0,0 +1,638 @@
+#include "dbt/aot/aot.h"
+#include "dbt/execute.h"
+#include "dbt/guest/rv32_cpu.h"
+#include "dbt/qmc/qcg/jitabi.h"
+#include "dbt/tcache/objprof.h"
+#include "dbt/tcache/tcache.h"
+#include "dbt/ukernel.h"
+#include "dbt/util/fsmanager.h"
+#include "dbt/util/stats.h"
+#include <boost/any.hpp>
+#include <boost/program_options.hpp>
+#include <boost/tokenizer.hpp>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <vector>
+
+namespace bpo = boost::program_options;
+using namespace dbt;
+
+struct BenchOptions {
+	std::string elf{};
+	std::string cache{};
+	std::string filter{};
+	std::string out{};
+	std::string baseline{};
+	double threshold{};
+	unsigned reps{};
+	std::string logs{};
+};
+
+static void PrintHelp(bpo::options_description &adesc)
+{
+	std::cout << "usage: [options]\n";
+	std::cout << adesc << "\n";
+}
+
+static bool ParseOptions(BenchOptions &o, int argc, char **argv)
+{
+	bpo::options_description adesc("options");
+	// clang-format off
+	adesc.add_options()
+	    ("help",   "help")
+	    ("logs",   bpo::value(&o.logs)->default_value(""), "enabled log streams separated by :")
+	    ("elf",    bpo::value(&o.elf)->default_value(""), "guest elf for compile and aot boot benchmarks")
+	    ("cache",  bpo::value(&o.cache)->default_value(""), "dbt cache with the elf .prof and .aot.so")
+	    ("filter", bpo::value(&o.filter)->default_value(""), "run benchmarks with names containing it")
+	    ("reps",   bpo::value(&o.reps)->default_value(7), "repetitions, the median is reported")
+	    ("out",    bpo::value(&o.out)->default_value(""), "json results path, stdout by default")
+	    ("baseline", bpo::value(&o.baseline)->default_value(""), "json results to compare with")
+	    ("threshold", bpo::value(&o.threshold)->default_value(5.0), "regression threshold, percent");
+	// clang-format on
+
+	try {
+		bpo::variables_map vmap;
+		bpo::store(bpo::parse_command_line(argc, argv, adesc), vmap);
+		if (vmap.count("help")) {
+			PrintHelp(adesc);
+			return false;
+		}
+		bpo::notify(vmap);
+	} catch (std::exception &e) {
+		std::cerr << "Bad options: " << e.what() << "\n";
+		PrintHelp(adesc);
+		return false;
+	}
+	if (!o.elf.empty() && o.cache.empty()) {
+		std::cerr << "Bad options: --elf requires --cache\n";
+		return false;
+	}
+	if (o.reps == 0) {
+		o.reps = 1;
+	}
+	return true;
+}
+
+static void SetupLogger(std::string const &logopt)
+{
+	boost::char_separator sep(":");
+	boost::tokenizer tok(logopt, sep);
+	for (auto const &e : tok) {
+		dbt::Logger::enable(e.c_str());
+	}
+}
+
+// Minimal rv32i encoder for the synthetic guest corpus
+namespace rvasm
+{
+enum Reg : u32 {
+	zero = 0,
+	ra = 1,
+	t0 = 5,
+	a0 = 10,
+	a1 = 11,
+	a2 = 12,
+	a3 = 13,
+};
+
+static constexpr u32 I(u32 op, u32 f3, u32 rd, u32 rs1, i32 imm)
+{
+	return ((u32)imm & 0xfff) << 20 | rs1 << 15 | f3 << 12 | rd << 7 | op;
+}
+static constexpr u32 R(u32 f3, u32 f7, u32 rd, u32 rs1, u32 rs2)
+{
+	return f7 << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 | rd << 7 | 0x33;
+}
+static constexpr u32 S(u32 f3, u32 rs1, u32 rs2, i32 imm)
+{
+	u32 i = imm;
+	return (i >> 5 & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 | (i & 0x1f) << 7 | 0x23;
+}
+static constexpr u32 B(u32 f3, u32 rs1, u32 rs2, i32 imm)
+{
+	u32 i = imm;
+	return (i >> 12 & 1) << 31 | (i >> 5 & 0x3f) << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 |
+	       (i >> 1 & 0xf) << 8 | (i >> 11 & 1) << 7 | 0x63;
+}
+
+static constexpr u32 addi(Reg rd, Reg rs1, i32 imm)
+{
+	return I(0x13, 0, rd, rs1, imm);
+}
+static constexpr u32 slli(Reg rd, Reg rs1, u32 sh)
+{
+	return I(0x13, 1, rd, rs1, sh);
+}
+static constexpr u32 srli(Reg rd, Reg rs1, u32 sh)
+{
+	return I(0x13, 5, rd, rs1, sh);
+}
+static constexpr u32 add(Reg rd, Reg rs1, Reg rs2)
+{
+	return R(0, 0, rd, rs1, rs2);
+}
+static constexpr u32 xor_(Reg rd, Reg rs1, Reg rs2)
+{
+	return R(4, 0, rd, rs1, rs2);
+}
+static constexpr u32 lw(Reg rd, Reg rs1, i32 imm)
+{
+	return I(0x03, 2, rd, rs1, imm);
+}
+static constexpr u32 sw(Reg rs2, Reg rs1, i32 imm)
+{
+	return S(2, rs1, rs2, imm);
+}
+static constexpr u32 auipc(Reg rd, u32 imm20)
+{
+	return imm20 << 12 | rd << 7 | 0x17;
+}
+static constexpr u32 jalr(Reg rd, Reg rs1, i32 imm)
+{
+	return I(0x67, 0, rd, rs1, imm);
+}
+static constexpr u32 bne(Reg rs1, Reg rs2, i32 imm)
+{
+	return B(1, rs1, rs2, imm);
+}
+static constexpr u32 ebreak()
+{
+	return 0x00100073;
+}
+} // namespace rvasm
+
+// Loops counting down a0, terminated by ebreak
+struct GuestKernel {
+	char const *name;
+	std::vector<u32> code;
+	u32 iters;
+	u32 ops_per_iter;
+	u32 gip{};
+};
+
+static constexpr u32 CORPUS_DATA_SIZE = 256_KB;
+
+static std::vector<GuestKernel> MakeCorpus()
+{
+	using namespace rvasm;
+	std::vector<GuestKernel> res;
+	// clang-format off
+	// Call and return through jalr, two gbrind per iteration
+	res.push_back({"brind", {
+		auipc(t0, 0),
+		jalr(ra, t0, 20),
+		addi(a0, a0, -1),
+		bne(a0, zero, -12),
+		ebreak(),
+		jalr(zero, ra, 0),
+	}, 1u << 22, 2});
+	res.push_back({"alu", {
+		add(a1, a1, a0),
+		xor_(a2, a1, a0),
+		slli(a3, a2, 3),
+		srli(a2, a3, 5),
+		add(a1, a1, a2),
+		addi(a0, a0, -1),
+		bne(a0, zero, -24),
+		ebreak(),
+	}, 1u << 22, 1});
+	// a1 - src, a2 - dst
+	res.push_back({"memcpy", {
+		lw(t0, a1, 0),
+		sw(t0, a2, 0),
+		addi(a1, a1, 4),
+		addi(a2, a2, 4),
+		addi(a0, a0, -1),
+		bne(a0, zero, -20),
+		ebreak(),
+	}, CORPUS_DATA_SIZE / 4, 1});
+	// clang-format on
+	return res;
+}
+
+// The corpus is mapped into guest memory and runs on the main thread
+struct GuestCorpus {
+	GuestCorpus()
+	{
+		kernels = MakeCorpus();
+		auto *code = (u32 *)mmu::mmap(0, mmu::PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+					      MAP_ANON | MAP_PRIVATE);
+		auto *data =
+		    mmu::mmap(0, CORPUS_DATA_SIZE * 2, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE);
+		if (code == MAP_FAILED || data == MAP_FAILED) {
+			Panic("dbtbench: guest mmap failed");
+		}
+		u32 offs = 0;
+		for (auto &k : kernels) {
+			k.gip = mmu::h2g(code + offs);
+			std::copy(k.code.begin(), k.code.end(), code + offs);
+			offs += roundup(k.code.size(), 4);
+		}
+		src = mmu::h2g(data);
+		dst = src + CORPUS_DATA_SIZE;
+		CPUState::SetCurrent(&state);
+	}
+
+	~GuestCorpus()
+	{
+		CPUState::SetCurrent(nullptr);
+	}
+
+	// Runs in translated code until ebreak
+	void Run(GuestKernel const &k, u32 iters)
+	{
+		state.ip = k.gip;
+		state.gpr[rvasm::a0] = iters;
+		state.gpr[rvasm::a1] = src;
+		state.gpr[rvasm::a2] = dst;
+		dbt::Execute(&state);
+		if (state.trapno != rv32::TrapCode::EBREAK) {
+			Panic("dbtbench: unexpected guest trap");
+		}
+		state.trapno = rv32::TrapCode::NONE;
+	}
+
+	std::vector<GuestKernel> kernels;
+	u32 src{};
+	u32 dst{};
+	CPUState state{nullptr};
+};
+
+// Elapsed ns and the number of operations of one repetition
+using RepResult = std::pair<u64, u64>;
+
+struct Bench {
+	std::string name;
+	char const *unit; // ns/op, or <op>/s for rates
+	std::function<RepResult()> rep;
+	unsigned reps{}; // 0 - as requested
+};
+
+struct BenchResult {
+	std::string name;
+	char const *unit;
+	double median;
+	double best;
+	unsigned reps;
+};
+
+static bool IsRate(char const *unit)
+{
+	return std::string_view(unit).ends_with("/s");
+}
+
+static BenchResult RunBench(Bench const &b, unsigned reps)
+{
+	if (b.reps) {
+		reps = b.reps;
+	}
+	std::vector<double> vals;
+	for (unsigned i = 0; i < reps; ++i) {
+		auto [ns, ops] = b.rep();
+		ns = std::max<u64>(ns, 1);
+		vals.push_back(IsRate(b.unit) ? 1e9 * ops / ns : (double)ns / std::max<u64>(ops, 1));
+	}
+	std::sort(vals.begin(), vals.end());
+	double best = IsRate(b.unit) ? vals.back() : vals.front();
+	return {b.name, b.unit, vals[vals.size() / 2], best, reps};
+}
+
+static u64 volatile g_sink;
+
+// Guest ips never backed by memory, lookups of them don't translate
+static constexpr u32 FAKE_IP_BASE = 0xf0000000;
+static constexpr u32 LOOKUP_TBS = 1u << tcache::L1_CACHE_BITS;
+static constexpr u32 L1_ALIAS = LOOKUP_TBS * 4; // same l1hash
+
+static TBlock *InsertFakeRegion(u32 ip)
+{
+	static u8 fake_code[1];
+	auto tb = tcache::AllocateTBlock();
+	if (tb == nullptr) {
+		Panic();
+	}
+	tb->ip = ip;
+	tb->tcode = TBlock::TCode{fake_code, sizeof(fake_code)};
+	tcache::Insert(tb);
+	return tb;
+}
+
+static RepResult LookupBench(bool aliased)
+{
+	for (u32 i = 0; i < LOOKUP_TBS; ++i) {
+		InsertFakeRegion(FAKE_IP_BASE + i * 4);
+		if (aliased) {
+			InsertFakeRegion(FAKE_IP_BASE + L1_ALIAS + i * 4);
+		}
+	}
+	// Aliasing pairs evict each other from l1_cache, every lookup takes the locked map path
+	u64 const n = 16 * LOOKUP_TBS;
+	uptr sink = 0;
+	u64 start = stats::NowNs();
+	for (u64 i = 0; i < n; ++i) {
+		u32 ip = FAKE_IP_BASE + (i / 2 % LOOKUP_TBS) * 4;
+		if (aliased && (i & 1)) {
+			ip += L1_ALIAS;
+		}
+		sink += (uptr)tcache::Lookup(ip);
+	}
+	u64 ns = stats::NowNs() - start;
+	g_sink = sink;
+	tcache::Invalidate();
+	return {ns, n};
+}
+
+static RepResult InvalidatePageBench()
+{
+	u32 const n = 64;
+	u64 ns = 0;
+	for (u32 i = 0; i < n; ++i) {
+		for (u32 ip = FAKE_IP_BASE; ip < FAKE_IP_BASE + mmu::PAGE_SIZE; ip += 4) {
+			InsertFakeRegion(ip);
+		}
+		u64 start = stats::NowNs();
+		tcache::InvalidatePage(FAKE_IP_BASE);
+		ns += stats::NowNs() - start;
+	}
+	tcache::Invalidate();
+	return {ns, n};
+}
+
+// Link to a region and back to the lazy stub, as InvalidatePage does
+static RepResult BranchSlotBench()
+{
+	using jitabi::ppoint::BranchSlot;
+	u32 const n_slots = 1024;
+	u32 const n = 64 * n_slots;
+	auto *slots = (u8 *)tcache::AllocateCode(n_slots * sizeof(BranchSlot), 16);
+	auto *tgt = tcache::AllocateCode(16, 16);
+	auto slot_at = [slots](u32 idx) { return (BranchSlot *)(slots + idx * sizeof(BranchSlot)); };
+	for (u32 i = 0; i < n_slots; ++i) {
+		slot_at(i)->gip = FAKE_IP_BASE;
+		slot_at(i)->LinkLazyJIT();
+	}
+	u64 start = stats::NowNs();
+	for (u32 i = 0; i < n; ++i) {
+		auto *slot = slot_at(i % n_slots);
+		slot->Link(tgt);
+		slot->LinkLazyJIT();
+	}
+	u64 ns = stats::NowNs() - start;
+	tcache::Invalidate();
+	return {ns, n};
+}
+
+static RepResult MmapBench()
+{
+	u32 const n = 4096;
+	u32 const len = 64_KB;
+	u64 start = stats::NowNs();
+	for (u32 i = 0; i < n; ++i) {
+		void *p = mmu::mmap(0, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE);
+		if (p == MAP_FAILED || mmu::munmap(mmu::h2g(p), len) < 0) {
+			Panic("dbtbench: mmu::mmap failed");
+		}
+	}
+	return {stats::NowNs() - start, n};
+}
+
+// The first run translates and links the regions, dispatch goes through gbrind for brind
+static RepResult ExecBench(GuestCorpus &corpus, GuestKernel const &k)
+{
+	corpus.Run(k, 16);
+	u64 start = stats::NowNs();
+	corpus.Run(k, k.iters);
+	u64 ns = stats::NowNs() - start;
+	tcache::Invalidate();
+	return {ns, (u64)k.iters * k.ops_per_iter};
+}
+
+// Compiles regions without inserting them into tcache
+struct BenchCompilerRuntime final : CompilerRuntime {
+	void *AllocateCode(size_t sz, uint align) override
+	{
+		return tcache::AllocateCode(sz, align);
+	}
+
+	bool AllowsRelocation() const override
+	{
+		return false;
+	}
+
+	void *AnnounceRegion(u32 ip, std::span<u8> const &code) override
+	{
+		return nullptr;
+	}
+
+	void AnnounceBranchSlot(void *slot) override {}
+
+	void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) override {}
+};
+
+struct CompileJobDesc {
+	qir::CodeSegment segment;
+	qir::CompilerJob::IpRangesSet iprange;
+	qir::CompilerJob::LiveInMap const *livein;
+};
+
+static RepResult CompileBench(std::vector<CompileJobDesc> const &jobs)
+{
+	BenchCompilerRuntime rt;
+	u64 start = stats::NowNs();
+	for (auto const &d : jobs) {
+		auto iprange = d.iprange;
+		qir::CompilerJob job(&rt, (uptr)mmu::base, d.segment, std::move(iprange));
+		job.gregs_livein = d.livein;
+		qir::CompilerDoJob(job);
+	}
+	u64 ns = stats::NowNs() - start;
+	tcache::Invalidate(); // reclaim code_pool
+	return {ns, jobs.size()};
+}
+
+static std::vector<Bench> CorpusBenches(GuestCorpus &corpus)
+{
+	std::vector<Bench> res;
+	res.push_back({"tcache_lookup_l1hit", "ns/op", [] { return LookupBench(false); }});
+	res.push_back({"tcache_lookup_l1miss", "ns/op", [] { return LookupBench(true); }});
+	res.push_back({"tcache_invalidate_page", "ns/op", InvalidatePageBench});
+	res.push_back({"branch_slot_relink", "ns/op", BranchSlotBench});
+	res.push_back({"mmu_mmap_munmap", "ns/op", MmapBench});
+
+	std::vector<CompileJobDesc> jobs;
+	for (auto const &k : corpus.kernels) {
+		res.push_back({std::string("exec_") + k.name, "ns/op", [&] { return ExecBench(corpus, k); }});
+
+		// Every instruction starts a region, as JIT entries after branches do
+		u32 end = k.gip + k.code.size() * 4;
+		qir::CodeSegment segment(rounddown(k.gip, mmu::PAGE_SIZE), mmu::PAGE_SIZE);
+		for (u32 ip = k.gip; ip < end; ip += 4) {
+			jobs.push_back({segment, {{ip, end}}, nullptr});
+		}
+	}
+	res.push_back({"compile_corpus", "regions/s", [jobs] { return CompileBench(jobs); }});
+	return res;
+}
+
+// Regions are formed from the .prof as elfaot does
+static std::vector<Bench> ElfBenches()
+{
+	std::vector<Bench> res;
+	static std::vector<qir::CompilerJob::LiveInMap> liveins;
+
+	if (objprof::HasProfile()) {
+		auto profile = objprof::GetProfile();
+		std::vector<CompileJobDesc> jobs;
+		liveins.reserve(profile.size());
+		for (auto const &page : profile) {
+			auto mg = BuildModuleGraph(page);
+			liveins.push_back(mg.ComputeLiveness());
+			for (auto const &r : mg.ComputeRegions()) {
+				qir::CompilerJob::IpRangesSet ipranges;
+				for (auto n : r) {
+					ipranges.push_back({n->ip, n->ip_end});
+				}
+				jobs.push_back({mg.segment, std::move(ipranges), &liveins.back()});
+			}
+		}
+		res.push_back({"compile_elf", "regions/s", [jobs] { return CompileBench(jobs); }});
+	} else {
+		std::cerr << "no profile for the elf, compile_elf skipped\n";
+	}
+
+	// dlopen of the same image is cached, only the first boot is meaningful
+	if (access(objprof::GetCachePath(AOT_SO_EXTENSION).c_str(), R_OK) == 0) {
+		auto boot = [] {
+			u64 start = stats::NowNs();
+			BootAOTFile();
+			return RepResult{stats::NowNs() - start, 1};
+		};
+		res.push_back({"aot_boot", "ns/op", boot, 1});
+	} else {
+		std::cerr << "no aot image for the elf, aot_boot skipped\n";
+	}
+	return res;
+}
+
+// Sorted by name, one result per line, so saved files diff well
+static void WriteJSON(std::ostream &os, std::vector<BenchResult> const &results)
+{
+	char buf[256];
+	os << "{\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto const &r = results[i];
+		snprintf(buf, sizeof(buf),
+			 "\t\t{\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.3f, \"best\": %.3f, "
+			 "\"reps\": %u}%s\n",
+			 r.name.c_str(), r.unit, r.median, r.best, r.reps, i + 1 < results.size() ? "," : "");
+		os << buf;
+	}
+	os << "\t]\n}\n";
+}
+
+static std::map<std::string, double> ReadBaseline(std::string const &path)
+{
+	std::ifstream is(path);
+	if (!is) {
+		Panic("dbtbench: can't read baseline " + path);
+	}
+	static std::regex const entry_re(R"re("name": "([^"]+)".*"median": ([0-9.eE+-]+))re");
+	std::map<std::string, double> res;
+	std::smatch m;
+	for (std::string line; std::getline(is, line);) {
+		if (std::regex_search(line, m, entry_re)) {
+			res[m[1]] = std::stod(m[2]);
+		}
+	}
+	return res;
+}
+
+// Returns false if some benchmark regressed beyond the threshold
+static bool CompareBaseline(std::vector<BenchResult> const &results, std::string const &path,
+			    double threshold)
+{
+	auto base = ReadBaseline(path);
+	bool ok = true;
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%-28s %14s %14s %9s\n", "benchmark", "baseline", "current", "change");
+	std::cerr << buf;
+	for (auto const &r : results) {
+		auto it = base.find(r.name);
+		if (it == base.end() || it->second == 0) {
+			snprintf(buf, sizeof(buf), "%-28s %14s %14.3f %9s\n", r.name.c_str(), "-", r.median,
+				 "new");
+			std::cerr << buf;
+			continue;
+		}
+		// Positive is worse
+		double change = 100.0 * (r.median - it->second) / it->second;
+		if (IsRate(r.unit)) {
+			change = -change;
+		}
+		bool regressed = change > threshold;
+		ok &= !regressed;
+		snprintf(buf, sizeof(buf), "%-28s %14.3f %14.3f %+8.2f%%%s\n", r.name.c_str(), it->second,
+			 r.median, change, regressed ? "  REGRESSION" : "");
+		std::cerr << buf;
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opts;
+	if (!ParseOptions(opts, argc, argv)) {
+		return 1;
+	}
+	SetupLogger(opts.logs);
+
+	if (!opts.cache.empty()) {
+		dbt::fsmanager::Init(opts.cache.c_str());
+		dbt::objprof::Init(opts.cache.c_str(), false);
+	}
+	dbt::mmu::Init();
+	dbt::tcache::Init();
+
+	std::vector<Bench> benches;
+	if (!opts.elf.empty()) {
+		// Before the corpus takes guest memory the elf wants
+		dbt::ukernel::ReproduceElfMappings(opts.elf.c_str());
+		benches = ElfBenches();
+	}
+	GuestCorpus corpus;
+	auto corpus_benches = CorpusBenches(corpus);
+	// aot_boot attaches the image, it goes last
+	benches.insert(benches.begin(), corpus_benches.begin(), corpus_benches.end());
+
+	std::vector<BenchResult> results;
+	for (auto const &b : benches) {
+		if (b.name.find(opts.filter) == std::string::npos) {
+			continue;
+		}
+		std::cerr << "running " << b.name << "\n";
+		results.push_back(RunBench(b, opts.reps));
+	}
+	auto by_name = [](auto const &a, auto const &b) { return a.name < b.name; };
+	std::sort(results.begin(), results.end(), by_name);
+
+	if (opts.out.empty()) {
+		WriteJSON(std::cout, results);
+	} else {
+		std::ofstream os(opts.out);
+		WriteJSON(os, results);
+	}
+	bool ok = opts.baseline.empty() || CompareBaseline(results, opts.baseline, opts.threshold);
+
+	if (!opts.cache.empty()) {
+		dbt::fsmanager::Destroy();
+	}
+	if constexpr (dbt::config::debug) {
+		dbt::tcache::Destroy();
+		dbt::mmu::Destroy();
+	}
+	return ok ? 0 : 2;
+}
@@ -1,5 +1,6 @@
 #include "dbt/aot/aot.h"
 #include "dbt/guest/rv32_cpu.h"
+#include "dbt/guest/rv32_native.h"
 #include "dbt/tcache/objprof.h"
 #include "dbt/tcache/tcache.h"
 #include "dbt/ukernel.h"
@@ -15,8 +16,12 @@ struct ElfAotOptions {
 	std::string elf{};
 	std::string cache{};
 	bool use_llvm{};
+	bool llvm_time_passes{};
+	uint llvm_hot_regs{};
 	std::string logs{};
 	std::string mgdump{};
+	bool native{};
+	std::string native_optout{};
 };
 
 static void PrintHelp(bpo::options_description &adesc)
@@ -35,7 +40,13 @@ static bool ParseOptions(ElfAotOptions &o, int argc, char **argv)
 	    ("elf", bpo::value(&o.elf)->required(), "elf file to translate")
 	    ("cache",  bpo::value(&o.cache)->required(), "dbt cache path")
 	    ("llvm",    bpo::value(&o.use_llvm)->default_value(true), "use llvm backend")
-	    ("mgdump", bpo::value(&o.mgdump)->default_value(""), "module graphs dump dir, specify to enable");
+	    ("llvm-time-passes", bpo::value(&o.llvm_time_passes)->default_value(false),
+	     "report llvm pass timings")
+	    ("llvm-hot-regs", bpo::value(&o.llvm_hot_regs)->default_value(dbt::LLVMAOTOptions{}.n_hot_regs),
+	     "guest registers passed in host registers between llvm aot regions, max 8")
+	    ("mgdump", bpo::value(&o.mgdump)->default_value(""), "module graphs dump dir, specify to enable")
+	    ("native", bpo::value(&o.native)->default_value(false), "host libc and libgcc routines")
+	    ("native-optout", bpo::value(&o.native_optout)->default_value(""), "names separated by :");
 	// clang-format on
 
 	try {
@@ -78,11 +89,15 @@ int main(int argc, char **argv)
 	dbt::fsmanager::Init(opts.cache.c_str());
 	dbt::objprof::Init(opts.cache.c_str(), false);
 	dbt::mmu::Init();
+	dbt::NativeFunctions::Configure(opts.native, opts.native_optout, false);
 
 	dbt::ukernel::ReproduceElfMappings(opts.elf.c_str());
 
 	if (opts.use_llvm) {
-		dbt::LLVMAOTCompileELF();
+		dbt::LLVMAOTOptions llvm_opts;
+		llvm_opts.time_passes = opts.llvm_time_passes;
+		llvm_opts.n_hot_regs = opts.llvm_hot_regs;
+		dbt::LLVMAOTCompileELF(llvm_opts);
 	} else {
 		dbt::AOTCompileELF();
 	}
@@ -0,0 +1,364 @@
+#include "dbt/aot/aot.h"
+#include "dbt/guest/rv32_native.h"
+#include "dbt/qmc/compile.h"
+#include "dbt/qmc/llvmgen/llvmgen.h"
+#include "dbt/qmc/qcg/qcg.h"
+#include "dbt/qmc/qir.h"
+#include "dbt/tcache/objprof.h"
+#include "dbt/ukernel.h"
+#include "dbt/util/fsmanager.h"
+#include "dbt/util/stats.h"
+#include <boost/program_options.hpp>
+#include <boost/tokenizer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// Replays translation of every region recorded in the profile, as elfaot would compile it, and reports
+// per-pass compile costs. Nothing is executed or written to the cache.
+
+namespace bpo = boost::program_options;
+using namespace dbt;
+
+struct ElfReplayOptions {
+	std::string elf{};
+	std::string cache{};
+	bool use_llvm{};
+	uint threads{};
+	uint iters{};
+	bool regions{};
+	std::string logs{};
+	bool native{};
+	std::string native_optout{};
+};
+
+static void PrintHelp(bpo::options_description &adesc)
+{
+	std::cout << "usage: [options]\n";
+	std::cout << adesc << "\n";
+}
+
+static bool ParseOptions(ElfReplayOptions &o, int argc, char **argv)
+{
+	bpo::options_description adesc("options");
+	// clang-format off
+	adesc.add_options()
+	    ("help",   "help")
+	    ("logs",   bpo::value(&o.logs)->default_value(""), "enabled log streams separated by :")
+	    ("elf", bpo::value(&o.elf)->required(), "elf file with a recorded profile")
+	    ("cache",  bpo::value(&o.cache)->required(), "dbt cache path")
+	    ("llvm",    bpo::value(&o.use_llvm)->default_value(false), "replay qir to llvm ir translation")
+	    ("threads", bpo::value(&o.threads)->default_value(1), "compile regions in parallel")
+	    ("iters", bpo::value(&o.iters)->default_value(1), "replays, the best time of a region is taken")
+	    ("regions", bpo::value(&o.regions)->default_value(false), "report every region")
+	    ("native", bpo::value(&o.native)->default_value(false), "host libc and libgcc routines")
+	    ("native-optout", bpo::value(&o.native_optout)->default_value(""), "names separated by :");
+	// clang-format on
+
+	try {
+		bpo::variables_map vmap;
+		bpo::store(bpo::parse_command_line(argc, argv, adesc), vmap);
+		if (vmap.count("help")) {
+			PrintHelp(adesc);
+			return false;
+		}
+		bpo::notify(vmap);
+	} catch (std::exception &e) {
+		std::cerr << "Bad options: " << e.what() << "\n";
+		PrintHelp(adesc);
+		return false;
+	}
+	if (!o.threads || !o.iters) {
+		std::cerr << "Bad options: --threads and --iters must be positive\n";
+		return false;
+	}
+	return true;
+}
+
+static void SetupLogger(std::string const &logopt)
+{
+	boost::char_separator sep(":");
+	boost::tokenizer tok(logopt, sep);
+	for (auto const &e : tok) {
+		Logger::enable(e.c_str());
+	}
+}
+
+// Relocatable like the aot runtime, code is dropped after each region
+struct ReplayCompilerRuntime final : CompilerRuntime {
+	ReplayCompilerRuntime() : code_arena(16_MB) {}
+
+	void *AllocateCode(size_t sz, uint align) override
+	{
+		return code_arena.Allocate(sz, align);
+	}
+
+	bool AllowsRelocation() const override
+	{
+		return true;
+	}
+
+	void *AnnounceRegion(u32 ip, std::span<u8> const &code) override
+	{
+		return nullptr;
+	}
+
+	void AnnounceBranchSlot(void *slot) override {}
+
+	void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) override {}
+
+	MemArena code_arena;
+};
+
+struct ReplayRegion {
+	qir::CodeSegment segment;
+	qir::CompilerJob::IpRangesSet iprange;
+	qir::CompilerJob::LiveInMap const *livein;
+};
+
+// Best over iterations for times, counts do not change between replays
+struct RegionCost {
+	u64 ir_ns{~0ULL};
+	u64 qsel_ns{~0ULL};
+	u64 qra_ns{~0ULL};
+	u64 emit_ns{~0ULL}; // llvm ir generation in --llvm mode
+	u32 qir_insns{};
+	u32 out_insns{}; // after regalloc, or llvm instructions
+	u32 spills{};
+	u32 fills{};
+	u32 code_bytes{};
+
+	void Merge(RegionCost const &c)
+	{
+		ir_ns = std::min(ir_ns, c.ir_ns);
+		qsel_ns = std::min(qsel_ns, c.qsel_ns);
+		qra_ns = std::min(qra_ns, c.qra_ns);
+		emit_ns = std::min(emit_ns, c.emit_ns);
+		qir_insns = c.qir_insns;
+		out_insns = c.out_insns;
+		spills = c.spills;
+		fills = c.fills;
+		code_bytes = c.code_bytes;
+	}
+};
+
+struct Replay {
+	std::vector<ReplayRegion> regions;
+	std::vector<RegionCost> costs;
+	std::vector<std::unique_ptr<qir::CompilerJob::LiveInMap>> liveins;
+	bool use_llvm{};
+	std::atomic<size_t> next{0};
+
+	void Load();
+	u64 Run(uint n_threads);
+
+private:
+	void Worker(std::vector<RegionCost> *out);
+	void DeclareFunctions(qir::LLVMGenCtx *ctx);
+};
+
+void Replay::Load()
+{
+	for (auto const &page : objprof::GetProfile()) {
+		auto mg = BuildModuleGraph(page);
+		liveins.push_back(std::make_unique<qir::CompilerJob::LiveInMap>(mg.ComputeLiveness()));
+
+		for (auto const &r : mg.ComputeRegions()) {
+			assert(r[0]->flags.region_entry);
+			qir::CompilerJob::IpRangesSet ipranges;
+			for (auto n : r) {
+				ipranges.push_back({n->ip, n->ip_end});
+			}
+			regions.push_back({mg.segment, std::move(ipranges), liveins.back().get()});
+		}
+	}
+	costs.resize(regions.size());
+}
+
+// Same set as LLVMAOTCompileELF declares, calls between regions resolve to them
+void Replay::DeclareFunctions(qir::LLVMGenCtx *ctx)
+{
+	for (auto const &page : objprof::GetProfile()) {
+		u32 const page_vaddr = page.pageno << mmu::PAGE_BITS;
+		qir::CodeSegment segment(page_vaddr, mmu::PAGE_SIZE);
+		for (u32 idx = 0; idx < page.executed.size(); ++idx) {
+			if (page.executed[idx] && (page.brind_target[idx] || page.segment_entry[idx])) {
+				ctx->AddFunction(page_vaddr + objprof::PageData::idx2po(idx), segment);
+			}
+		}
+	}
+	for (auto const &r : regions) {
+		ctx->AddFunction(r.iprange[0].first, r.segment);
+	}
+}
+
+void Replay::Worker(std::vector<RegionCost> *out)
+{
+	ReplayCompilerRuntime rt;
+	MemArena arena(1_MB);
+
+	// Module per replay, region functions are filled only once
+	std::unique_ptr<llvm::Module> cmodule;
+	std::unique_ptr<qir::LLVMGenCtx> ctx;
+	if (use_llvm) {
+		cmodule = std::make_unique<llvm::Module>("replay_module", qir::g_llvm_ctx);
+		ctx = std::make_unique<qir::LLVMGenCtx>(cmodule.get());
+		DeclareFunctions(ctx.get());
+	}
+
+	while (true) {
+		size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+		if (idx >= regions.size()) {
+			break;
+		}
+		auto const &d = regions[idx];
+		auto &c = (*out)[idx];
+		auto iprange = d.iprange;
+		u32 entry_ip = iprange[0].first;
+		qir::CompilerJob job(&rt, (uptr)mmu::base, d.segment, std::move(iprange));
+		job.gregs_livein = d.livein;
+
+		arena.Reset();
+		u64 start = stats::NowNs();
+		auto region = qir::CompilerGenRegionIR(&arena, job);
+		c.ir_ns = stats::NowNs() - start;
+		c.qir_insns = 0;
+		for (auto &bb : region->GetBlocks()) {
+			c.qir_insns += std::distance(bb.ilist.begin(), bb.ilist.end());
+		}
+
+		if (use_llvm) {
+			start = stats::NowNs();
+			auto fn = qir::QIRToLLVM(*ctx, &job.segment, region, entry_ip).Run();
+			c.emit_ns = stats::NowNs() - start;
+			c.qsel_ns = c.qra_ns = 0;
+			c.out_insns = fn->getInstructionCount();
+			continue;
+		}
+
+		rt.code_arena.Reset();
+		qcg::CodegenProfile prof;
+		auto code = qcg::GenerateCode(&rt, &job.segment, region, entry_ip, &prof);
+		c.qsel_ns = prof.qsel_ns;
+		c.qra_ns = prof.qra_ns;
+		c.emit_ns = prof.emit_ns;
+		c.out_insns = prof.n_insns;
+		c.spills = prof.n_spills;
+		c.fills = prof.n_fills;
+		c.code_bytes = code.size();
+	}
+}
+
+// Returns wall time of the replay
+u64 Replay::Run(uint n_threads)
+{
+	std::vector<RegionCost> iter_costs(regions.size());
+	next.store(0, std::memory_order_relaxed);
+
+	u64 start = stats::NowNs();
+	std::vector<std::thread> workers;
+	for (uint i = 1; i < n_threads; ++i) {
+		workers.emplace_back([&] { Worker(&iter_costs); });
+	}
+	Worker(&iter_costs);
+	for (auto &t : workers) {
+		t.join();
+	}
+	u64 wall_ns = stats::NowNs() - start;
+
+	for (size_t i = 0; i < regions.size(); ++i) {
+		costs[i].Merge(iter_costs[i]);
+	}
+	return wall_ns;
+}
+
+static void PrintReport(Replay const &r, u64 wall_ns, ElfReplayOptions const &opts)
+{
+	RegionCost total{0, 0, 0, 0};
+	u64 qir_insns = 0, out_insns = 0, spills = 0, fills = 0, code_bytes = 0;
+	for (auto const &c : r.costs) {
+		total.ir_ns += c.ir_ns;
+		total.qsel_ns += c.qsel_ns;
+		total.qra_ns += c.qra_ns;
+		total.emit_ns += c.emit_ns;
+		qir_insns += c.qir_insns;
+		out_insns += c.out_insns;
+		spills += c.spills;
+		fills += c.fills;
+		code_bytes += c.code_bytes;
+	}
+	u64 pass_ns = total.ir_ns + total.qsel_ns + total.qra_ns + total.emit_ns;
+	auto n = r.regions.size();
+
+	if (opts.regions) {
+		printf("%10s %10s %10s %10s %10s %8s %8s %7s %7s %8s\n", "ip", "ir_ns", "qsel_ns", "qra_ns",
+		       opts.use_llvm ? "llvm_ns" : "emit_ns", "qir", opts.use_llvm ? "llvm" : "mir", "spills",
+		       "fills", "bytes");
+		for (size_t i = 0; i < n; ++i) {
+			auto const &c = r.costs[i];
+			printf("%10x %10lu %10lu %10lu %10lu %8u %8u %7u %7u %8u\n",
+			       r.regions[i].iprange[0].first, c.ir_ns, c.qsel_ns, c.qra_ns, c.emit_ns,
+			       c.qir_insns, c.out_insns, c.spills, c.fills, c.code_bytes);
+		}
+		printf("\n");
+	}
+
+	auto pass = [&](char const *name, u64 ns) {
+		printf("%-10s %12lu ns %6.2f%% %10.0f ns/region\n", name, ns,
+		       100.0 * ns / std::max<u64>(pass_ns, 1), (double)ns / std::max<size_t>(n, 1));
+	};
+	printf("%lu regions, %u threads, best of %u: %.3f ms wall, %.0f regions/s\n", n, opts.threads,
+	       opts.iters, wall_ns / 1e6, n * 1e9 / std::max<u64>(wall_ns, 1));
+	pass("irgen", total.ir_ns);
+	if (opts.use_llvm) {
+		pass("llvmgen", total.emit_ns);
+		printf("qir insns %lu, llvm insns %lu\n", qir_insns, out_insns);
+		return;
+	}
+	pass("qsel", total.qsel_ns);
+	pass("qra", total.qra_ns);
+	pass("emit", total.emit_ns);
+	printf("qir insns %lu, after regalloc %lu, spills %lu, fills %lu, code bytes %lu\n", qir_insns,
+	       out_insns, spills, fills, code_bytes);
+}
+
+int main(int argc, char **argv)
+{
+	ElfReplayOptions opts;
+	if (!ParseOptions(opts, argc, argv)) {
+		return 1;
+	}
+
+	SetupLogger(opts.logs);
+
+	fsmanager::Init(opts.cache.c_str());
+	objprof::Init(opts.cache.c_str(), false);
+	mmu::Init();
+	NativeFunctions::Configure(opts.native, opts.native_optout, false);
+
+	ukernel::ReproduceElfMappings(opts.elf.c_str());
+
+	Replay replay;
+	replay.use_llvm = opts.use_llvm;
+	replay.Load();
+	if (replay.regions.empty()) {
+		std::cerr << "no profiled regions for the elf\n";
+		return 1;
+	}
+
+	u64 wall_ns = ~0ULL;
+	for (uint i = 0; i < opts.iters; ++i) {
+		wall_ns = std::min(wall_ns, replay.Run(opts.threads));
+	}
+	PrintReport(replay, wall_ns, opts);
+
+	fsmanager::Destroy();
+	if constexpr (config::debug) {
+		objprof::Destroy();
+		mmu::Destroy();
+	}
+	return 0;
+}
@@ -1,13 +1,21 @@
 #include "dbt/guest/rv32_cpu.h"
+#include "dbt/guest/rv32_native.h"
 #include "dbt/tcache/objprof.h"
+#include "dbt/tcache/perfmap.h"
+#include "dbt/tcache/sampleprof.h"
+#include "dbt/tcache/sharedcode.h"
 #include "dbt/tcache/tcache.h"
 #include "dbt/ukernel.h"
 #include "dbt/util/fsmanager.h"
+#include "dbt/util/stats.h"
+#include "dbt/util/uringio.h"
 #include <boost/any.hpp>
 #include <boost/program_options.hpp>
 #include <boost/tokenizer.hpp>
 #include <iostream>
 
+#include <unistd.h>
+
 namespace bpo = boost::program_options;
 
 struct ElfRunOptions {
@@ -16,7 +24,22 @@ struct ElfRunOptions {
 	std::string fsroot{};
 	std::string cache{};
 	bool use_aot{};
+	bool shared_code{};
 	std::string logs{};
+	std::string fork_server{};
+	std::string fork_marker{};
+	unsigned tenants{};
+	bool native{};
+	std::string native_optout{};
+	bool native_validate{};
+	bool io_uring{};
+	bool hugepages{};
+	bool prefault{};
+	bool hot_relayout{};
+	bool perf_map{};
+	bool perf_jitdump{};
+	std::string sample_profile{};
+	std::string stats{};
 };
 
 static std::pair<std::span<char *>, std::span<char *>> SplitArgs(unsigned argc, char **argv)
@@ -58,7 +81,22 @@ static bool ParseOptions(ElfRunOptions &o, int argc, char **argv)
 	    ("logs",   bpo::value(&o.logs)->default_value(""), "enabled log streams separated by :")
 	    ("fsroot", bpo::value(&o.fsroot)->required(), "isolated path for emulated process")
 	    ("cache",  bpo::value(&o.cache)->required(), "dbt cache path")
-	    ("aot",    bpo::value(&o.use_aot)->default_value(false), "boot aot file if available");
+	    ("aot",    bpo::value(&o.use_aot)->default_value(false), "boot aot file if available")
+	    ("shared-code", bpo::value(&o.shared_code)->default_value(false), "cross-process jit cache")
+	    ("fork-server", bpo::value(&o.fork_server)->default_value(""), "serve forks on unix socket")
+	    ("fork-marker", bpo::value(&o.fork_marker)->default_value("ebreak"), "ebreak or read:<fd>")
+	    ("tenants", bpo::value(&o.tenants)->default_value(1), "guest processes sharing the code cache")
+	    ("native", bpo::value(&o.native)->default_value(false), "host libc and libgcc routines")
+	    ("native-optout", bpo::value(&o.native_optout)->default_value(""), "names separated by :")
+	    ("native-validate", bpo::value(&o.native_validate)->default_value(false), "check native calls")
+	    ("io-uring", bpo::value(&o.io_uring)->default_value(false), "async coalesced guest writes")
+	    ("hugepages", bpo::value(&o.hugepages)->default_value(false), "thp for guest memory and jit code")
+	    ("prefault", bpo::value(&o.prefault)->default_value(false), "prefault elf, stack and code cache")
+	    ("hot-relayout", bpo::value(&o.hot_relayout)->default_value(false), "pack hot jit code")
+	    ("perf-map", bpo::value(&o.perf_map)->default_value(false), "write /tmp/perf-<pid>.map")
+	    ("perf-jitdump", bpo::value(&o.perf_jitdump)->default_value(false), "write /tmp/jit-<pid>.dump")
+	    ("sample-profile", bpo::value(&o.sample_profile)->default_value(""), "sampled <path>.folded")
+	    ("stats", bpo::value(&o.stats)->default_value(""), "json counters, SIGUSR2 dumps too");
 	// clang-format on
 
 	try {
@@ -102,21 +140,51 @@ int main(int argc, char **argv)
 	SetupLogger(opts.logs);
 
 	dbt::fsmanager::Init(opts.cache.c_str());
+	if (!opts.stats.empty()) {
+		dbt::stats::Init(opts.stats.c_str());
+	}
 	dbt::objprof::Init(opts.cache.c_str(), opts.use_aot);
+	if (opts.shared_code) {
+		dbt::sharedcode::Enable();
+	}
+	dbt::mmu::Configure(opts.hugepages, opts.prefault);
 	dbt::mmu::Init();
 	dbt::tcache::Init();
+	dbt::perfmap::Init(opts.perf_map, opts.perf_jitdump);
+	if (opts.hot_relayout) {
+		dbt::tcache::EnableHotSampling();
+	}
+	if (!opts.sample_profile.empty()) {
+		dbt::sampleprof::EnableProfile(opts.sample_profile);
+	}
+	dbt::NativeFunctions::Configure(opts.native, opts.native_optout, opts.native_validate);
+	if (opts.io_uring && !dbt::uringio::Init()) {
+		std::cerr << "io_uring is not available, guest I/O is synchronous\n";
+	}
 
 	dbt::ukernel::SetFSRoot(opts.fsroot.c_str());
-	dbt::ukernel::MainThreadBoot(static_cast<int>(gargs.size()), gargs.data());
-	int guest_rc = dbt::ukernel::MainThreadExecute();
+	if (!opts.fork_server.empty()) {
+		dbt::ukernel::SetForkServer(opts.fork_server.c_str(), opts.fork_marker.c_str());
+	}
+	int guest_rc;
+	if (opts.tenants > 1) {
+		guest_rc = dbt::ukernel::TenantsExecute(opts.tenants, static_cast<int>(gargs.size()),
+							gargs.data());
+	} else {
+		dbt::ukernel::MainThreadBoot(static_cast<int>(gargs.size()), gargs.data());
+		guest_rc = dbt::ukernel::MainThreadExecute();
+	}
 
-	dbt::objprof::UpdateProfile();
+	dbt::ukernel::FlushOnExit();
 
-	if constexpr (dbt::config::debug) {
+	// Don't unmap the code and guest memory under threads left by exit_group
+	if (dbt::config::debug && !dbt::ukernel::HasLiveThreads()) {
+		dbt::sharedcode::Destroy();
 		dbt::objprof::Destroy();
 		dbt::tcache::Destroy();
 		dbt::mmu::Destroy();
 	}
 	dbt::fsmanager::Destroy();
-	return guest_rc;
+	// Static destructors would run under them as well
+	_exit(guest_rc);
 }
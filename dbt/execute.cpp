@@ -2,11 +2,19 @@
 #include "dbt/guest/rv32_runtime.h"
 #include "dbt/qmc/compile.h"
 #include "dbt/qmc/qcg/jitabi.h"
+#include "dbt/tcache/perfmap.h"
+#include "dbt/tcache/sampleprof.h"
+#include "dbt/tcache/sharedcode.h"
+#include <cstring>
 
 namespace dbt
 {
+STAT_COUNTER(execute_loop);
+STAT_COUNTER(execute_enter_jit);
+STAT_COUNTER(execute_interp);
+STAT_COUNTER(execute_relayout);
 
-sigjmp_buf trap_unwind_env;
+thread_local sigjmp_buf trap_unwind_env;
 
 static inline bool HandleTrap(CPUState *state)
 {
@@ -14,7 +22,28 @@ static inline bool HandleTrap(CPUState *state)
 	return !state->IsTrapPending();
 }
 
+static TBlock *InsertRegion(u32 ip, std::span<u8> const &code)
+{
+	u64 const epoch = tcache::GetFlushEpoch();
+	auto tb = tcache::AllocateTBlock();
+	if (tb == nullptr) {
+		Panic();
+	}
+	if (epoch != tcache::GetFlushEpoch()) {
+		return nullptr; // the code is flushed, interpret it this time
+	}
+	tb->ip = ip;
+	tb->tcode = TBlock::TCode{code.data(), code.size()};
+	tcache::Insert(tb);
+	perfmap::AnnounceCode(ip, code.data(), code.size());
+	return tb;
+}
+
 struct JITCompilerRuntime final : CompilerRuntime {
+	JITCompilerRuntime() = default;
+	// Relocatable code is published to sharedcode, gip_end bounds guest code it depends on
+	explicit JITCompilerRuntime(u32 gip_end_) : relocatable(true), gip_end(gip_end_) {}
+
 	void *AllocateCode(size_t sz, uint align) override
 	{
 		return tcache::AllocateCode(sz, align);
@@ -22,21 +51,31 @@ struct JITCompilerRuntime final : CompilerRuntime {
 
 	bool AllowsRelocation() const override
 	{
-		return false;
+		return relocatable;
 	}
 
 	void *AnnounceRegion(u32 ip, std::span<u8> const &code) override
 	{
-		// TODO: concurrent tcache
-		auto tb = tcache::AllocateTBlock();
-		if (tb == nullptr) {
-			Panic();
+		if (relocatable) {
+			sharedcode::Publish(ip, gip_end, mmu::base, code);
 		}
-		tb->ip = ip;
-		tb->tcode = TBlock::TCode{code.data(), code.size()};
-		tcache::Insert(tb);
-		return (void *)tb;
+		return (void *)InsertRegion(ip, code);
 	}
+
+	void AnnounceBranchSlot(void *slot) override
+	{
+		// Relocatable slots are linked lazily through stub_tab
+		assert(relocatable);
+	}
+
+	void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) override
+	{
+		assert(!relocatable);
+		tcache::RecordFaultSite((uptr)hpc, gip, dirty);
+	}
+
+	bool relocatable{false};
+	u32 gip_end{};
 };
 
 static inline IpRange GetCompilationIPRange(u32 ip)
@@ -45,44 +84,131 @@ static inline IpRange GetCompilationIPRange(u32 ip)
 	if (config::dump_trace) {
 		return {ip, upper};
 	}
-	if (auto *tb_upper = tcache::LookupUpperBound(ip)) {
-		upper = std::min(upper, tb_upper->ip);
+	if (auto ip_upper = tcache::UpperBoundIp(ip)) {
+		upper = std::min(upper, *ip_upper);
 	}
 	return {ip, upper};
 }
 
+// Guest code bytes a region translation might depend on
+static inline u32 GetTranslatedIPEnd(IpRange const &range)
+{
+	u32 end = std::max(range.second, range.first + 4);
+	return std::min(end, range.first + 4 * rv32::TB_MAX_INSNS);
+}
+
+// Published code is relocatable and its BranchSlots are lazy, a private copy is enough
+static TBlock *CopySharedRegion(u32 ip)
+{
+	auto code = sharedcode::Lookup(ip, mmu::base);
+	if (code.empty()) {
+		return nullptr;
+	}
+	auto *ptr = (u8 *)tcache::AllocateCode(code.size(), qcg::ArchTraits::CODE_ALIGN);
+	if (ptr == nullptr) {
+		Panic();
+	}
+	memcpy(ptr, code.data(), code.size());
+	return InsertRegion(ip, {ptr, code.size()});
+}
+
+// Translation is serialized, another thread might have done it already
+// Returns nullptr if the code at ip must be interpreted
+static TBlock *TranslateRegion(u32 ip)
+{
+	DBT_TCACHE_LOCK();
+	if (auto *tb = tcache::Lookup(ip)) {
+		return tb;
+	}
+	sampleprof::ScopedActivity act(sampleprof::Activity::COMPILE);
+	if (!tcache::PrepareTranslation(ip)) {
+		return nullptr;
+	}
+	auto range = GetCompilationIPRange(ip);
+	auto jrt = JITCompilerRuntime();
+	if (sharedcode::IsAttached()) {
+		if (auto *tb = CopySharedRegion(ip)) {
+			return tb;
+		}
+		jrt = JITCompilerRuntime(GetTranslatedIPEnd(range));
+	}
+	u32 gip_page = rounddown(ip, mmu::PAGE_SIZE);
+	qir::CompilerJob job(&jrt, (uptr)mmu::base, qir::CodeSegment(gip_page, mmu::PAGE_SIZE), {range});
+	return (TBlock *)qir::CompilerDoJob(job);
+}
+
+// Retranslates hot regions one after another, so they are dense in the code pool in chaining order
+static void RelayoutHotRegions()
+{
+	DBT_TCACHE_LOCK();
+	sampleprof::Flush();
+	auto const hot = tcache::CollectHotRegions();
+	std::vector<decltype(TBlock::flags)> flags;
+	for (auto ip : hot) {
+		flags.push_back(tcache::Lookup(ip)->flags);
+	}
+	tcache::EvictRegions(hot);
+	for (size_t i = 0; i < hot.size(); ++i) {
+		if (auto *tb = TranslateRegion(hot[i])) {
+			tb->flags = flags[i];
+			tb->flags.is_hot = true;
+		}
+	}
+}
+
 void Execute(CPUState *state)
 {
 	sigsetjmp(dbt::trap_unwind_env, 0);
 
 	jitabi::ppoint::BranchSlot *branch_slot = nullptr;
+	u64 slot_epoch = 0;
 
 	while (likely(!HandleTrap(state))) {
+		sampleprof::SetActivity(sampleprof::Activity::DISPATCH);
+		stat_execute_loop.Add();
 		assert(state == CPUState::Current());
 		assert(state->gpr[0] == 0);
 		assert(!branch_slot || branch_slot->gip == state->ip);
 		if constexpr (config::use_interp) {
+			sampleprof::SetActivity(sampleprof::Activity::INTERP);
 			Interpreter::Execute(state);
 			continue;
 		}
+		u64 const epoch = tcache::Safepoint(state->l1_brind_cache);
+		if (unlikely(sampleprof::NeedsFlush())) {
+			sampleprof::Flush();
+		}
+
+		if (unlikely(tcache::HotSamplesReady()) && !tcache::IsShared()) {
+			stat_execute_relayout.Add();
+			RelayoutHotRegions();
+			branch_slot = nullptr; // might be in the evicted code
+		}
 
 		TBlock *tb = tcache::Lookup(state->ip);
 		if (tb == nullptr) {
-			auto jrt = JITCompilerRuntime();
-			u32 gip_page = rounddown(state->ip, mmu::PAGE_SIZE);
-			qir::CompilerJob job(&jrt, (uptr)mmu::base,
-					     qir::CodeSegment(gip_page, mmu::PAGE_SIZE),
-					     {GetCompilationIPRange(state->ip)});
-			tb = (TBlock *)qir::CompilerDoJob(job);
+			tb = TranslateRegion(state->ip);
+		}
+		if (tb == nullptr) {
+			sampleprof::SetActivity(sampleprof::Activity::INTERP);
+			stat_execute_interp.Add();
+			Interpreter::ExecuteBlock(state);
+			branch_slot = nullptr;
+			continue;
 		}
 
+		if (branch_slot && slot_epoch != tcache::GetFlushEpoch()) {
+			branch_slot = nullptr; // the code was flushed since the slot was reached
+		}
 		if (branch_slot) {
-			branch_slot->Link(tb->tcode.ptr);
-			tcache::RecordLink(branch_slot, tb, branch_slot->flags.cross_segment);
+			tcache::LinkBranch(branch_slot, tb);
 		} else {
-			tcache::CacheBrind(tb);
+			tcache::CacheBrind(state->l1_brind_cache, tb);
 		}
 
+		sampleprof::SetActivity(sampleprof::Activity::TRANSLATED);
+		stat_execute_enter_jit.Add();
+		slot_epoch = epoch;
 		branch_slot = jitabi::trampoline_to_jit(state, mmu::base, tb->tcode.ptr);
 	}
 }
@@ -9,7 +9,7 @@ namespace dbt
 
 LOG_STREAM(dbt);
 
-extern sigjmp_buf trap_unwind_env;
+extern thread_local sigjmp_buf trap_unwind_env;
 
 ALWAYS_INLINE void RaiseTrap()
 {
@@ -1,6 +1,7 @@
 #include "dbt/guest/rv32_analyser.h"
 #include "dbt/guest/rv32_cpu.h"
 #include "dbt/guest/rv32_decode.h"
+#include "dbt/guest/rv32_native.h"
 #include "dbt/tcache/cflow_dump.h"
 
 #include <sstream>
@@ -9,7 +10,10 @@ namespace dbt::rv32
 {
 LOG_STREAM(analyse)
 
-RV32Analyser::RV32Analyser(ModuleGraph *mg_, u32 ip, uptr vmem) : vmem_base(vmem), bb_ip(ip), mg(mg_) {}
+RV32Analyser::RV32Analyser(ModuleGraph *mg_, u32 ip, uptr vmem)
+    : vmem_base(vmem), bb_ip(ip), mg(mg_), node(mg_->GetNode(ip))
+{
+}
 
 void RV32Analyser::Analyse(ModuleGraph *mg, u32 ip, u32 boundary_ip, uptr vmem)
 {
@@ -18,6 +22,14 @@ void RV32Analyser::Analyse(ModuleGraph *mg, u32 ip, u32 boundary_ip, uptr vmem)
 	t.insn_ip = ip;
 	// mg->RecordEntry(ip);
 
+	if (NativeFunctions::IsBound(ip)) {
+		// host routine reads arguments and returns to ra
+		ModuleGraph::RecordGRegUseDef(t.node, ModuleGraph::GREGS_ALL, 0);
+		mg->RecordGBrind(ip);
+		mg->GetNode(ip)->ip_end = ip + 4;
+		return;
+	}
+
 	u32 num_insns = 0;
 	while (true) {
 		t.AnalyseInsn();
@@ -25,7 +37,8 @@ void RV32Analyser::Analyse(ModuleGraph *mg, u32 ip, u32 boundary_ip, uptr vmem)
 		if (t.control != Control::NEXT) {
 			break;
 		}
-		if (num_insns == TB_MAX_INSNS || t.insn_ip >= boundary_ip) {
+		if (num_insns == TB_MAX_INSNS || t.insn_ip >= boundary_ip ||
+		    NativeFunctions::IsBound(t.insn_ip)) {
 			t.control = Control::TB_OVF;
 			mg->RecordGBr(t.bb_ip, t.insn_ip);
 			break;
@@ -61,13 +74,37 @@ static ALWAYS_INLINE void LogInsn(IType i, u32 ip)
 	log_analyse("\t %08x: %-8s   %s", ip, IType::opcode_str, res.c_str());
 }
 
+template <typename IType>
+ALWAYS_INLINE void RV32Analyser::RecordGRegs(IType i)
+{
+	u32 use = 0, def = 0;
+	if constexpr (requires { i.rd(); }) {
+		mg->RecordGRegRef(i.rd());
+		def |= 1u << i.rd();
+	}
+	if constexpr (requires { i.rs1(); }) {
+		mg->RecordGRegRef(i.rs1());
+		use |= 1u << i.rs1();
+	}
+	if constexpr (requires { i.rs2(); }) {
+		mg->RecordGRegRef(i.rs2());
+		use |= 1u << i.rs2();
+	}
+	ModuleGraph::RecordGRegUseDef(node, use & ModuleGraph::GREGS_ALL, def & ModuleGraph::GREGS_ALL);
+}
+
 #define Analyser(name)                                                                                       \
 	void RV32Analyser::H_##name(void *insn)                                                              \
 	{                                                                                                    \
 		insn::Insn_##name i{*(u32 *)insn};                                                           \
 		LogInsn(i, insn_ip);                                                                         \
+		RecordGRegs(i);                                                                              \
 		static constexpr auto flags = decltype(i)::flags;                                            \
 		V_##name(i);                                                                                 \
+		if constexpr (flags & insn::Flags::Trap) {                                                   \
+			/* runtime may observe any register */                                               \
+			ModuleGraph::RecordGRegUseDef(node, ModuleGraph::GREGS_ALL, 0);                      \
+		}                                                                                            \
 		if constexpr (flags & insn::Flags::Branch || flags & insn::Flags::Trap) {                    \
 			control = RV32Analyser::Control::BRANCH;                                             \
 		}                                                                                            \
@@ -152,7 +189,11 @@ Analyser(or) {}
 Analyser(and) {}
 Analyser(fence) {}
 Analyser(fencei) {}
-Analyser(ecall) {}
+Analyser(ecall)
+{
+	// Syscalls return to the next insn unless the thread terminates
+	mg->RecordGBr(bb_ip, insn_ip + 4);
+}
 Analyser(ebreak) {}
 
 Analyser(lrw) {}
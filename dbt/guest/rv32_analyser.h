@@ -22,6 +22,8 @@ private:
 	explicit RV32Analyser(ModuleGraph *mg_, u32 ip, uptr vmem);
 	void AnalyseInsn();
 	void AnalyseBrcc(rv32::insn::B i);
+	template <typename IType>
+	void RecordGRegs(IType i);
 
 	enum class Control { NEXT, BRANCH, TB_OVF } control{Control::NEXT};
 	uptr vmem_base{};
@@ -29,6 +31,7 @@ private:
 	u32 bb_ip{}; // for cflow_dump
 
 	ModuleGraph *mg{};
+	ModuleGraphNode *node{};
 };
 
 } // namespace dbt::rv32
@@ -16,6 +16,7 @@ enum class TrapCode : u32 {
 	ILLEGAL_INSN,
 	EBREAK,
 	ECALL,
+	PAGE_FAULT,
 };
 
 // TODO: separate guest part
@@ -2,6 +2,7 @@
 #include "dbt/guest/rv32_decode.h"
 #include "dbt/guest/rv32_runtime.h"
 #include "dbt/mmu.h"
+#include "dbt/ukernel.h"
 #include <atomic>
 
 #include <immintrin.h>
@@ -180,8 +181,8 @@ HANDLER(fence) {}
 HANDLER(fencei) {}
 HANDLER(ecall)
 {
-	RAISE_TRAP(TrapCode::ECALL);
-	RaiseTrap();
+	s->ip = GET_GIP() + 4;
+	ukernel::SyscallDirect(s);
 }
 HANDLER(ebreak)
 {
@@ -277,7 +278,7 @@ entry:
 #define XDUMP(name)                                                                                          \
 	do {                                                                                                 \
 		if (++icount == TB_MAX_INSNS || !(gip & ~mmu::PAGE_MASK) ||                                  \
-		    (insn::Insn_##name::flags & insn::Flags::Branch))                                        \
+		    (insn::Insn_##name::flags & (insn::Flags::Branch | insn::Flags::Trap)))                  \
 			goto entry;                                                                          \
 	} while (0)
 #else
@@ -319,4 +320,32 @@ dispatch:
 	}
 }
 
+void Interpreter::ExecuteBlock(CPUState *state)
+{
+	using Handler = void (*)(CPUState *, u32 &, u8 *, u32);
+	static constexpr Handler handlers[] = {
+#define OP(name, format_, flags_) [(u8)insn::Op::_##name] = &H_##name,
+	    RV32_OPCODE_LIST()
+#undef OP
+	};
+	static constexpr bool ends_block[] = {
+#define OP(name, format_, flags_)                                                                            \
+	[(u8)insn::Op::_##name] = (insn::Insn_##name::flags & (insn::Flags::Branch | insn::Flags::Trap)) != 0,
+	    RV32_OPCODE_LIST()
+#undef OP
+	};
+
+	u8 *vmem = mmu::base;
+	u32 gip = state->ip;
+	for (u16 n = 0; n < TB_MAX_INSNS; ++n) {
+		u8 *insn_ptr = vmem + gip;
+		auto op = (u8)insn::Decoder<insn::Op>::Decode(insn_ptr);
+		handlers[op](state, gip, vmem, *(u32 *)insn_ptr);
+		if (ends_block[op] || !(gip & ~mmu::PAGE_MASK)) {
+			break;
+		}
+	}
+	state->ip = gip;
+}
+
 } // namespace dbt::rv32
\ No newline at end of file
@@ -0,0 +1,613 @@
+#include "dbt/guest/rv32_native.h"
+#include "dbt/mmu.h"
+#include "dbt/tcache/tcache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace dbt::rv32
+{
+
+bool NativeFunctions::enabled{false};
+bool NativeFunctions::validate{false};
+std::array<bool, to_underlying(NativeFnId::Count)> NativeFunctions::optout{};
+std::unordered_map<u32, NativeFnId> NativeFunctions::bound{};
+
+// a points to a0-a7, results are returned in a0 per ilp32
+using NativeFn = void (*)(u32 *a, u8 *vmem);
+
+#define NATIVE(name) static void Native_##name(u32 *a, u8 *vmem)
+#define REFERENCE(name) static void Reference_##name(u32 *a, u8 *vmem)
+
+static inline char *gstr(u8 *vmem, u32 gptr)
+{
+	return (char *)(vmem + gptr);
+}
+
+static inline u32 h2g(u8 *vmem, void *hptr)
+{
+	return (u8 *)hptr - vmem;
+}
+
+NATIVE(memcpy)
+{
+	memcpy(vmem + a[0], vmem + a[1], a[2]);
+}
+NATIVE(memmove)
+{
+	memmove(vmem + a[0], vmem + a[1], a[2]);
+}
+NATIVE(memset)
+{
+	memset(vmem + a[0], (int)a[1], a[2]);
+}
+NATIVE(memcmp)
+{
+	a[0] = memcmp(vmem + a[0], vmem + a[1], a[2]);
+}
+NATIVE(memchr)
+{
+	void *p = memchr(vmem + a[0], (int)a[1], a[2]);
+	a[0] = p ? h2g(vmem, p) : 0;
+}
+NATIVE(strlen)
+{
+	a[0] = strlen(gstr(vmem, a[0]));
+}
+NATIVE(strnlen)
+{
+	a[0] = strnlen(gstr(vmem, a[0]), a[1]);
+}
+NATIVE(strcmp)
+{
+	a[0] = strcmp(gstr(vmem, a[0]), gstr(vmem, a[1]));
+}
+NATIVE(strncmp)
+{
+	a[0] = strncmp(gstr(vmem, a[0]), gstr(vmem, a[1]), a[2]);
+}
+NATIVE(strchr)
+{
+	char *p = strchr(gstr(vmem, a[0]), (int)a[1]);
+	a[0] = p ? h2g(vmem, p) : 0;
+}
+NATIVE(strchrnul)
+{
+	a[0] = h2g(vmem, strchrnul(gstr(vmem, a[0]), (int)a[1]));
+}
+NATIVE(strcpy)
+{
+	strcpy(gstr(vmem, a[0]), gstr(vmem, a[1]));
+}
+
+// Plain byte loops, same as the guest would do, used in validation mode
+REFERENCE(memcpy)
+{
+	for (u32 i = 0; i < a[2]; ++i) {
+		vmem[a[0] + i] = vmem[a[1] + i];
+	}
+}
+REFERENCE(memmove)
+{
+	if (a[0] < a[1]) {
+		Reference_memcpy(a, vmem);
+		return;
+	}
+	for (u32 i = a[2]; i > 0; --i) {
+		vmem[a[0] + i - 1] = vmem[a[1] + i - 1];
+	}
+}
+REFERENCE(memset)
+{
+	for (u32 i = 0; i < a[2]; ++i) {
+		vmem[a[0] + i] = a[1];
+	}
+}
+REFERENCE(memcmp)
+{
+	u32 res = 0;
+	for (u32 i = 0; i < a[2] && !res; ++i) {
+		res = (int)vmem[a[0] + i] - (int)vmem[a[1] + i];
+	}
+	a[0] = res;
+}
+REFERENCE(memchr)
+{
+	u32 res = 0;
+	for (u32 i = 0; i < a[2]; ++i) {
+		if (vmem[a[0] + i] == (u8)a[1]) {
+			res = a[0] + i;
+			break;
+		}
+	}
+	a[0] = res;
+}
+REFERENCE(strlen)
+{
+	u32 n = 0;
+	while (vmem[a[0] + n]) {
+		n++;
+	}
+	a[0] = n;
+}
+REFERENCE(strnlen)
+{
+	u32 n = 0;
+	while (n < a[1] && vmem[a[0] + n]) {
+		n++;
+	}
+	a[0] = n;
+}
+REFERENCE(strncmp)
+{
+	u32 res = 0;
+	for (u32 i = 0; i < a[2]; ++i) {
+		u8 c0 = vmem[a[0] + i], c1 = vmem[a[1] + i];
+		res = (int)c0 - (int)c1;
+		if (res || !c0) {
+			break;
+		}
+	}
+	a[0] = res;
+}
+REFERENCE(strcmp)
+{
+	a[2] = ~(u32)0;
+	Reference_strncmp(a, vmem);
+}
+REFERENCE(strchrnul)
+{
+	u32 p = a[0];
+	while (vmem[p] && vmem[p] != (u8)a[1]) {
+		p++;
+	}
+	a[0] = p;
+}
+REFERENCE(strchr)
+{
+	u32 c = (u8)a[1];
+	Reference_strchrnul(a, vmem);
+	if (vmem[a[0]] != c) {
+		a[0] = 0;
+	}
+}
+REFERENCE(strcpy)
+{
+	u32 i = 0;
+	do {
+		vmem[a[0] + i] = vmem[a[1] + i];
+	} while (vmem[a[1] + i++]);
+}
+
+// libgcc helpers, arguments and results follow ilp32: 64-bit values in register pairs, low word first.
+// Integer division by zero and overflow behave as the M extension, NaNs are canonical as in soft-fp.
+static inline u64 arg64(u32 const *a, int i)
+{
+	return ((u64)a[2 * i + 1] << 32) | a[2 * i];
+}
+
+static inline void ret64(u32 *a, u64 v)
+{
+	a[0] = v;
+	a[1] = v >> 32;
+}
+
+static inline double argdf(u32 const *a, int i)
+{
+	return std::bit_cast<double>(arg64(a, i));
+}
+
+static inline void retdf(u32 *a, double v)
+{
+	ret64(a, std::isnan(v) ? 0x7ff8000000000000ull : std::bit_cast<u64>(v));
+}
+
+static inline float argsf(u32 const *a, int i)
+{
+	return std::bit_cast<float>(a[i]);
+}
+
+static inline void retsf(u32 *a, float v)
+{
+	a[0] = std::isnan(v) ? 0x7fc00000u : std::bit_cast<u32>(v);
+}
+
+template <typename T>
+static inline T DivM(T x, T y)
+{
+	if (y == 0) {
+		return ~(T)0;
+	}
+	if (std::is_signed_v<T> && x == std::numeric_limits<T>::min() && y == (T)-1) {
+		return x;
+	}
+	return x / y;
+}
+
+template <typename T>
+static inline T RemM(T x, T y)
+{
+	if (y == 0) {
+		return x;
+	}
+	if (std::is_signed_v<T> && x == std::numeric_limits<T>::min() && y == (T)-1) {
+		return 0;
+	}
+	return x % y;
+}
+
+// Comparison helpers return unord_res if any operand is NaN, otherwise -1, 0 or 1
+template <typename F>
+static inline u32 CmpFP(F x, F y, i32 unord_res)
+{
+	if (std::isnan(x) || std::isnan(y)) {
+		return unord_res;
+	}
+	return x < y ? -1 : (x == y ? 0 : 1);
+}
+
+// Saturating conversion, NaN is treated as a value of its sign
+template <typename I, typename F>
+static inline I FixFP(F x)
+{
+	if (std::isnan(x)) {
+		return std::signbit(x) ? std::numeric_limits<I>::min() : std::numeric_limits<I>::max();
+	}
+	if (x <= (F)std::numeric_limits<I>::min()) {
+		return std::numeric_limits<I>::min();
+	}
+	if (x >= (F)std::numeric_limits<I>::max()) {
+		return std::numeric_limits<I>::max();
+	}
+	return (I)x;
+}
+
+NATIVE(mulsi3)
+{
+	a[0] = a[0] * a[1];
+}
+NATIVE(divsi3)
+{
+	a[0] = DivM<i32>(a[0], a[1]);
+}
+NATIVE(udivsi3)
+{
+	a[0] = DivM<u32>(a[0], a[1]);
+}
+NATIVE(modsi3)
+{
+	a[0] = RemM<i32>(a[0], a[1]);
+}
+NATIVE(umodsi3)
+{
+	a[0] = RemM<u32>(a[0], a[1]);
+}
+NATIVE(muldi3)
+{
+	ret64(a, arg64(a, 0) * arg64(a, 1));
+}
+NATIVE(divdi3)
+{
+	ret64(a, DivM<i64>(arg64(a, 0), arg64(a, 1)));
+}
+NATIVE(udivdi3)
+{
+	ret64(a, DivM<u64>(arg64(a, 0), arg64(a, 1)));
+}
+NATIVE(moddi3)
+{
+	ret64(a, RemM<i64>(arg64(a, 0), arg64(a, 1)));
+}
+NATIVE(umoddi3)
+{
+	ret64(a, RemM<u64>(arg64(a, 0), arg64(a, 1)));
+}
+NATIVE(ashldi3)
+{
+	ret64(a, arg64(a, 0) << (a[2] & 63));
+}
+NATIVE(lshrdi3)
+{
+	ret64(a, arg64(a, 0) >> (a[2] & 63));
+}
+NATIVE(ashrdi3)
+{
+	ret64(a, (i64)arg64(a, 0) >> (a[2] & 63));
+}
+
+#define NATIVE_FP_BINOP(name, op, t)                                                                         \
+	NATIVE(name)                                                                                         \
+	{                                                                                                    \
+		ret##t(a, arg##t(a, 0) op arg##t(a, 1));                                                     \
+	}
+#define NATIVE_FP_CMP(name, t, unord_res)                                                                    \
+	NATIVE(name)                                                                                         \
+	{                                                                                                    \
+		a[0] = CmpFP(arg##t(a, 0), arg##t(a, 1), unord_res);                                         \
+	}
+
+NATIVE_FP_BINOP(adddf3, +, df);
+NATIVE_FP_BINOP(subdf3, -, df);
+NATIVE_FP_BINOP(muldf3, *, df);
+NATIVE_FP_BINOP(divdf3, /, df);
+NATIVE(negdf2)
+{
+	a[1] ^= 1u << 31;
+}
+NATIVE_FP_CMP(eqdf2, df, 1);
+NATIVE_FP_CMP(nedf2, df, 1);
+NATIVE_FP_CMP(ltdf2, df, 1);
+NATIVE_FP_CMP(ledf2, df, 1);
+NATIVE_FP_CMP(gtdf2, df, -1);
+NATIVE_FP_CMP(gedf2, df, -1);
+NATIVE(unorddf2)
+{
+	a[0] = std::isnan(argdf(a, 0)) || std::isnan(argdf(a, 1));
+}
+NATIVE(floatsidf)
+{
+	retdf(a, (i32)a[0]);
+}
+NATIVE(floatunsidf)
+{
+	retdf(a, a[0]);
+}
+NATIVE(fixdfsi)
+{
+	a[0] = FixFP<i32>(argdf(a, 0));
+}
+NATIVE(fixunsdfsi)
+{
+	a[0] = FixFP<u32>(argdf(a, 0));
+}
+NATIVE(extendsfdf2)
+{
+	retdf(a, argsf(a, 0));
+}
+NATIVE(truncdfsf2)
+{
+	retsf(a, argdf(a, 0));
+}
+
+NATIVE_FP_BINOP(addsf3, +, sf);
+NATIVE_FP_BINOP(subsf3, -, sf);
+NATIVE_FP_BINOP(mulsf3, *, sf);
+NATIVE_FP_BINOP(divsf3, /, sf);
+NATIVE(negsf2)
+{
+	a[0] ^= 1u << 31;
+}
+NATIVE_FP_CMP(eqsf2, sf, 1);
+NATIVE_FP_CMP(nesf2, sf, 1);
+NATIVE_FP_CMP(ltsf2, sf, 1);
+NATIVE_FP_CMP(lesf2, sf, 1);
+NATIVE_FP_CMP(gtsf2, sf, -1);
+NATIVE_FP_CMP(gesf2, sf, -1);
+NATIVE(unordsf2)
+{
+	a[0] = std::isnan(argsf(a, 0)) || std::isnan(argsf(a, 1));
+}
+NATIVE(floatsisf)
+{
+	retsf(a, (i32)a[0]);
+}
+NATIVE(floatunsisf)
+{
+	retsf(a, a[0]);
+}
+NATIVE(fixsfsi)
+{
+	a[0] = FixFP<i32>(argsf(a, 0));
+}
+NATIVE(fixunssfsi)
+{
+	a[0] = FixFP<u32>(argsf(a, 0));
+}
+
+static constexpr char const *native_names[] = {
+#define X(name) #name,
+    NATIVE_LIBC_FUNCTIONS(X)
+#undef X
+#define X(name) "__" #name,
+    NATIVE_LIBGCC_FUNCTIONS(X)
+#undef X
+};
+
+static constexpr NativeFn native_impls[] = {
+#define X(name) Native_##name,
+    NATIVE_FUNCTIONS(X)
+#undef X
+};
+
+// Length of the guest string at gptr, up to max. Fails if it runs into memory the guest can't read
+static std::optional<u32> GuestStrnlen(u8 *vmem, u32 gptr, u32 max)
+{
+	u32 len = 0;
+	while (len < max) {
+		u32 const addr = gptr + len;
+		u32 const chunk = std::min<u32>(mmu::PAGE_SIZE - (addr & ~mmu::PAGE_MASK), max - len);
+		if (!mmu::IsGuestMapped(addr, chunk, PROT_READ)) {
+			return std::nullopt;
+		}
+		if (auto p = (u8 *)memchr(vmem + addr, 0, chunk)) {
+			return len + (p - (vmem + addr));
+		}
+		len += chunk;
+	}
+	return len;
+}
+
+// Host routines would fault out of the guest state, such calls run the guest body instead
+static bool CheckArgs(NativeFnId id, u32 const *a, u8 *vmem)
+{
+	auto readable = [](u32 gptr, u32 n) { return mmu::IsGuestMapped(gptr, n, PROT_READ); };
+	auto writable = [](u32 gptr, u32 n) { return mmu::IsGuestMapped(gptr, n, PROT_WRITE); };
+	auto str = [vmem](u32 gptr, u32 max = ~(u32)0) { return GuestStrnlen(vmem, gptr, max).has_value(); };
+
+	switch (id) {
+	case NativeFnId::id_memcpy:
+	case NativeFnId::id_memmove:
+		return writable(a[0], a[2]) && readable(a[1], a[2]);
+	case NativeFnId::id_memset:
+		return writable(a[0], a[2]);
+	case NativeFnId::id_memcmp:
+		return readable(a[0], a[2]) && readable(a[1], a[2]);
+	case NativeFnId::id_memchr:
+		return readable(a[0], a[2]);
+	case NativeFnId::id_strlen:
+	case NativeFnId::id_strchr:
+	case NativeFnId::id_strchrnul:
+		return str(a[0]);
+	case NativeFnId::id_strnlen:
+		return str(a[0], a[1]);
+	case NativeFnId::id_strcmp:
+		return str(a[0]) && str(a[1]);
+	case NativeFnId::id_strncmp:
+		return str(a[0], a[2]) && str(a[1], a[2]);
+	case NativeFnId::id_strcpy: {
+		auto len = GuestStrnlen(vmem, a[1], ~(u32)0);
+		return len && *len < ~(u32)0 && writable(a[0], *len + 1);
+	}
+	default: // libgcc helpers don't access memory
+		return true;
+	}
+}
+
+// libgcc helpers have no reference, validation mode just calls them
+static constexpr NativeFn native_refs[] = {
+#define X(name) Reference_##name,
+    NATIVE_LIBC_FUNCTIONS(X)
+#undef X
+#define X(name) nullptr,
+    NATIVE_LIBGCC_FUNCTIONS(X)
+#undef X
+};
+
+// Guest bytes at a0 the function writes
+static u32 WrittenBytes(NativeFnId id, u32 const *a, u8 *vmem)
+{
+	switch (id) {
+	case NativeFnId::id_memcpy:
+	case NativeFnId::id_memmove:
+	case NativeFnId::id_memset:
+		return a[2];
+	case NativeFnId::id_strcpy:
+		return strlen(gstr(vmem, a[1])) + 1;
+	default:
+		return 0;
+	}
+}
+
+static bool ResultSignOnly(NativeFnId id)
+{
+	return id == NativeFnId::id_memcmp || id == NativeFnId::id_strcmp || id == NativeFnId::id_strncmp;
+}
+
+static void ValidateCall(NativeFnId id, u32 *a, u8 *vmem)
+{
+	auto idx = to_underlying(id);
+	if (!native_refs[idx]) {
+		native_impls[idx](a, vmem);
+		return;
+	}
+	u32 const dst = a[0];
+	u32 const n = WrittenBytes(id, a, vmem);
+
+	std::vector<u8> saved(vmem + dst, vmem + dst + n);
+	std::array<u32, 8> ref_a;
+	std::copy(a, a + ref_a.size(), ref_a.begin());
+	native_refs[idx](ref_a.data(), vmem);
+	std::vector<u8> expected(vmem + dst, vmem + dst + n);
+	memcpy(vmem + dst, saved.data(), n);
+
+	native_impls[idx](a, vmem);
+
+	bool match = ResultSignOnly(id) ? ((i32)a[0] < 0) == ((i32)ref_a[0] < 0) && !a[0] == !ref_a[0]
+					: a[0] == ref_a[0];
+	match &= !memcmp(vmem + dst, expected.data(), n);
+	if (!match) {
+		log_native("%s: native a0=%08x, reference a0=%08x", native_names[idx], a[0], ref_a[0]);
+		Panic("native function validation failed");
+	}
+}
+
+void NativeFunctions::Call(CPUState *state, NativeFnId id)
+{
+	u32 *a = &state->gpr[10];
+	if (unlikely(!CheckArgs(id, a, mmu::base))) {
+		log_native("%s: arguments out of guest memory, run the guest body",
+			   native_names[to_underlying(id)]);
+		return;
+	}
+	if (unlikely(validate)) {
+		ValidateCall(id, a, mmu::base);
+	} else {
+		native_impls[to_underlying(id)](a, mmu::base);
+	}
+	state->ip = state->gpr[1] & ~(u32)1;
+}
+
+void NativeFunctions::Configure(bool enable_, std::string const &optout_list, bool validate_)
+{
+	enabled = enable_;
+	validate = validate_;
+
+	std::string_view list(optout_list);
+	while (!list.empty()) {
+		auto name = list.substr(0, list.find(':'));
+		list.remove_prefix(std::min(name.size() + 1, list.size()));
+		if (name.empty()) {
+			continue;
+		}
+		auto it = std::find(std::begin(native_names), std::end(native_names), name);
+		if (it == std::end(native_names)) {
+			Panic("unknown native function " + std::string(name));
+		}
+		optout[it - std::begin(native_names)] = true;
+	}
+}
+
+u64 NativeFunctions::Fingerprint()
+{
+	std::vector<std::pair<u32, NativeFnId>> sorted(bound.begin(), bound.end());
+	std::sort(sorted.begin(), sorted.end());
+	// FNV-1a
+	u64 h = 0xcbf29ce484222325ull;
+	for (auto [ip, id] : sorted) {
+		h = (h ^ ip) * 0x100000001b3ull;
+		h = (h ^ to_underlying(id)) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+void NativeFunctions::BindSymbols(std::vector<guestsyms::Function> const &funcs)
+{
+	if (!enabled) {
+		return;
+	}
+	DBT_TCACHE_LOCK();
+	for (auto const &f : funcs) {
+		auto it = std::find(std::begin(native_names), std::end(native_names), f.name);
+		if (it == std::end(native_names)) {
+			continue;
+		}
+		auto idx = it - std::begin(native_names);
+		if (optout[idx]) {
+			continue;
+		}
+		log_native("bind %s at %08x", *it, f.addr);
+		bound.insert({f.addr, (NativeFnId)idx});
+	}
+}
+
+} // namespace dbt::rv32
+
+extern "C" void __attribute__((used)) qcgstub_rv32_native(dbt::CPUState *state, u32 id)
+{
+	dbt::NativeFunctions::Call(state, (dbt::rv32::NativeFnId)id);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "dbt/guest/rv32_cpu.h"
+#include "dbt/tcache/guestsyms.h"
+#include "dbt/util/logger.h"
+
+#include <string>
+#include <unordered_map>
+
+namespace dbt::rv32
+{
+LOG_STREAM(native)
+
+#define NATIVE_LIBC_FUNCTIONS(X)                                                                             \
+	X(memcpy)                                                                                            \
+	X(memmove)                                                                                           \
+	X(memset)                                                                                            \
+	X(memcmp)                                                                                            \
+	X(memchr)                                                                                            \
+	X(strlen)                                                                                            \
+	X(strnlen)                                                                                           \
+	X(strcmp)                                                                                            \
+	X(strncmp)                                                                                           \
+	X(strchr)                                                                                            \
+	X(strchrnul)                                                                                         \
+	X(strcpy)
+
+// libgcc helpers of rv32i/soft-float builds, symbol names are prefixed with __
+#define NATIVE_LIBGCC_FUNCTIONS(X)                                                                           \
+	X(mulsi3)                                                                                            \
+	X(divsi3)                                                                                            \
+	X(udivsi3)                                                                                           \
+	X(modsi3)                                                                                            \
+	X(umodsi3)                                                                                           \
+	X(muldi3)                                                                                            \
+	X(divdi3)                                                                                            \
+	X(udivdi3)                                                                                           \
+	X(moddi3)                                                                                            \
+	X(umoddi3)                                                                                           \
+	X(ashldi3)                                                                                           \
+	X(lshrdi3)                                                                                           \
+	X(ashrdi3)                                                                                           \
+	X(adddf3)                                                                                            \
+	X(subdf3)                                                                                            \
+	X(muldf3)                                                                                            \
+	X(divdf3)                                                                                            \
+	X(negdf2)                                                                                            \
+	X(eqdf2)                                                                                             \
+	X(nedf2)                                                                                             \
+	X(ltdf2)                                                                                             \
+	X(ledf2)                                                                                             \
+	X(gtdf2)                                                                                             \
+	X(gedf2)                                                                                             \
+	X(unorddf2)                                                                                          \
+	X(floatsidf)                                                                                         \
+	X(floatunsidf)                                                                                       \
+	X(fixdfsi)                                                                                           \
+	X(fixunsdfsi)                                                                                        \
+	X(extendsfdf2)                                                                                       \
+	X(truncdfsf2)                                                                                        \
+	X(addsf3)                                                                                            \
+	X(subsf3)                                                                                            \
+	X(mulsf3)                                                                                            \
+	X(divsf3)                                                                                            \
+	X(negsf2)                                                                                            \
+	X(eqsf2)                                                                                             \
+	X(nesf2)                                                                                             \
+	X(ltsf2)                                                                                             \
+	X(lesf2)                                                                                             \
+	X(gtsf2)                                                                                             \
+	X(gesf2)                                                                                             \
+	X(unordsf2)                                                                                          \
+	X(floatsisf)                                                                                         \
+	X(floatunsisf)                                                                                       \
+	X(fixsfsi)                                                                                           \
+	X(fixunssfsi)
+
+#define NATIVE_FUNCTIONS(X) NATIVE_LIBC_FUNCTIONS(X) NATIVE_LIBGCC_FUNCTIONS(X)
+
+enum class NativeFnId : u32 {
+#define X(name) id_##name,
+	NATIVE_FUNCTIONS(X)
+#undef X
+	    Count,
+};
+
+// Hot guest functions replaced with host routines. Entries are bound by .symtab names at elf load,
+// translated code at the entry calls the routine on guest registers and returns to ra. Calls with
+// arguments out of the mapped guest memory continue in the translated guest body, it faults as usual.
+struct NativeFunctions {
+	// optout: function names separated by :
+	static void Configure(bool enable, std::string const &optout, bool validate);
+	static bool IsEnabled()
+	{
+		return enabled;
+	}
+	static void BindSymbols(std::vector<guestsyms::Function> const &funcs);
+	// Translations at and before bound entries depend on the bindings
+	static u64 Fingerprint();
+
+	static bool IsBound(u32 ip)
+	{
+		return !bound.empty() && bound.contains(ip);
+	}
+	static NativeFnId Lookup(u32 ip)
+	{
+		return bound.find(ip)->second;
+	}
+
+	// Sets ip to ra if the routine was called, leaves it at the entry otherwise
+	static void Call(CPUState *state, NativeFnId id);
+
+private:
+	NativeFunctions() = delete;
+
+	static bool enabled;
+	static bool validate;
+	static std::array<bool, to_underlying(NativeFnId::Count)> optout;
+	static std::unordered_map<u32, NativeFnId> bound;
+};
+
+} // namespace dbt::rv32
+
+namespace dbt
+{
+using NativeFunctions = rv32::NativeFunctions;
+} // namespace dbt
@@ -1,5 +1,6 @@
 #include "dbt/guest/rv32_qir.h"
 #include "dbt/guest/rv32_decode.h"
+#include "dbt/guest/rv32_native.h"
 #include "dbt/guest/rv32_runtime.h"
 #include "dbt/qmc/qir_printer.h"
 #include "dbt/tcache/cflow_dump.h"
@@ -61,10 +62,13 @@ StateInfo const *const RV32Translator::state_info = GetStateInfo();
 
 RV32Translator::RV32Translator(qir::Region *region_, uptr vmem) : qb(), vmem_base(vmem) {}
 
-void RV32Translator::Translate(qir::Region *region, CompilerJob::IpRangesSet *ipranges, uptr vmem)
+void RV32Translator::Translate(qir::Region *region, CompilerJob::IpRangesSet *ipranges, uptr vmem,
+			       CompilerJob::LiveInMap const *gregs_livein)
 {
 	log_qir("RV32Translator: start");
 	RV32Translator t(region, vmem);
+	t.gregs_livein = gregs_livein;
+	t.fault_sites = region->HasFaultSites();
 
 	for (auto const &range : *ipranges) {
 		t.ip2bb.insert({range.first, region->CreateBlock()});
@@ -91,6 +95,10 @@ void RV32Translator::TranslateIPRange(u32 ip, u32 boundary_ip)
 		qb.Create_hcall(RuntimeStubId::id_trace, vconst(0));
 	}
 
+	if (NativeFunctions::IsBound(ip)) {
+		TranslateNativeCall();
+	}
+
 	u32 num_insns = 0;
 	control = Control::NEXT;
 	while (true) {
@@ -99,7 +107,8 @@ void RV32Translator::TranslateIPRange(u32 ip, u32 boundary_ip)
 		if (control != Control::NEXT) {
 			break;
 		}
-		if (num_insns == TB_MAX_INSNS || insn_ip >= boundary_ip) {
+		if (num_insns == TB_MAX_INSNS || insn_ip >= boundary_ip ||
+		    NativeFunctions::IsBound(insn_ip)) {
 			control = Control::TB_OVF;
 			cflow_dump::RecordGBr(bb_ip, ip);
 			MakeGBr(insn_ip);
@@ -109,6 +118,29 @@ void RV32Translator::TranslateIPRange(u32 ip, u32 boundary_ip)
 	log_qir("RV32Translator: stop at %08x", ip);
 }
 
+// Function entry bound to a host routine: call it and return to ra. The routine leaves ip at the entry
+// if it can't be called, the guest body is translated after it for that case
+void RV32Translator::TranslateNativeCall()
+{
+	auto id = NativeFunctions::Lookup(insn_ip);
+	log_qir("  %08x:  native call %u", insn_ip, to_underlying(id));
+	PreSideeff();
+	qb.Create_hcall(RuntimeStubId::id_rv32_native, vconst(to_underlying(id)));
+
+	auto ip = VOperand::MakeVGPR(VType::I32, GlobalRegId::IP);
+	auto bb_body = qb.CreateBlock();
+	auto bb_ret = qb.CreateBlock();
+	qb.GetBlock()->AddSucc(bb_body);
+	qb.GetBlock()->AddSucc(bb_ret);
+	qb.Create_brcc(CondCode::EQ, ip, vconst(insn_ip), insn_ip);
+
+	qb = Builder(bb_ret);
+	cflow_dump::RecordGBrind(bb_ip);
+	qb.Create_gbrind(ip);
+
+	qb = Builder(bb_body);
+}
+
 // TODO: move to late qir pass?
 void RV32Translator::PreSideeff()
 {
@@ -125,6 +157,25 @@ void RV32Translator::TranslateInsn()
 	(this->*decoder::Decode(insn_ptr))(insn_ptr);
 }
 
+u64 RV32Translator::GetLiveGlobals(u32 ip)
+{
+	if (!gregs_livein) {
+		return qir::InstGBr::ALL_LIVE;
+	}
+	auto it = gregs_livein->find(ip);
+	if (it == gregs_livein->end()) {
+		return qir::InstGBr::ALL_LIVE;
+	}
+
+	u64 live = 1ull << GlobalRegId::IP;
+	for (u8 i = 1; i < 32; ++i) {
+		if (it->second & (1u << i)) {
+			live |= 1ull << (GlobalRegId::GPR_START + i - 1);
+		}
+	}
+	return live;
+}
+
 void RV32Translator::MakeGBr(u32 ip)
 {
 	auto it = ip2bb.find(ip);
@@ -132,7 +183,7 @@ void RV32Translator::MakeGBr(u32 ip)
 		qb.Create_br();
 		qb.GetBlock()->AddSucc(it->second);
 	} else {
-		qb.Create_gbr(vconst(ip));
+		qb.Create_gbr(vconst(ip), GetLiveGlobals(ip));
 	}
 }
 
@@ -146,7 +197,7 @@ void RV32Translator::TranslateBrcc(rv32::insn::B i, CondCode cc)
 			return it->second;
 		} else {
 			qb = Builder(qb.CreateBlock());
-			qb.Create_gbr(vconst(ip));
+			qb.Create_gbr(vconst(ip), GetLiveGlobals(ip));
 			return qb.GetBlock();
 		}
 	};
@@ -156,7 +207,7 @@ void RV32Translator::TranslateBrcc(rv32::insn::B i, CondCode cc)
 	auto bb_t = make_target(insn_ip + i.imm());
 	qb = Builder(bb_src);
 
-	qb.Create_brcc(cc, gprop(i.rs1()), gprop(i.rs2()));
+	qb.Create_brcc(cc, gprop(i.rs1()), gprop(i.rs2()), insn_ip);
 	qb.GetBlock()->AddSucc(bb_t);
 	qb.GetBlock()->AddSucc(bb_f);
 #else // TODO: qir cleanup pass: remove empty bb
@@ -165,7 +216,7 @@ void RV32Translator::TranslateBrcc(rv32::insn::B i, CondCode cc)
 
 	qb.GetBlock()->AddSucc(bb_t);
 	qb.GetBlock()->AddSucc(bb_f);
-	qb.Create_brcc(cc, gprop(i.rs1()), gprop(i.rs2()));
+	qb.Create_brcc(cc, gprop(i.rs1()), gprop(i.rs2()), insn_ip);
 
 	qb = Builder(bb_t);
 	MakeGBr(insn_ip + i.imm());
@@ -201,9 +252,9 @@ void RV32Translator::TranslateLoad(insn::I i, VType type, VSign sgn)
 		addr = tmp;
 	}
 	if (i.rd()) {
-		qb.Create_vmload(type, sgn, vgpr(i.rd()), addr);
+		qb.Create_vmload(type, sgn, vgpr(i.rd()), addr, insn_ip);
 	} else {
-		qb.Create_vmload(type, sgn, addr, addr);
+		qb.Create_vmload(type, sgn, addr, addr, insn_ip);
 	}
 }
 
@@ -216,7 +267,7 @@ void RV32Translator::TranslateStore(insn::S i, VType type, VSign sgn)
 		qb.Create_add(tmp, addr, vconst(i.imm()));
 		addr = tmp;
 	}
-	qb.Create_vmstore(type, sgn, addr, gprop(i.rs2(), type));
+	qb.Create_vmstore(type, sgn, addr, gprop(i.rs2(), type), insn_ip);
 }
 
 inline void RV32Translator::TranslateHelper(insn::Base i, RuntimeStubId stub)
@@ -242,8 +293,12 @@ static ALWAYS_INLINE void LogInsn(IType i, u32 ip)
 		insn::Insn_##name i{*(u32 *)insn};                                                           \
 		LogInsn(i, insn_ip);                                                                         \
 		static constexpr auto flags = decltype(i)::flags;                                            \
-		if constexpr (flags & insn::Flags::Trap || flags & insn::Flags::MayTrap) {                   \
+		if constexpr (flags & insn::Flags::Trap) {                                                   \
 			PreSideeff();                                                                        \
+		} else if constexpr (flags & insn::Flags::MayTrap) {                                         \
+			if (!fault_sites) {                                                                  \
+				PreSideeff();                                                                \
+			}                                                                                    \
 		}                                                                                            \
 		V_##name(i);                                                                                 \
 		if constexpr (flags & insn::Flags::Branch || flags & insn::Flags::Trap) {                    \
@@ -376,7 +431,12 @@ TRANSLATOR_ArithmRR(or, or);
 TRANSLATOR_ArithmRR(and, and);
 TRANSLATOR_Helper(fence);
 TRANSLATOR_Helper(fencei);
-TRANSLATOR_Helper(ecall);
+TRANSLATOR(ecall)
+{
+	TranslateHelper(i, RuntimeStubId::id_rv32_ecall);
+	cflow_dump::RecordGBr(bb_ip, insn_ip + 4);
+	MakeGBr(insn_ip + 4);
+}
 TRANSLATOR_Helper(ebreak);
 
 TRANSLATOR_Helper(ill);
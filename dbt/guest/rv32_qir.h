@@ -18,7 +18,8 @@ struct RV32Translator {
 	RV32_OPCODE_LIST()
 #undef OP
 
-	static void Translate(qir::Region *region, CompilerJob::IpRangesSet *ipranges, uptr vmem);
+	static void Translate(qir::Region *region, CompilerJob::IpRangesSet *ipranges, uptr vmem,
+			      CompilerJob::LiveInMap const *gregs_livein = nullptr);
 
 	static StateInfo const *const state_info;
 
@@ -27,9 +28,11 @@ private:
 
 	explicit RV32Translator(qir::Region *region, uptr vmem);
 	void TranslateIPRange(u32 ip, u32 boundary_ip);
+	void TranslateNativeCall();
 	void PreSideeff();
 	void TranslateInsn();
 
+	u64 GetLiveGlobals(u32 ip);
 	void MakeGBr(u32 ip);
 
 	void TranslateLoad(insn::I i, VType type, VSign sgn);
@@ -41,9 +44,11 @@ private:
 
 	qir::Builder qb;
 	std::map<u32, qir::Block *> ip2bb;
+	CompilerJob::LiveInMap const *gregs_livein{};
 
 	enum class Control { NEXT, BRANCH, TB_OVF } control{Control::NEXT};
 	uptr vmem_base{};
+	bool fault_sites{}; // memory accesses don't store ip, see Region::HasFaultSites
 	u32 insn_ip{0};
 	u32 bb_ip{}; // for cflow_dump
 };
@@ -8,6 +8,8 @@ namespace dbt::rv32
 
 struct Interpreter {
 	static void Execute(CPUState *state);
+	// Runs up to a branch or the end of the page, for code that is not worth translating
+	static void ExecuteBlock(CPUState *state);
 
 private:
 	Interpreter() = delete;
@@ -16,4 +16,5 @@
 	X(rv32_amominw)                                                                                      \
 	X(rv32_amomaxw)                                                                                      \
 	X(rv32_amominuw)                                                                                     \
-	X(rv32_amomaxuw)
+	X(rv32_amomaxuw)                                                                                     \
+	X(rv32_native)
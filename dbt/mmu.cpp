@@ -1,7 +1,13 @@
 #include "dbt/mmu.h"
 #include "dbt/ukernel.h"
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <map>
+#include <mutex>
+#include <set>
+#include <vector>
 
 namespace dbt
 {
@@ -21,95 +27,369 @@ void *host_mmap(void *addr, size_t len, int prot, int flags, int fd, __off_t off
 	return res;
 }
 
-u8 *mmu::base{nullptr};
-u32 mmu::mmap_hint_page = mmu::MIN_MMAP_ADDR >> mmu::PAGE_BITS;
-std::bitset<(mmu::ASPACE_SIZE >> mmu::PAGE_BITS)> mmu::used_pages;
+void host_hugepages(void *addr, size_t len)
+{
+	if (!mmu::hugepages) {
+		return;
+	}
+	if (madvise(addr, len, MADV_HUGEPAGE)) {
+		log_mmu("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+	}
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+void host_prefault(void *addr, size_t len)
+{
+	if (!mmu::prefault) {
+		return;
+	}
+	if (!madvise(addr, len, MADV_POPULATE_WRITE)) {
+		return;
+	}
+	// Older kernels, touch the pages
+	for (size_t offs = 0; offs < len; offs += mmu::PAGE_SIZE) {
+		auto p = (u8 volatile *)addr + offs;
+		*p = *p;
+	}
+}
+
+struct mmu::Space {
+	static constexpr u32 NUM_PAGES = ASPACE_SIZE >> PAGE_BITS;
+	// Non-fixed mappings are placed above, the ELF image and brk grow below
+	static constexpr u32 MMAP_BASE_PAGE = 256_MB >> PAGE_BITS;
+
+	Space();
+
+	u8 *base{nullptr};
+	u32 mmap_hint_page{MMAP_BASE_PAGE};
+
+	// Free extents [start, end) in pages, indexed by address and by (size, start) for best-fit
+	std::map<u32, u32> free_extents;
+	std::set<std::pair<u32, u32>> free_by_size;
+
+	// Guest protection of mapped ranges [start, end) in pages
+	struct Mapping {
+		u32 pend;
+		int prot;
+	};
+	std::map<u32, Mapping> mappings;
+	// Code pages are protected from translating threads, other updates come under mm_lock too
+	std::mutex lock;
+
+	void InsertExtent(u32 pstart, u32 pend);
+	void EraseExtent(std::map<u32, u32>::iterator it);
+
+	void MarkUsedPages(u32 pvaddr, u32 plen);
+	void MarkFreePages(u32 pvaddr, u32 plen);
+	bool HasFreePages(u32 pvaddr, u32 plen);
+	u32 LookupFreeRange(u32 pvaddr, u32 plen, u32 palign = 1);
+
+	void SetMapping(u32 pvaddr, u32 plen, int prot);
+	void EraseMappings(u32 pvaddr, u32 plen);
+	int GetProt(u32 pvaddr); // -1 if unmapped
+	void SetCodeProt(u32 pvaddr, bool is_code);
+	void ProtectCodePages(u32 pvaddr, u32 plen);
+};
+
+// Translations are shared by all spaces of the process, so are code pages. Taken before Space::lock
+static std::mutex spaces_lock;
+static std::vector<mmu::Space *> spaces;
+// Pages with translated code, host protection is guest protection without PROT_WRITE in every space
+static std::set<u32> code_pages;
+
+thread_local u8 *mmu::base{nullptr};
+thread_local mmu::Space *mmu::space{nullptr};
+bool mmu::hugepages{false};
+bool mmu::prefault{false};
+
+void mmu::Configure(bool hugepages_, bool prefault_)
+{
+	hugepages = hugepages_;
+	prefault = prefault_;
+}
 
 void mmu::Init()
 {
-	MarkUsedPages(0, MIN_MMAP_ADDR);
+	BindSpace(CreateSpace());
+}
+
+void mmu::Destroy()
+{
+	DestroySpace(space);
+	BindSpace(nullptr);
+}
+
+mmu::Space *mmu::CreateSpace()
+{
+	std::lock_guard lk(spaces_lock);
+	if (config::zero_membase && !spaces.empty()) {
+		Panic("zero membase allows only one guest address space");
+	}
+	auto s = new Space();
 
 	if constexpr (!config::zero_membase) {
 		// Allocate and immediately deallocate region, result is g2h(0)
-		base =
-		    (u8 *)::mmap(NULL, ASPACE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
-		if (base == MAP_FAILED || munmap(base + MIN_MMAP_ADDR, ASPACE_SIZE - MIN_MMAP_ADDR)) {
-			Panic("mmu::Init failed");
+		// Huge pages need the same alignment in guest and host addresses
+		size_t const slack = hugepages ? HUGE_PAGE_SIZE : 0;
+		auto res = (u8 *)::mmap(NULL, ASPACE_SIZE + slack, PROT_NONE,
+					MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+		if (res == MAP_FAILED) {
+			Panic("mmu::CreateSpace failed");
+		}
+		s->base = slack ? (u8 *)roundup((uptr)res, HUGE_PAGE_SIZE) : res;
+		int rc = ::munmap(s->base + MIN_MMAP_ADDR, ASPACE_SIZE - MIN_MMAP_ADDR);
+		if (!rc && s->base != res) {
+			rc = ::munmap(res, s->base - res);
+		}
+		if (!rc && slack) {
+			rc = ::munmap(s->base + ASPACE_SIZE, res + slack - s->base);
+		}
+		if (rc) {
+			Panic("mmu::CreateSpace failed");
 		}
 	}
-	log_mmu("mmu::base initialized at %p", base);
+	spaces.push_back(s);
+	log_mmu("mmu space initialized at %p", s->base);
+	return s;
 }
 
-void mmu::Destroy()
+void mmu::DestroySpace(Space *s)
 {
-	int rc = munmap(base, ASPACE_SIZE);
+	std::lock_guard lk(spaces_lock);
+	spaces.erase(std::find(spaces.begin(), spaces.end(), s));
+	int rc = ::munmap(s->base, ASPACE_SIZE);
 	if (rc) {
-		Panic("mmu::Destroy failed");
+		Panic("mmu::DestroySpace failed");
 	}
+	delete s;
+}
+
+void mmu::BindSpace(Space *s)
+{
+	space = s;
+	base = s ? s->base : nullptr;
 }
 
-void mmu::MarkUsedPages(u32 pvaddr, u32 plen)
+mmu::Space::Space()
 {
-	for (u32 p = pvaddr; p < plen; ++p) {
-		used_pages.set(p);
+	InsertExtent(0, NUM_PAGES);
+	MarkUsedPages(0, MMAP_BASE_PAGE);
+}
+
+void mmu::Space::InsertExtent(u32 pstart, u32 pend)
+{
+	free_extents.emplace(pstart, pend);
+	free_by_size.emplace(pend - pstart, pstart);
+}
+
+void mmu::Space::EraseExtent(std::map<u32, u32>::iterator it)
+{
+	free_by_size.erase({it->second - it->first, it->first});
+	free_extents.erase(it);
+}
+
+void mmu::Space::MarkUsedPages(u32 pvaddr, u32 plen)
+{
+	u32 const pend = pvaddr + plen;
+	auto it = free_extents.upper_bound(pvaddr);
+	if (it != free_extents.begin() && std::prev(it)->second > pvaddr) {
+		--it;
+	}
+	while (it != free_extents.end() && it->first < pend) {
+		auto [fstart, fend] = *it;
+		EraseExtent(it++);
+		if (fstart < pvaddr) {
+			InsertExtent(fstart, pvaddr);
+		}
+		if (fend > pend) {
+			InsertExtent(pend, fend);
+		}
 	}
 }
 
-void mmu::MarkFreePages(u32 pvaddr, u32 plen)
+void mmu::Space::MarkFreePages(u32 pvaddr, u32 plen)
 {
-	for (u32 p = pvaddr; p < plen; ++p) {
-		used_pages.reset(p);
+	MarkUsedPages(pvaddr, plen);
+	u32 pstart = pvaddr, pend = pvaddr + plen;
+
+	auto next = free_extents.find(pend);
+	if (next != free_extents.end()) {
+		pend = next->second;
+		EraseExtent(next);
+	}
+	auto prev = free_extents.lower_bound(pstart);
+	if (prev != free_extents.begin() && std::prev(prev)->second == pstart) {
+		--prev;
+		pstart = prev->first;
+		EraseExtent(prev);
+	}
+	InsertExtent(pstart, pend);
+}
+
+bool mmu::Space::HasFreePages(u32 pvaddr, u32 plen)
+{
+	auto it = free_extents.lower_bound(pvaddr);
+	if (it != free_extents.end() && it->first < pvaddr + plen) {
+		return true;
 	}
+	return it != free_extents.begin() && std::prev(it)->second > pvaddr;
 }
 
-u32 mmu::LookupFreeRange(u32 pvaddr, u32 plen)
+// Take the range at the hint if it fits, best-fit extent otherwise. palign is a power of two
+u32 mmu::Space::LookupFreeRange(u32 pvaddr, u32 plen, u32 palign)
 {
-	u32 count = plen;
-	for (u32 p = pvaddr; p < ASPACE_SIZE >> PAGE_BITS; ++p) {
-		if (used_pages.test(p)) {
-			count = plen;
-		} else if (--count == 0) {
-			return p + 1 - plen;
+	auto it = free_extents.upper_bound(pvaddr);
+	if (it != free_extents.begin() && std::prev(it)->second > pvaddr) {
+		--it;
+	}
+	if (it != free_extents.end()) {
+		u64 pstart = roundup((u64)std::max(it->first, pvaddr), palign);
+		if (pstart + plen <= it->second) {
+			return pstart;
 		}
 	}
+	// Any extent of this size fits an aligned range
+	auto bf = free_by_size.lower_bound({plen + palign - 1, 0});
+	if (bf != free_by_size.end()) {
+		return roundup(bf->second, palign);
+	}
 	return 0;
 }
 
+void mmu::Space::EraseMappings(u32 pvaddr, u32 plen)
+{
+	u32 const pend = pvaddr + plen;
+	auto it = mappings.upper_bound(pvaddr);
+	if (it != mappings.begin() && std::prev(it)->second.pend > pvaddr) {
+		--it;
+	}
+	while (it != mappings.end() && it->first < pend) {
+		auto [mstart, m] = *it;
+		it = mappings.erase(it);
+		if (mstart < pvaddr) {
+			mappings.emplace(mstart, Mapping{pvaddr, m.prot});
+		}
+		if (m.pend > pend) {
+			mappings.emplace(pend, Mapping{m.pend, m.prot});
+		}
+	}
+}
+
+void mmu::Space::SetMapping(u32 pvaddr, u32 plen, int prot)
+{
+	EraseMappings(pvaddr, plen);
+	u32 pstart = pvaddr, pend = pvaddr + plen;
+
+	auto next = mappings.find(pend);
+	if (next != mappings.end() && next->second.prot == prot) {
+		pend = next->second.pend;
+		mappings.erase(next);
+	}
+	auto prev = mappings.lower_bound(pstart);
+	if (prev != mappings.begin() && std::prev(prev)->second.pend == pstart &&
+	    std::prev(prev)->second.prot == prot) {
+		--prev;
+		pstart = prev->first;
+		mappings.erase(prev);
+	}
+	mappings.emplace(pstart, Mapping{pend, prot});
+}
+
+int mmu::Space::GetProt(u32 pvaddr)
+{
+	auto it = mappings.upper_bound(pvaddr);
+	if (it == mappings.begin() || std::prev(it)->second.pend <= pvaddr) {
+		return -1;
+	}
+	return std::prev(it)->second.prot;
+}
+
+// Only writable mappings are changed, each protected page splits the vma and any huge page backing it.
+// Text is usually read-only, so --hugepages keeps working for it
+void mmu::Space::SetCodeProt(u32 pvaddr, bool is_code)
+{
+	int prot = GetProt(pvaddr);
+	if (prot > 0 && (prot & PROT_WRITE)) {
+		int host_prot = is_code ? prot & ~PROT_WRITE : prot;
+		if (::mprotect(base + ((uptr)pvaddr << PAGE_BITS), PAGE_SIZE, host_prot)) {
+			Panic("mmu::SetCodeProt failed");
+		}
+	}
+}
+
+// Reapply after the guest (re)maps the range, translations of the old contents are still alive
+void mmu::Space::ProtectCodePages(u32 pvaddr, u32 plen)
+{
+	auto it = code_pages.lower_bound(pvaddr);
+	for (; it != code_pages.end() && *it < pvaddr + plen; ++it) {
+		SetCodeProt(*it, true);
+	}
+}
+
+// Populating before madvise would fault in small pages. Writable executable ranges are where guests
+// generate code, SetCodeProt splits them into small pages anyway
+static void *MapAdvised(void *hptr, size_t len, int prot, int flags, int fd, size_t offs)
+{
+	bool const populate = flags & MAP_POPULATE;
+	void *res = ::mmap(hptr, len, prot, flags & ~MAP_POPULATE, fd, offs);
+	if (res == MAP_FAILED) {
+		return res;
+	}
+	if ((prot & (PROT_WRITE | PROT_EXEC)) != (PROT_WRITE | PROT_EXEC)) {
+		host_hugepages(res, len);
+	}
+	if (populate) {
+		int advice = (prot & PROT_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+		if (madvise(res, len, advice) && madvise(res, len, MADV_WILLNEED)) {
+			log_mmu("mmu::mmap: prefault failed: %s", strerror(errno));
+		}
+	}
+	return res;
+}
+
 void *mmu::mmap(u32 vaddr, u32 len, int prot, int flags, int fd, size_t offs)
 {
 	assert((u64)vaddr + len - 1 < ASPACE_SIZE);
 	len = roundup(len, PAGE_SIZE);
 	u32 const plen = len >> PAGE_BITS;
+	std::lock_guard slk(spaces_lock);
+	std::lock_guard lk(space->lock);
 
 	if (flags & MAP_FIXED) {
 		void *hptr = g2h(vaddr);
-		hptr = ::mmap(hptr, len, prot, flags, fd, offs);
+		hptr = MapAdvised(hptr, len, prot, flags, fd, offs);
 		if (hptr == MAP_FAILED) {
 			log_mmu("mmu::mmap fixed failed");
 			return MAP_FAILED;
 		}
 		log_mmu("mmu::mmap allocated at %p sz=0x%08x", hptr, len);
-		MarkUsedPages(vaddr >> PAGE_BITS, plen);
+		space->MarkUsedPages(vaddr >> PAGE_BITS, plen);
+		space->SetMapping(vaddr >> PAGE_BITS, plen, prot);
+		space->ProtectCodePages(vaddr >> PAGE_BITS, plen);
 		return hptr;
 	}
 
-	u32 paddr = mmap_hint_page;
-	bool paddr_wrapped = false;
+	// Huge page aligned placement for large ranges, so that the whole range can be backed by them
+	u32 palign = 1;
+	if (hugepages && len >= HUGE_PAGE_SIZE) {
+		palign = HUGE_PAGE_SIZE >> PAGE_BITS;
+	}
+
+	u32 paddr;
 	void *hptr;
 	while (1) {
-		while (1) {
-			paddr = LookupFreeRange(paddr, plen);
-			if (paddr_wrapped && (paddr == 0 || paddr > mmap_hint_page)) {
-				log_mmu("mmu::mmap: no free range in vm");
-				return MAP_FAILED;
-			}
-			if (paddr == 0) {
-				log_mmu("mmu::mmap: vm lookup wrapped");
-				paddr_wrapped = true;
-				paddr = MIN_MMAP_ADDR >> PAGE_BITS;
-			} else {
-				break;
-			}
+		paddr = space->LookupFreeRange(space->mmap_hint_page, plen, palign);
+		if (paddr == 0 && palign != 1) {
+			palign = 1;
+			continue;
+		}
+		if (paddr == 0) {
+			log_mmu("mmu::mmap: no free range in vm");
+			return MAP_FAILED;
 		}
 
 		log_mmu("mmu::mmap: try at %p", g2h(paddr << PAGE_BITS));
@@ -118,25 +398,124 @@ void *mmu::mmap(u32 vaddr, u32 len, int prot, int flags, int fd, size_t offs)
 		if (hptr == MAP_FAILED) {
 			Panic("mmu::mmap failed, probably host oom");
 		}
-		if (check_h2g((u8 *)hptr + len - 1)) {
+		if (hptr == g2h(paddr << PAGE_BITS)) {
 			break;
 		}
+		// Occupied by a host mapping, don't try this range again
 		log_mmu("mmu::mmap: miss %p", hptr);
 		if (::munmap(hptr, len) != 0) {
 			Panic();
 		}
-		paddr += plen;
+		space->MarkUsedPages(paddr, plen);
 	}
 
-	void *res = ::mmap(hptr, len, prot, flags | MAP_FIXED, fd, offs);
+	void *res = MapAdvised(hptr, len, prot, flags | MAP_FIXED, fd, offs);
 	if (res == MAP_FAILED || res != hptr) {
 		Panic();
 	}
 	log_mmu("mmu::mmap allocated at %p sz=0x%08x", hptr, len);
-	paddr = h2g(hptr) >> PAGE_BITS;
-	MarkUsedPages(paddr, plen);
-	mmap_hint_page = paddr + plen;
+	space->MarkUsedPages(paddr, plen);
+	space->SetMapping(paddr, plen, prot);
+	space->ProtectCodePages(paddr, plen);
+	space->mmap_hint_page = paddr + plen;
 	return res;
 }
 
+int mmu::munmap(u32 vaddr, u32 len)
+{
+	if ((vaddr & ~PAGE_MASK) || (u64)vaddr + len > ASPACE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = roundup(len, PAGE_SIZE);
+	std::lock_guard lk(space->lock);
+	if (int rc = ::munmap(g2h(vaddr), len); rc) {
+		return rc;
+	}
+	u32 pstart = vaddr >> PAGE_BITS, pend = pstart + (len >> PAGE_BITS);
+	space->EraseMappings(pstart, pend - pstart);
+	pstart = std::max(pstart, Space::MMAP_BASE_PAGE);
+	if (pstart < pend) {
+		space->MarkFreePages(pstart, pend - pstart);
+	}
+	return 0;
+}
+
+void mmu::Prefault(u32 vaddr, u32 len)
+{
+	host_prefault(g2h(vaddr), len);
+}
+
+int mmu::mprotect(u32 vaddr, u32 len, int prot)
+{
+	if ((vaddr & ~PAGE_MASK) || (u64)vaddr + len > ASPACE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = roundup(len, PAGE_SIZE);
+	u32 const pstart = vaddr >> PAGE_BITS, pend = pstart + (len >> PAGE_BITS);
+	std::lock_guard slk(spaces_lock);
+	std::lock_guard lk(space->lock);
+	if (space->HasFreePages(pstart, pend - pstart)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (int rc = ::mprotect(g2h(vaddr), len, prot); rc) {
+		return rc;
+	}
+	space->SetMapping(pstart, pend - pstart, prot);
+	space->ProtectCodePages(pstart, pend - pstart);
+	return 0;
+}
+
+void mmu::ProtectCodePage(u32 vaddr)
+{
+	u32 const pvaddr = vaddr >> PAGE_BITS;
+	std::lock_guard slk(spaces_lock);
+	if (!code_pages.insert(pvaddr).second) {
+		return;
+	}
+	log_mmu("write-protect code page %08x", vaddr);
+	for (auto s : spaces) {
+		std::lock_guard lk(s->lock);
+		s->SetCodeProt(pvaddr, true);
+	}
+}
+
+bool mmu::UnprotectCodePage(u32 vaddr)
+{
+	u32 const pvaddr = vaddr >> PAGE_BITS;
+	std::lock_guard slk(spaces_lock);
+	if (!code_pages.erase(pvaddr)) {
+		return false;
+	}
+	for (auto s : spaces) {
+		std::lock_guard lk(s->lock);
+		s->SetCodeProt(pvaddr, false);
+	}
+	return true;
+}
+
+bool mmu::IsGuestWritable(u32 vaddr)
+{
+	std::lock_guard lk(space->lock);
+	int prot = space->GetProt(vaddr >> PAGE_BITS);
+	return prot > 0 && (prot & PROT_WRITE);
+}
+
+bool mmu::IsGuestMapped(u32 vaddr, u32 len, int prot)
+{
+	u64 const pend = ((u64)vaddr + len + PAGE_SIZE - 1) >> PAGE_BITS;
+	std::lock_guard lk(space->lock);
+	for (u64 p = vaddr >> PAGE_BITS; p < pend;) {
+		auto it = space->mappings.upper_bound(p);
+		if (it == space->mappings.begin() || std::prev(it)->second.pend <= p ||
+		    (std::prev(it)->second.prot & prot) != prot) {
+			return false;
+		}
+		p = std::prev(it)->second.pend;
+	}
+	return true;
+}
+
 } // namespace dbt
@@ -2,7 +2,6 @@
 
 #include "dbt/util/allocator.h"
 #include "dbt/util/logger.h"
-#include <bitset>
 #include <cstdint>
 #include <unordered_map>
 extern "C" {
@@ -18,10 +17,47 @@ struct mmu {
 	static constexpr size_t PAGE_SIZE = 1 << PAGE_BITS;
 	static constexpr size_t PAGE_MASK = ~(PAGE_SIZE - 1);
 	static constexpr size_t MIN_MMAP_ADDR = 16 * PAGE_SIZE;
+	static constexpr size_t HUGE_PAGE_SIZE = 2_MB;
+
+	// Call before Init: back mappings with transparent huge pages, prefault hot ranges. Write-protected
+	// code pages split huge pages, see SetCodeProt
+	static void Configure(bool hugepages_, bool prefault_);
 	static void Init();
 	static void Destroy();
+
+	// Guest address space, bound to the host threads executing the guest process. Zero membase builds
+	// allow only one per host process
+	struct Space;
+	static Space *CreateSpace();
+	static void DestroySpace(Space *s);
+	static void BindSpace(Space *s);
+	static Space *CurrentSpace()
+	{
+		return space;
+	}
+
 	static void *mmap(u32 vaddr, u32 len, int prot, int flag = MAP_ANON | MAP_PRIVATE | MAP_FIXED,
 			  int fd = -1, size_t offs = 0);
+	// Return -1 and set errno on failure, as the host calls do
+	static int munmap(u32 vaddr, u32 len);
+	static int mprotect(u32 vaddr, u32 len, int prot);
+
+	// Self-modifying code detection: guest pages with translated code are not writable on the host.
+	// The translation cache is shared by all spaces, so protection applies to each of them
+	static void ProtectCodePage(u32 vaddr);
+	// Returns false if the page wasn't protected, guest protection is restored otherwise
+	static bool UnprotectCodePage(u32 vaddr);
+	static bool IsGuestWritable(u32 vaddr);
+	// The whole range is mapped with prot, for buffers the host accesses outside of syscalls
+	static bool IsGuestMapped(u32 vaddr, u32 len, int prot);
+
+	// Fault in a mapped range ahead of use
+	static void Prefault(u32 vaddr, u32 len);
+	// Extra mmap flags for the ranges used right after mapping
+	static int HotMapFlags()
+	{
+		return prefault ? MAP_POPULATE : 0;
+	}
 
 	static ALWAYS_INLINE bool check_h2g(void *hptr)
 	{
@@ -38,15 +74,14 @@ struct mmu {
 		return base + gptr;
 	}
 
-	static u8 *base;
+	static thread_local u8 *base;
 
 private:
-	static std::bitset<(ASPACE_SIZE >> PAGE_BITS)> used_pages;
-	static u32 mmap_hint_page;
+	friend void host_hugepages(void *addr, size_t len);
+	friend void host_prefault(void *addr, size_t len);
 
-	static void MarkUsedPages(u32 pvaddr, u32 plen);
-	static void MarkFreePages(u32 pvaddr, u32 plen);
-	static u32 LookupFreeRange(u32 pvaddr, u32 plen);
+	static thread_local Space *space;
+	static bool hugepages, prefault;
 
 	mmu() = delete;
 };
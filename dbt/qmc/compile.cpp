@@ -2,26 +2,32 @@
 #include "dbt/guest/rv32_qir.h"
 #include "dbt/qmc/qcg/qcg.h"
 #include "dbt/qmc/qir_printer.h"
+#include "dbt/util/stats.h"
 
 namespace dbt::qir
 {
+STAT_HISTOGRAM(compile_ns);
+STAT_HISTOGRAM(compile_code_bytes);
 
 void *CompilerDoJob(CompilerJob &job)
 {
+	StatHistogram::ScopedTimer timer(stat_compile_ns);
 	MemArena arena(1_MB);
 
 	auto entry_ip = job.iprange[0].first;
 	auto region = CompilerGenRegionIR(&arena, job);
 
 	auto tcode = qcg::GenerateCode(job.cruntime, &job.segment, region, entry_ip);
+	stat_compile_code_bytes.Record(tcode.size());
 	return job.cruntime->AnnounceRegion(entry_ip, tcode);
 }
 
 qir::Region *CompilerGenRegionIR(MemArena *arena, CompilerJob &job)
 {
 	auto *region = arena->New<Region>(arena, IRTranslator::state_info);
+	region->SetFaultSites(!job.cruntime->AllowsRelocation());
 
-	IRTranslator::Translate(region, &job.iprange, job.vmem);
+	IRTranslator::Translate(region, &job.iprange, job.vmem, job.gregs_livein);
 	PrinterPass::run(log_qir, "Initial IR after IRTranslator", region);
 
 	return region;
@@ -4,18 +4,31 @@
 #include "dbt/util/common.h"
 #include <span>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 namespace dbt
 {
 using IpRange = std::pair<u32, u32>;
 
+// Guest global not written back to CPUState at a vmload/vmstore, held in a host register
+struct FaultDirtyGlobal {
+	u16 state_offs;
+	u8 hreg;
+};
+
 struct CompilerRuntime {
 	virtual void *AllocateCode(size_t sz, uint align) = 0;
 
 	virtual bool AllowsRelocation() const = 0;
 
 	virtual void *AnnounceRegion(u32 ip, std::span<u8> const &code) = 0;
+
+	// Relocatable mode only: lazy BranchSlot emitted in the code allocated above
+	virtual void AnnounceBranchSlot(void *slot) = 0;
+
+	// Non-relocatable mode only: guest state to recover if vmload/vmstore at hpc faults
+	virtual void AnnounceFaultSite(void *hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty) = 0;
 };
 
 static constexpr std::string_view AOT_SYM_PREFIX = "_x";
@@ -59,6 +72,11 @@ struct CompilerJob {
 	uptr vmem;
 	CodeSegment segment;
 	IpRangesSet iprange;
+
+	// Guest register live-in masks of analysed entries, other targets are assumed to use everything
+	// Valid while the analysed code is unchanged, tcache drops aot regions once any of it is rewritten
+	using LiveInMap = std::unordered_map<u32, u32>;
+	LiveInMap const *gregs_livein{};
 };
 
 // Now qmc operates only in synchronous mode, so returns a value from runtime.AnnounceRegion
@@ -40,29 +40,61 @@ namespace dbt::qir
 thread_local llvm::LLVMContext g_llvm_ctx;
 
 LLVMGenCtx::LLVMGenCtx(llvm::Module *cmodule_) : ctx(g_llvm_ctx), cmodule(*cmodule_)
+{
+	CreateFunctionTypes();
+
+	auto ptrty = llvm::PointerType::get(ctx, 0);
+	auto i32ty = llvm::Type::getInt32Ty(ctx);
+	brind_cache_entry_ty = llvm::StructType::create(ctx, {i32ty, ptrty}, "BrindCacheEntry");
+
+	auto mdb = llvm::MDBuilder(ctx);
+
+	md_unlikely = mdb.createBranchWeights(1, 12);
+
+	auto md_adomain = mdb.createAliasScopeDomain("alias_global_domain");
+	md_astate = mdb.createAliasScope("alias_state", md_adomain);
+	md_avmem = mdb.createAliasScope("alias_vmem", md_adomain);
+	md_aother = mdb.createAliasScope("alias_other", md_adomain);
+}
+
+void LLVMGenCtx::CreateFunctionTypes()
 {
 	auto voidty = llvm::Type::getVoidTy(ctx);
 	auto ptrty = llvm::PointerType::get(ctx, 0);
 	auto i8ptrty = llvm::Type::getInt8PtrTy(ctx);
 	auto i32ty = llvm::Type::getInt32Ty(ctx);
 
-	qcg_fnty = llvm::FunctionType::get(voidty, {i8ptrty, i8ptrty}, false);
+	// Foreign code enters with garbage in hot args, exported entries ignore them
+	std::vector<llvm::Type *> qcg_args = {i8ptrty, i8ptrty};
+	qcg_args.resize(2 + hot_state_offs.size(), i32ty);
+
+	qcg_fnty = llvm::FunctionType::get(voidty, qcg_args, false);
 	qcg_gbr_patch_fnty = llvm::FunctionType::get(voidty, {i8ptrty, i8ptrty, ptrty}, false);
 	qcg_stub_brind_fnty =
 	    llvm::FunctionType::get(llvm::PointerType::getUnqual(qcg_fnty), {i8ptrty, i32ty}, false);
 
 	qcg_helper_fnty = llvm::FunctionType::get(voidty, {i8ptrty, i32ty}, false);
+}
 
-	brind_cache_entry_ty = llvm::StructType::create(ctx, {i32ty, ptrty}, "BrindCacheEntry");
-
-	auto mdb = llvm::MDBuilder(ctx);
+void LLVMGenCtx::SetHotRegs(std::vector<u16> &&state_offs)
+{
+	assert(fn2seg.empty());
+	assert(state_offs.size() <= MAX_HOT_REGS);
+	hot_state_offs = std::move(state_offs);
+	CreateFunctionTypes();
+}
 
-	md_unlikely = mdb.createBranchWeights(1, 12);
+static std::string MakeRegionFnName(u32 region_ip)
+{
+	return MakeAotSymbol(region_ip) + ".body";
+}
 
-	auto md_adomain = mdb.createAliasScopeDomain("alias_global_domain");
-	md_astate = mdb.createAliasScope("alias_state", md_adomain);
-	md_avmem = mdb.createAliasScope("alias_vmem", md_adomain);
-	md_aother = mdb.createAliasScope("alias_other", md_adomain);
+llvm::Function *LLVMGenCtx::GetRegionFunction(u32 region_ip)
+{
+	if (hot_state_offs.empty()) {
+		return cmodule.getFunction(MakeAotSymbol(region_ip));
+	}
+	return cmodule.getFunction(MakeRegionFnName(region_ip));
 }
 
 void LLVMGenCtx::AddFunction(u32 region_ip, CodeSegment segment)
@@ -73,24 +105,41 @@ void LLVMGenCtx::AddFunction(u32 region_ip, CodeSegment segment)
 		return;
 	}
 
-	func = llvm::Function::Create(qcg_fnty, llvm::Function::ExternalLinkage, name, cmodule);
-	func->setDSOLocal(true);
-	func->setCallingConv(llvm::CallingConv::GHC);
-	func->setDoesNotThrow();
-	func->getArg(0)->addAttr(llvm::Attribute::NoAlias);
-	func->getArg(1)->addAttr(llvm::Attribute::NoAlias);
+	auto create_fn = [&](std::string const &fname, llvm::GlobalValue::LinkageTypes linkage) {
+		auto fn = llvm::Function::Create(qcg_fnty, linkage, fname, cmodule);
+		fn->setDSOLocal(true);
+		fn->setCallingConv(llvm::CallingConv::GHC);
+		fn->setDoesNotThrow();
+		fn->getArg(0)->addAttr(llvm::Attribute::NoAlias);
+		fn->getArg(1)->addAttr(llvm::Attribute::NoAlias);
+
+		fn->getArg(0)->setName("state");
+		fn->getArg(1)->setName("membase");
 
-	func->getArg(0)->setName("state");
-	func->getArg(1)->setName("membase");
+		// TODO: add segment id as MD_annotation
+		fn2seg.insert({fname, segment});
+		return fn;
+	};
 
-	// TODO: add segment id as MD_annotation
-	fn2seg.insert({name, segment});
+	func = create_fn(name, llvm::Function::ExternalLinkage);
+	if (hot_state_offs.empty()) {
+		return;
+	}
+
+	// Exported entry loads hot regs and jumps to the region body
+	auto body = create_fn(MakeRegionFnName(region_ip), llvm::Function::InternalLinkage);
+
+	LLVMGen gen(*this, func);
+	auto lirb = llvm::IRBuilder<>(llvm::BasicBlock::Create(ctx, "entry", func));
+	gen.lb = &lirb;
+	gen.CreateQCGFnCall(body, gen.LoadHotRegsFromState());
 }
 
-void LLVMGen::ExpandIntrinsics(bool is_final)
+u32 LLVMGen::ExpandIntrinsics(bool is_final)
 {
 	auto lirb = llvm::IRBuilder<>(lctx);
 	lb = &lirb;
+	u32 n_expanded = 0;
 
 	for (auto &bb : func->getBasicBlockList()) {
 		for (auto iit = bb.begin(); iit != bb.end(); ++iit) {
@@ -111,14 +160,20 @@ void LLVMGen::ExpandIntrinsics(bool is_final)
 				}
 				iit = call->eraseFromParent();
 				--iit;
+				n_expanded++;
 			}
 		}
 	}
+	return n_expanded;
 }
 
 llvm::PreservedAnalyses IntrinsicExpansionPass::run(llvm::Function &fn, llvm::FunctionAnalysisManager &fam)
 {
-	LLVMGen(ctx, &fn).ExpandIntrinsics(is_final);
+	auto n_expanded = LLVMGen(ctx, &fn).ExpandIntrinsics(is_final);
+	if (!n_expanded) {
+		return llvm::PreservedAnalyses::all();
+	}
+	ctx.n_intrin_expanded += n_expanded;
 	return llvm::PreservedAnalyses::none();
 }
 
@@ -231,9 +286,37 @@ void LLVMGen::Emit_gbr(qir::InstGBr *ins)
 }
 #endif
 
-void LLVMGen::CreateQCGFnCall(llvm::Value *fn)
+std::vector<llvm::Value *> LLVMGen::LoadHotRegsFromState()
+{
+	std::vector<llvm::Value *> res;
+	for (auto offs : g.hot_state_offs) {
+		auto ep = MakeStateEP(llvm::Type::getInt32PtrTy(lctx), offs);
+		res.push_back(AScopeState(lb->CreateAlignedLoad(lb->getInt32Ty(), ep, llvm::Align(4))));
+	}
+	return res;
+}
+
+void LLVMGen::StoreHotRegsToState(llvm::ArrayRef<llvm::Value *> hot_args)
+{
+	assert(hot_args.size() == g.hot_state_offs.size());
+	for (size_t i = 0; i < hot_args.size(); ++i) {
+		auto ep = MakeStateEP(llvm::Type::getInt32PtrTy(lctx), g.hot_state_offs[i]);
+		AScopeState(lb->CreateAlignedStore(hot_args[i], ep, llvm::Align(4)));
+	}
+}
+
+// Hot args are passed only to region functions of this module, undef for the rest
+void LLVMGen::CreateQCGFnCall(llvm::Value *fn, llvm::ArrayRef<llvm::Value *> hot_args)
 {
-	auto call = lb->CreateCall(g.qcg_fnty, fn, {statev, membasev});
+	std::vector<llvm::Value *> args = {statev, membasev};
+	if (hot_args.empty()) {
+		args.resize(2 + g.hot_state_offs.size(), llvm::UndefValue::get(lb->getInt32Ty()));
+	} else {
+		assert(hot_args.size() == g.hot_state_offs.size());
+		args.insert(args.end(), hot_args.begin(), hot_args.end());
+	}
+
+	auto call = lb->CreateCall(g.qcg_fnty, fn, args);
 	call->addFnAttr(llvm::Attribute::NoReturn);
 	call->setCallingConv(llvm::CallingConv::GHC);
 	call->setTailCall(true);
@@ -267,7 +350,24 @@ static std::string MakeGbrAsmString(u32 gip, bool cross_segment)
 	slot.gip = gip;
 	slot.flags.cross_segment = cross_segment;
 
-	return ".string \"" + MakeAsmString({(u8 *)&slot, sizeof(slot)}) + "\"";
+	// Register the slot in .aotslots (see LinkAOTObject)
+	// 8-byte alignment allows concurrent patching
+	std::string res = ".pushsection .aotslots,\"a\",@progbits\n.long 1f - .\n.popsection\n";
+	res += ".p2align 3\n1:\n";
+	return res + ".string \"" + MakeAsmString({(u8 *)&slot, sizeof(slot)}) + "\"";
+}
+
+// intr_gbr/intr_gbrind: (state, membase, gip, hot_args...)
+static llvm::FunctionType *MakeIntrinFnType(llvm::IRBuilder<> *lb, size_t n_hot_args)
+{
+	std::vector<llvm::Type *> args = {lb->getPtrTy(), lb->getPtrTy(), lb->getInt32Ty()};
+	args.resize(3 + n_hot_args, lb->getInt32Ty());
+	return llvm::FunctionType::get(lb->getVoidTy(), args, false);
+}
+
+static std::vector<llvm::Value *> GetIntrinHotArgs(llvm::CallInst *call)
+{
+	return {call->arg_begin() + 3, call->arg_end()};
 }
 
 static bool Expand_gbr(LLVMGen &gen, llvm::CallInst *call, bool must_expand)
@@ -278,17 +378,20 @@ static bool Expand_gbr(LLVMGen &gen, llvm::CallInst *call, bool must_expand)
 
 	auto *lb = gen.lb;
 	lb->GetInsertBlock()->getTerminator()->eraseFromParent();
-	gen.CreateQCGGbr(llvm::cast<llvm::ConstantInt>(call->getArgOperand(2))->getZExtValue(), true);
+	auto gip = llvm::cast<llvm::ConstantInt>(call->getArgOperand(2))->getZExtValue();
+	gen.CreateQCGGbr(gip, true, GetIntrinHotArgs(call));
 	return true;
 }
 
-void LLVMGen::CreateQCGGbr(u32 gip, bool must_expand)
+void LLVMGen::CreateQCGGbr(u32 gip, bool must_expand, llvm::ArrayRef<llvm::Value *> hot_args)
 {
-	if (auto tgtfn = cmodule.getFunction(MakeAotSymbol(gip)); tgtfn) {
+	if (auto tgtfn = g.GetRegionFunction(gip); tgtfn) {
 		// TODO: segment check?
 		// TODO(tuning): inlining heuristics
-		CreateQCGFnCall(tgtfn);
+		CreateQCGFnCall(tgtfn, hot_args);
 	} else if (must_expand) {
+		StoreHotRegsToState(hot_args);
+
 		// llvm.sponentry - crashes with my llvm build
 		// llvm.frameaddress - enforces frame creation in contradiction to ghccc
 		auto entrysp =
@@ -307,8 +410,7 @@ void LLVMGen::CreateQCGGbr(u32 gip, bool must_expand)
 
 		llvm::Function *intrin = cmodule.getFunction(intrin_name);
 		if (!intrin) {
-			auto ftype = llvm::FunctionType::get(
-			    lb->getVoidTy(), {lb->getPtrTy(), lb->getPtrTy(), lb->getInt32Ty()}, false);
+			auto ftype = MakeIntrinFnType(lb, g.hot_state_offs.size());
 			intrin = llvm::Function::Create(ftype, llvm::Function::ExternalLinkage, intrin_name,
 							cmodule);
 			intrin->setCallingConv(llvm::CallingConv::GHC);
@@ -318,7 +420,9 @@ void LLVMGen::CreateQCGGbr(u32 gip, bool must_expand)
 			g.intrin_fns.insert({intrin_name, Expand_gbr});
 		}
 
-		auto call = lb->CreateCall(intrin, {statev, membasev, constv<32>(gip)});
+		std::vector<llvm::Value *> args = {statev, membasev, constv<32>(gip)};
+		args.insert(args.end(), hot_args.begin(), hot_args.end());
+		auto call = lb->CreateCall(intrin, args);
 		call->setCallingConv(llvm::CallingConv::GHC);
 		call->setTailCall();
 		lb->CreateUnreachable();
@@ -326,7 +430,7 @@ void LLVMGen::CreateQCGGbr(u32 gip, bool must_expand)
 }
 
 QIRToLLVM::QIRToLLVM(LLVMGenCtx &g_, CodeSegment *segment_, qir::Region *region_, u32 region_ip)
-    : LLVMGen(g_, g_.cmodule.getFunction(MakeAotSymbol(region_ip))), region(region_)
+    : LLVMGen(g_, g_.GetRegionFunction(region_ip)), region(region_)
 {
 }
 
@@ -368,8 +472,23 @@ void QIRToLLVM::CreateVGPRLocs(qir::VRegsInfo *vinfo)
 	vlocs.clear();
 	vlocs_nglobals = vinfo->NumGlobals();
 
+	// Hot regs live in allocas, initialized from args
+	auto &hot_offs = g.hot_state_offs;
+	hot_vlocs.clear();
+	for (size_t k = 0; k < hot_offs.size(); ++k) {
+		auto alloca = lb->CreateAlloca(lb->getInt32Ty(), nullptr, "hot." + std::to_string(k));
+		lb->CreateAlignedStore(func->getArg(2 + k), alloca, llvm::Align(4));
+		hot_vlocs.push_back(alloca);
+	}
+
 	for (RegN i = 0; i < vlocs_nglobals; ++i) {
 		auto *info = vinfo->GetGlobalInfo(i);
+		auto hot_it = std::find(hot_offs.begin(), hot_offs.end(), info->state_offs);
+		if (hot_it != hot_offs.end()) {
+			assert(info->type == VType::I32);
+			vlocs.push_back(hot_vlocs[hot_it - hot_offs.begin()]);
+			continue;
+		}
 		auto state_ep = MakeStateEP(info->type, info->state_offs);
 		state_ep->setName(std::string("@") + info->name);
 		vlocs.push_back(state_ep);
@@ -383,6 +502,28 @@ void QIRToLLVM::CreateVGPRLocs(qir::VRegsInfo *vinfo)
 	}
 }
 
+std::vector<llvm::Value *> QIRToLLVM::LoadHotRegs()
+{
+	std::vector<llvm::Value *> res;
+	for (auto loc : hot_vlocs) {
+		res.push_back(lb->CreateAlignedLoad(lb->getInt32Ty(), loc, llvm::Align(4)));
+	}
+	return res;
+}
+
+void QIRToLLVM::SyncHotRegs()
+{
+	StoreHotRegsToState(LoadHotRegs());
+}
+
+void QIRToLLVM::ReloadHotRegs()
+{
+	auto vals = LoadHotRegsFromState();
+	for (size_t k = 0; k < vals.size(); ++k) {
+		lb->CreateAlignedStore(vals[k], hot_vlocs[k], llvm::Align(4));
+	}
+}
+
 llvm::Type *QIRToLLVM::MakeType(VType type)
 {
 	switch (type) {
@@ -439,9 +580,16 @@ std::pair<llvm::Value *, bool> QIRToLLVM::MakeVOperandEP(VOperand op)
 {
 	assert(!op.IsConst());
 	if (op.IsVGPR()) {
-		return std::make_pair(vlocs[op.GetVGPR()], op.GetVGPR() < vlocs_nglobals);
+		auto loc = vlocs[op.GetVGPR()];
+		bool is_state = op.GetVGPR() < vlocs_nglobals && !llvm::isa<llvm::AllocaInst>(loc);
+		return std::make_pair(loc, is_state);
 	}
 	if (op.IsGSlot()) {
+		auto &hot_offs = g.hot_state_offs;
+		auto hot_it = std::find(hot_offs.begin(), hot_offs.end(), op.GetSlotOffs());
+		if (hot_it != hot_offs.end()) {
+			return std::make_pair(hot_vlocs[hot_it - hot_offs.begin()], false);
+		}
 		return std::make_pair(MakeStateEP(op.GetType(), op.GetSlotOffs()), true);
 	}
 	unreachable("");
@@ -503,10 +651,13 @@ void QIRToLLVM::EmitTrace()
 
 void QIRToLLVM::Emit_hcall(qir::InstHcall *ins)
 {
-	lb->CreateCall(g.qcg_helper_fnty, MakeRStub(ins->stub, g.qcg_helper_fnty),
-		       {statev, LoadVOperand(ins->i(0))});
+	auto arg = LoadVOperand(ins->i(0));
+	SyncHotRegs();
+	lb->CreateCall(g.qcg_helper_fnty, MakeRStub(ins->stub, g.qcg_helper_fnty), {statev, arg});
 	if (--qbb->ilist.end() == ins) {
 		lb->CreateRetVoid();
+	} else {
+		ReloadHotRegs();
 	}
 }
 
@@ -532,7 +683,25 @@ void QIRToLLVM::Emit_brcc(qir::InstBrcc *ins)
 void QIRToLLVM::Emit_gbr(qir::InstGBr *ins)
 {
 	auto gip = ins->tpc.GetConst();
-	CreateQCGGbr(gip, false);
+	auto hot_args = LoadHotRegs();
+
+	// Dead globals: undef stores are erased by instcombine along with the stores they overwrite
+	for (RegN i = 0; i < vlocs_nglobals; ++i) {
+		if (ins->IsGlobalLive(i)) {
+			continue;
+		}
+		auto loc = vlocs[i];
+		auto hot_it = std::find(hot_vlocs.begin(), hot_vlocs.end(), loc);
+		if (hot_it != hot_vlocs.end()) {
+			hot_args[hot_it - hot_vlocs.begin()] = llvm::UndefValue::get(lb->getInt32Ty());
+			continue;
+		}
+		auto type = region->GetVRegsInfo()->GetGlobalInfo(i)->type;
+		auto store = lb->CreateAlignedStore(llvm::UndefValue::get(MakeType(type)), loc,
+						    llvm::Align(VTypeToSize(type)));
+		AScopeState(store);
+	}
+	CreateQCGGbr(gip, false, hot_args);
 }
 
 static bool Expand_gbrind(LLVMGen &gen, llvm::CallInst *call, bool must_expand)
@@ -544,7 +713,7 @@ static bool Expand_gbrind(LLVMGen &gen, llvm::CallInst *call, bool must_expand)
 		auto gip = llvm::cast<llvm::ConstantInt>(const_gipv)->getZExtValue();
 		log_qir("Optimized gbrind->gbr(%08x) in %s", gip, gen.func->getName());
 		lb->GetInsertBlock()->getTerminator()->eraseFromParent();
-		gen.CreateQCGGbr(gip, must_expand);
+		gen.CreateQCGGbr(gip, must_expand, GetIntrinHotArgs(call));
 		return true;
 	}
 
@@ -552,6 +721,7 @@ static bool Expand_gbrind(LLVMGen &gen, llvm::CallInst *call, bool must_expand)
 		return false;
 	}
 	lb->GetInsertBlock()->getTerminator()->eraseFromParent();
+	gen.StoreHotRegsToState(GetIntrinHotArgs(call));
 
 	auto slowp_bb = llvm::BasicBlock::Create(gen.lctx);
 	auto fastp_bb = llvm::BasicBlock::Create(gen.lctx);
@@ -606,8 +776,7 @@ void QIRToLLVM::Emit_gbrind(qir::InstGBrind *ins)
 
 	llvm::Function *intrin = cmodule.getFunction(intrin_name);
 	if (!intrin) {
-		auto ftype = llvm::FunctionType::get(
-		    lb->getVoidTy(), {lb->getPtrTy(), lb->getPtrTy(), lb->getInt32Ty()}, false);
+		auto ftype = MakeIntrinFnType(lb, g.hot_state_offs.size());
 		intrin = llvm::Function::Create(ftype, llvm::Function::ExternalLinkage, intrin_name, cmodule);
 		intrin->setCallingConv(llvm::CallingConv::GHC);
 		intrin->setDoesNotReturn();
@@ -616,7 +785,10 @@ void QIRToLLVM::Emit_gbrind(qir::InstGBrind *ins)
 		g.intrin_fns.insert({intrin_name, Expand_gbrind});
 	}
 
-	auto call = lb->CreateCall(intrin, {statev, membasev, gipv});
+	std::vector<llvm::Value *> args = {statev, membasev, gipv};
+	auto hot_args = LoadHotRegs();
+	args.insert(args.end(), hot_args.begin(), hot_args.end());
+	auto call = lb->CreateCall(intrin, args);
 	call->setCallingConv(llvm::CallingConv::GHC);
 	call->setTailCall();
 	lb->CreateUnreachable();
@@ -36,11 +36,24 @@ struct LLVMGenCtx {
 	llvm::MDNode *md_avmem{};
 	llvm::MDNode *md_aother{};
 
+	// Guest registers passed as extra qcg_fnty args between region functions, materialized in
+	// CPUState only at exits to the runtime or to foreign code
+	static constexpr u8 MAX_HOT_REGS = 8; // ghccc: 10 argument gprs, 2 are taken
+	std::vector<u16> hot_state_offs;
+
 	std::unordered_map<std::string, CodeSegment> fn2seg;
 	std::unordered_map<std::string_view, std::function<bool(LLVMGen &, llvm::CallInst *, bool)>>
 	    intrin_fns;
+	u64 n_intrin_expanded{0}; // fixed-point detection for optimization pipeline
 
+	// Call before AddFunction
+	void SetHotRegs(std::vector<u16> &&state_offs);
 	void AddFunction(u32 region_ip, CodeSegment segment);
+	// Function with region body, differs from the exported entry if hot regs are used
+	llvm::Function *GetRegionFunction(u32 region_ip);
+
+private:
+	void CreateFunctionTypes();
 };
 
 struct IntrinsicExpansionPass : public llvm::PassInfoMixin<IntrinsicExpansionPass> {
@@ -70,10 +83,13 @@ struct LLVMGen {
 		return llvm::ConstantInt::get(lctx, llvm::APInt(Bits, val));
 	}
 
-	void CreateQCGFnCall(llvm::Value *fn);
-	void CreateQCGGbr(u32 gipv, bool must_expand);
+	void CreateQCGFnCall(llvm::Value *fn, llvm::ArrayRef<llvm::Value *> hot_args = {});
+	void CreateQCGGbr(u32 gipv, bool must_expand, llvm::ArrayRef<llvm::Value *> hot_args);
+
+	std::vector<llvm::Value *> LoadHotRegsFromState();
+	void StoreHotRegsToState(llvm::ArrayRef<llvm::Value *> hot_args);
 
-	void ExpandIntrinsics(bool is_final);
+	u32 ExpandIntrinsics(bool is_final);
 
 	LLVMGenCtx &g;
 	llvm::LLVMContext &lctx;
@@ -120,6 +136,9 @@ private:
 	};
 
 	void CreateVGPRLocs(qir::VRegsInfo *vinfo);
+	std::vector<llvm::Value *> LoadHotRegs();
+	void SyncHotRegs();
+	void ReloadHotRegs();
 	llvm::Type *MakeType(VType type);
 	llvm::PointerType *MakePtrType(VType type);
 
@@ -142,6 +161,7 @@ private:
 	std::unordered_map<u32, llvm::BasicBlock *> id2bb;
 	std::vector<llvm::Value *> vlocs;
 	RegN vlocs_nglobals{};
+	std::vector<llvm::Value *> hot_vlocs;
 };
 
 } // namespace dbt::qir
@@ -116,6 +116,9 @@ static constexpr RegMask GPR_CALL_SAVED = GPR_ALL & ~GPR_CALL_CLOBBER;
 
 static constexpr u16 spillframe_size = 1024; // TODO: reuse temps
 
+// Fragment start alignment, loop headers are aligned relative to it
+static constexpr u16 CODE_ALIGN = 16;
+
 bool match_gp_const(qir::VType type, i64 val, RACtImm ct);
 
 void init();
@@ -5,6 +5,10 @@
 
 namespace dbt::jitabi
 {
+STAT_COUNTER(jit_lazy_link);
+STAT_COUNTER(jit_lazy_link_escape);
+STAT_COUNTER(jit_brind_slowpath);
+STAT_COUNTER(jit_brind_escape);
 
 struct _RetPair {
 	void *v0;
@@ -82,12 +86,13 @@ HELPER_ASM void qcgstub_escape_brind()
 // Caller uses 2nd value in returned pair as jump target
 static ALWAYS_INLINE _RetPair TryLinkBranch(CPUState *state, ppoint::BranchSlot *slot)
 {
+	stat_jit_lazy_link.Add();
 	auto found = tcache::Lookup(slot->gip);
 	if (likely(found)) {
-		slot->Link(found->tcode.ptr);
-		tcache::RecordLink(slot, found, slot->flags.cross_segment);
+		tcache::LinkBranch(slot, found);
 		return {slot, found->tcode.ptr};
 	}
+	stat_jit_lazy_link_escape.Add();
 	state->ip = slot->gip;
 	return {slot, (void *)qcgstub_escape_link};
 }
@@ -125,7 +130,7 @@ HELPER_ASM void qcgstub_link_branch_llvmaot()
 
 HELPER _RetPair qcg_TryLinkBranchJIT(CPUState *state, void *retaddr)
 {
-	return TryLinkBranch(state, ppoint::BranchSlot::FromCallPtrRetaddr(retaddr));
+	return TryLinkBranch(state, ppoint::BranchSlot::FromCallRel32Retaddr(retaddr));
 }
 
 HELPER _RetPair qcg_TryLinkBranchAOT(CPUState *state, void *retaddr)
@@ -142,12 +147,14 @@ HELPER _RetPair qcg_TryLinkBranchLLVMAOT(CPUState *state, void *retaddr, uptr in
 // Indirect branch slowpath
 HELPER void *qcgstub_brind(CPUState *state, u32 gip)
 {
+	stat_jit_brind_slowpath.Add();
 	state->ip = gip;
 	auto *found = tcache::Lookup(gip);
 	if (likely(found)) {
-		tcache::CacheBrind(found);
+		tcache::CacheBrind(state->l1_brind_cache, found);
 		return (void *)found->tcode.ptr;
 	}
+	stat_jit_brind_escape.Add();
 	return (void *)qcgstub_escape_brind;
 }
 
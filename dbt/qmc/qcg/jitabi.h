@@ -1,6 +1,7 @@
 #pragma once
 
 #include "dbt/qmc/qcg/arch_traits.h"
+#include <cstring>
 
 namespace dbt
 {
@@ -14,16 +15,9 @@ namespace ppoint
 {
 struct BranchSlot {
 private:
-	struct Call64Abs {
-		u64 op_mov_imm_rax : 16 = 0xb848;
-		u64 imm : 64;
-		u64 op_call_rax : 16 = 0xd0ff;
-	} __attribute__((packed));
-
-	struct Jump64Abs {
-		u64 op_mov_imm_rax : 16 = 0xb848;
-		u64 imm : 64;
-		u64 op_jmp_rax : 16 = 0xe0ff;
+	struct CallRel32 {
+		u64 op_call_imm : 8 = 0xe8;
+		u32 imm : 32;
 	} __attribute__((packed));
 
 	struct Jump32Rel {
@@ -40,10 +34,10 @@ private:
 
 	union {
 	private:
-		Call64Abs x0;
-		Jump64Abs x1;
-		Jump32Rel x2;
-		CallTab x3;
+		CallRel32 x0;
+		Jump32Rel x1;
+		CallTab x2;
+		u64 x3; // concurrent patching stores 8 bytes
 	} __attribute__((packed, may_alias)) code;
 
 	template <typename P, typename... Args>
@@ -53,16 +47,32 @@ private:
 		return new (&code) P(args...);
 	}
 
+	// The slot may be executed concurrently: replace the head with a single aligned 8-byte store,
+	// only short patches fit in it
+	template <typename P>
+	bool CommitConcurrent(P const &p)
+	{
+		static_assert(sizeof(P) <= sizeof(u64) && sizeof(code) >= sizeof(u64));
+		auto *head = (u64 *)&code;
+		if ((uptr)head % sizeof(u64)) {
+			return false;
+		}
+		u64 val = __atomic_load_n(head, __ATOMIC_RELAXED);
+		memcpy(&val, &p, sizeof(P));
+		__atomic_store_n(head, val, __ATOMIC_RELEASE);
+		return true;
+	}
+
 public:
-	void Link(void *to);
+	bool Link(void *to, bool concurrent = false);
 	void LinkLazyJIT();
-	void LinkLazyAOT(u16 stub_tab_offs);
+	void LinkLazyAOT(u16 stub_tab_offs, bool concurrent = false);
 	void LinkLazyLLVMAOT(u16 stub_tab_offs);
 
-	// Calculate BranchSlot* from retaddr if call by ptr was used
-	static BranchSlot *FromCallPtrRetaddr(void *ra)
+	// Calculate BranchSlot* from retaddr if call rel32 was used
+	static BranchSlot *FromCallRel32Retaddr(void *ra)
 	{
-		return (BranchSlot *)((uptr)ra - sizeof(Call64Abs));
+		return (BranchSlot *)((uptr)ra - sizeof(CallRel32));
 	}
 
 	// Calculate BranchSlot* from retaddr if RuntimeStub call was used
@@ -76,16 +86,28 @@ public:
 		bool cross_segment : 1 {false};
 	} flags;
 } __attribute__((packed));
+static_assert(sizeof(BranchSlot) == 13);
 
+// JIT slots live in the code pool, the link stub veneer is within rel32 reach
 inline void BranchSlot::LinkLazyJIT()
 {
-	CreatePatch<Call64Abs>()->imm =
-	    (uptr)(*RuntimeStubTab::GetGlobal())[RuntimeStubId::id_link_branch_jit];
+	auto stub = (*RuntimeStubTab::GetJIT())[RuntimeStubId::id_link_branch_jit];
+	iptr rel = (iptr)stub - ((iptr)&code + sizeof(CallRel32));
+	if ((i32)rel != rel) {
+		Panic("link_branch_jit stub is out of rel32 range");
+	}
+	CreatePatch<CallRel32>()->imm = rel;
 }
 
-inline void BranchSlot::LinkLazyAOT(u16 stub_tab_offs)
+inline void BranchSlot::LinkLazyAOT(u16 stub_tab_offs, bool concurrent)
 {
-	CreatePatch<CallTab>()->imm = stub_tab_offs + RuntimeStubTab::offs(RuntimeStubId::id_link_branch_aot);
+	CallTab p;
+	p.imm = stub_tab_offs + RuntimeStubTab::offs(RuntimeStubId::id_link_branch_aot);
+	if (!concurrent) {
+		*CreatePatch<CallTab>() = p;
+	} else if (!CommitConcurrent(p)) {
+		Panic("failed to unlink BranchSlot");
+	}
 }
 
 inline void BranchSlot::LinkLazyLLVMAOT(u16 stub_tab_offs)
@@ -94,14 +116,19 @@ inline void BranchSlot::LinkLazyLLVMAOT(u16 stub_tab_offs)
 	    stub_tab_offs + RuntimeStubTab::offs(RuntimeStubId::id_link_branch_llvmaot);
 }
 
-inline void BranchSlot::Link(void *to)
+inline bool BranchSlot::Link(void *to, bool concurrent)
 {
 	iptr rel = (iptr)to - ((iptr)&code + sizeof(Jump32Rel));
-	if ((i32)rel == rel) {
-		CreatePatch<Jump32Rel>()->imm = rel;
-	} else {
-		CreatePatch<Jump64Abs>()->imm = (uptr)to;
+	if ((i32)rel != rel) {
+		return false; // the caller might retry through a veneer
+	}
+	if (concurrent) {
+		Jump32Rel p;
+		p.imm = rel;
+		return CommitConcurrent(p);
 	}
+	CreatePatch<Jump32Rel>()->imm = rel;
+	return true;
 }
 
 } // namespace ppoint
@@ -1,6 +1,7 @@
 #include "dbt/qmc/qcg/qcg.h"
 #include "dbt/qmc/qcg/qemit.h"
 #include "dbt/qmc/qir_printer.h"
+#include "dbt/util/stats.h"
 
 namespace dbt::qcg
 {
@@ -17,16 +18,20 @@ private:
 	friend struct QCodegenVisitor;
 };
 
-std::span<u8> GenerateCode(CompilerRuntime *cruntime, qir::CodeSegment *segment, qir::Region *r, u32 ip)
+std::span<u8> GenerateCode(CompilerRuntime *cruntime, qir::CodeSegment *segment, qir::Region *r, u32 ip,
+			   CodegenProfile *prof)
 {
 	ArchTraits::init();
 	MachineRegionInfo mregion_info;
+	u64 t0 = prof ? stats::NowNs() : 0;
 
 	QSelPass::run(r, &mregion_info);
 	qir::PrinterPass::run(log_qcg, "IR dump after QSelPass", r);
+	u64 t1 = prof ? stats::NowNs() : 0;
 
-	QRegAllocPass::run(r);
+	QRegAllocPass::run(r, prof);
 	qir::PrinterPass::run(log_qcg, "IR dump after QRegAllocPass", r);
+	u64 t2 = prof ? stats::NowNs() : 0;
 
 	log_qcg("Emit machine instructions: reloc=%u is_leaf=%u", !cruntime->AllowsRelocation(),
 		!mregion_info.has_calls);
@@ -35,6 +40,15 @@ std::span<u8> GenerateCode(CompilerRuntime *cruntime, qir::CodeSegment *segment,
 	cg.Run(ip);
 
 	auto code = ce.EmitCode();
+	if (prof) {
+		prof->qsel_ns = t1 - t0;
+		prof->qra_ns = t2 - t1;
+		prof->emit_ns = stats::NowNs() - t2;
+		prof->n_insns = 0;
+		for (auto &bb : r->GetBlocks()) {
+			prof->n_insns += std::distance(bb.ilist.begin(), bb.ilist.end());
+		}
+	}
 	QEmit::DumpCode(code);
 	return code;
 }
@@ -65,9 +79,9 @@ void QCodegen::Run(u32 ip)
 	ce->Prologue(ip);
 	QCodegenVisitor vis(this);
 
-	for (auto &bb : region->GetBlocks()) {
-		ce->SetBlock(&bb);
-		auto &ilist = bb.ilist;
+	for (auto bb : ce->GetLayout()) {
+		ce->SetBlock(bb);
+		auto &ilist = bb->ilist;
 		for (auto iit = ilist.begin(); iit != ilist.end(); ++iit) {
 			vis.visit(&*iit);
 		}
@@ -8,7 +8,18 @@ namespace dbt::qcg
 
 LOG_STREAM(qcg);
 
-std::span<u8> GenerateCode(CompilerRuntime *cruntime, qir::CodeSegment *segment, qir::Region *r, u32 ip);
+// Per-pass costs of one GenerateCode call, filled on request
+struct CodegenProfile {
+	u64 qsel_ns{};
+	u64 qra_ns{};
+	u64 emit_ns{};
+	u32 n_insns{}; // after register allocation
+	u32 n_spills{};
+	u32 n_fills{};
+};
+
+std::span<u8> GenerateCode(CompilerRuntime *cruntime, qir::CodeSegment *segment, qir::Region *r, u32 ip,
+			   CodegenProfile *prof = nullptr);
 
 struct MachineRegionInfo {
 	bool has_calls = false;
@@ -19,7 +30,7 @@ struct QSelPass {
 };
 
 struct QRegAllocPass {
-	static void run(qir::Region *region);
+	static void run(qir::Region *region, CodegenProfile *prof = nullptr);
 };
 
 }; // namespace dbt::qcg
@@ -21,6 +21,119 @@ QEmit::QEmit(qir::Region *region, CompilerRuntime *cruntime_, qir::CodeSegment *
 	for (u32 i = 0; i < n_labels; ++i) {
 		labels.push_back(j.newLabel());
 	}
+	PlaceBlocks(region);
+}
+
+// Exits assumed not taken go to the cold section: exits from loops and, by BTFN, forward guest branches
+void QEmit::PlaceBlocks(qir::Region *region)
+{
+	u32 n_blocks = region->GetNumBlocks();
+	placement.resize(n_blocks);
+
+	// Loop headers are targets of DFS back edges
+	enum : u8 { NEW, ACTIVE, DONE };
+	std::vector<u8> dfs(n_blocks, NEW);
+	std::vector<std::pair<qir::Block *, u32>> stk;
+	for (auto &root : region->GetBlocks()) {
+		if (dfs[root.GetId()] != NEW) {
+			continue;
+		}
+		dfs[root.GetId()] = ACTIVE;
+		stk.push_back({&root, 0});
+		while (!stk.empty()) {
+			auto [b, idx] = stk.back();
+			auto &succs = b->GetSuccs();
+			if (idx == succs.size()) {
+				dfs[b->GetId()] = DONE;
+				stk.pop_back();
+				continue;
+			}
+			stk.back().second++;
+			auto s = succs[idx];
+			if (dfs[s->GetId()] == ACTIVE) {
+				placement[s->GetId()].loop_header = true;
+			} else if (dfs[s->GetId()] == NEW) {
+				dfs[s->GetId()] = ACTIVE;
+				stk.push_back({s, 0});
+			}
+		}
+	}
+
+	auto const terminator = [](qir::Block *b) { return &*--b->ilist.end(); };
+	auto const is_exit_stub = [&](qir::Block *b) {
+		return b->GetSuccs().empty() && b->GetPreds().size() == 1 &&
+		       terminator(b)->GetOpcode() == qir::Op::_gbr;
+	};
+	auto const exit_tpc = [&](qir::Block *b) {
+		return static_cast<qir::InstGBr *>(terminator(b))->tpc.GetConst();
+	};
+
+	auto entry = &*region->GetBlocks().begin();
+	for (auto &b : region->GetBlocks()) {
+		if (terminator(&b)->GetOpcode() != qir::Op::_brcc) {
+			continue;
+		}
+		auto bb_t = b.GetSuccs().at(0);
+		auto bb_f = b.GetSuccs().at(1);
+		bool t_exit = is_exit_stub(bb_t) && bb_t != entry;
+		bool f_exit = is_exit_stub(bb_f) && bb_f != entry;
+		qir::Block *unlikely = nullptr;
+		if (t_exit && f_exit) {
+			unlikely = exit_tpc(bb_t) > exit_tpc(bb_f) ? bb_t : bb_f;
+		} else if (t_exit || f_exit) {
+			// Backward exits are assumed taken
+			auto exit = t_exit ? bb_t : bb_f;
+			auto gip = static_cast<qir::InstBrcc *>(terminator(&b))->gip;
+			if (exit_tpc(exit) > gip) {
+				unlikely = exit;
+			}
+		}
+		if (unlikely) {
+			placement[unlikely->GetId()].cold = true;
+		}
+	}
+
+	for (auto &b : region->GetBlocks()) {
+		if (!placement[b.GetId()].cold) {
+			layout.push_back(&b);
+		}
+	}
+	size_t n_hot = layout.size();
+	for (auto &b : region->GetBlocks()) {
+		if (placement[b.GetId()].cold) {
+			layout.push_back(&b);
+		}
+	}
+	for (size_t i = 0; i + 1 < layout.size(); ++i) {
+		if (i + 1 != n_hot) {
+			placement[layout[i]->GetId()].next = layout[i + 1];
+		}
+	}
+	log_qcg("placement: %zu of %u blocks are cold", layout.size() - n_hot, n_blocks);
+}
+
+void QEmit::EnterColdSection()
+{
+	if (!cold_section) {
+		auto flags = asmjit::SectionFlags::kExecutable;
+		if (jcode.newSection(&cold_section, ".cold", SIZE_MAX, flags, ArchTraits::CODE_ALIGN)) {
+			Panic();
+		}
+	}
+	j.section(cold_section);
+}
+
+void QEmit::SetBlock(qir::Block *bb_)
+{
+	bb = bb_;
+	auto const &pl = placement[bb->GetId()];
+	if (pl.cold) {
+		EnterColdSection();
+	}
+	if (pl.loop_header) {
+		j.align(asmjit::AlignMode::kCode, ArchTraits::CODE_ALIGN);
+	}
+	j.bind(labels[bb->GetId()]);
 }
 
 std::span<u8> QEmit::EmitCode()
@@ -29,14 +142,29 @@ std::span<u8> QEmit::EmitCode()
 	jcode.resolveUnresolvedLinks();
 
 	size_t code_sz = jcode.codeSize();
-	void *code_ptr = cruntime->AllocateCode(code_sz, 8);
+	void *code_ptr = cruntime->AllocateCode(code_sz, ArchTraits::CODE_ALIGN);
 	if (code_ptr == nullptr) {
 		Panic();
 	}
 
 	jcode.relocateToBase((uptr)code_ptr);
-	jcode.copyFlattenedData(code_ptr, code_sz);
+	jcode.copyFlattenedData(code_ptr, code_sz, asmjit::CopySectionFlags::kPadSectionBuffer);
 	code_sz = jcode.codeSize();
+
+	for (auto label : branch_slots) {
+		auto offs = jcode.labelOffsetFromBase(label);
+		auto slot = (jitabi::ppoint::BranchSlot *)((u8 *)code_ptr + offs);
+		if (jit_mode) {
+			slot->LinkLazyJIT(); // rel32, so only at the final address
+		} else {
+			cruntime->AnnounceBranchSlot(slot);
+		}
+	}
+	for (auto const &fs : fault_sites) {
+		auto dirty = std::span{fs.site->dirty.data(), fs.site->n_dirty};
+		auto offs = jcode.labelOffsetFromBase(fs.label);
+		cruntime->AnnounceFaultSite((u8 *)code_ptr + offs, fs.gip, dirty);
+	}
 	return {(u8 *)code_ptr, code_sz};
 }
 
@@ -193,7 +321,7 @@ void QEmit::Emit_hcall(qir::InstHcall *ins)
 void QEmit::Emit_br(qir::InstBr *ins)
 {
 	auto bb_s = bb->GetSuccs().at(0);
-	auto bb_ff = &*++bb->getIter();
+	auto bb_ff = placement[bb->GetId()].next;
 	if (bb_s != bb_ff) {
 		j.jmp(labels[bb_s->GetId()]);
 	}
@@ -203,7 +331,7 @@ void QEmit::Emit_brcc(qir::InstBrcc *ins)
 {
 	auto bb_t = bb->GetSuccs().at(0);
 	auto bb_f = bb->GetSuccs().at(1);
-	auto bb_ff = &*++bb->getIter();
+	auto bb_ff = placement[bb->GetId()].next;
 
 	auto &vs0 = ins->i(0);
 	auto &vs1 = ins->i(1);
@@ -214,6 +342,10 @@ void QEmit::Emit_brcc(qir::InstBrcc *ins)
 		ins->cc = qir::SwapCC(ins->cc);
 	}
 	auto cc = ins->cc;
+	if (bb_t == bb_ff) {
+		std::swap(bb_t, bb_f);
+		cc = qir::InverseCC(cc);
+	}
 
 	j.emit(asmjit::x86::Inst::kIdCmp, make_operand(vs0), make_operand(vs1));
 	auto jcc = asmjit::x86::Inst::jccFromCond(make_cc(cc));
@@ -228,13 +360,15 @@ void QEmit::Emit_gbr(qir::InstGBr *ins)
 {
 	FrameDestroy();
 	static constexpr size_t patch_size = sizeof(jitabi::ppoint::BranchSlot);
+	j.align(asmjit::AlignMode::kCode, 8); // for atomic patching
+	auto slot_label = j.newLabel();
+	j.bind(slot_label);
+	branch_slots.push_back(slot_label);
 	j.embedUInt8(0, patch_size);
 	auto *slot = (jitabi::ppoint::BranchSlot *)(j.bufferPtr() - patch_size);
 	slot->gip = ins->tpc.GetConst();
 	slot->flags.cross_segment = !segment->InSegment(slot->gip);
-	if (jit_mode) {
-		slot->LinkLazyJIT();
-	} else {
+	if (!jit_mode) {
 		slot->LinkLazyAOT(offsetof(CPUState, stub_tab));
 	}
 }
@@ -249,11 +383,7 @@ void QEmit::Emit_gbrind(qir::InstGBrind *ins)
 		// Inlined l1_brind_cache lookup
 		auto tmp0 = asmjit::x86::rdi;
 		auto tmp1 = asmjit::x86::rdx;
-		if (jit_mode) {
-			j.mov(tmp1.r64(), (uptr)tcache::l1_brind_cache.data());
-		} else {
-			j.mov(tmp1.r64(), asmjit::x86::Mem(R_STATE, offsetof(CPUState, l1_brind_cache)));
-		}
+		j.mov(tmp1.r64(), asmjit::x86::Mem(R_STATE, offsetof(CPUState, l1_brind_cache)));
 
 		static_assert(sizeof(tcache::BrindCacheEntry) == 1u << 4);
 		static_assert(offsetof(tcache::BrindCacheEntry, gip) == 0);
@@ -269,6 +399,8 @@ void QEmit::Emit_gbrind(qir::InstGBrind *ins)
 				       sizeof(u64)));
 	}
 
+	bool const in_hot = !placement[bb->GetId()].cold;
+	EnterColdSection();
 	j.bind(slowpath);
 
 	j.mov(asmjit::x86::gpq(asmjit::x86::Gp::kIdDi), R_STATE);
@@ -286,6 +418,9 @@ void QEmit::Emit_gbrind(qir::InstGBrind *ins)
 		FrameDestroy();
 	}
 	j.jmp(asmjit::x86::rax);
+	if (in_hot) {
+		j.section(jcode.textSection());
+	}
 }
 
 // set size manually
@@ -315,6 +450,11 @@ void QEmit::Emit_vmload(qir::InstVMLoad *ins)
 	auto prd = make_gpr(vrd);
 	auto mem = make_vmem(vbase);
 
+	if (ins->fault) {
+		auto label = j.newLabel();
+		j.bind(label);
+		fault_sites.push_back({label, ins->gip, ins->fault});
+	}
 	assert(vrd.GetType() == qir::VType::I32);
 	switch (ins->sz) {
 	case qir::VType::I8:
@@ -350,6 +490,11 @@ void QEmit::Emit_vmstore(qir::InstVMStore *ins)
 	auto pdata = make_operand(vdata);
 	auto mem = make_vmem(vbase);
 
+	if (ins->fault) {
+		auto label = j.newLabel();
+		j.bind(label);
+		fault_sites.push_back({label, ins->gip, ins->fault});
+	}
 	assert(ins->sgn == qir::VSign::U);
 	mem.setSize(VTypeToSize(ins->sz));
 	j.emit(asmjit::x86::Inst::kIdMov, mem, pdata);
@@ -11,11 +11,12 @@ namespace dbt::qcg
 struct QEmit {
 	QEmit(qir::Region *region, CompilerRuntime *cruntime_, qir::CodeSegment *segment_, bool is_leaf_);
 
-	void SetBlock(qir::Block *bb_)
+	// Blocks in emission order
+	std::vector<qir::Block *> const &GetLayout() const
 	{
-		bb = bb_;
-		j.bind(labels[bb->GetId()]);
+		return layout;
 	}
+	void SetBlock(qir::Block *bb_);
 
 	std::span<u8> EmitCode();
 	static void DumpCode(std::span<u8> const &code);
@@ -38,6 +39,9 @@ private:
 	void FrameSetup();
 	void FrameDestroy();
 
+	void PlaceBlocks(qir::Region *region);
+	void EnterColdSection();
+
 	template <asmjit::x86::Inst::Id Op>
 	ALWAYS_INLINE void EmitInstBinop(qir::InstBinop *ins);
 
@@ -59,7 +63,7 @@ private:
 	qir::CodeSegment *segment{};
 	bool jit_mode;
 
-	RuntimeStubTab const &stub_tab{*RuntimeStubTab::GetGlobal()};
+	RuntimeStubTab const &stub_tab{*RuntimeStubTab::GetJIT()};
 
 	bool is_leaf;
 	u32 spillframe_sp_offs;
@@ -70,6 +74,24 @@ private:
 	JitErrorHandler jerr{};
 
 	std::vector<asmjit::Label> labels;
+	std::vector<asmjit::Label> branch_slots;
+
+	struct BlockPlacement {
+		qir::Block *next{}; // fallthrough successor
+		bool cold{};
+		bool loop_header{};
+	};
+	std::vector<qir::Block *> layout;
+	std::vector<BlockPlacement> placement;
+	// Emitted after the hot code of the fragment
+	asmjit::Section *cold_section{};
+
+	struct FaultSiteRec {
+		asmjit::Label label;
+		u32 gip;
+		qir::VMemFaultSite const *site;
+	};
+	std::vector<FaultSiteRec> fault_sites;
 };
 
 }; // namespace dbt::qcg
\ No newline at end of file
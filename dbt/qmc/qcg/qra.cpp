@@ -56,9 +56,10 @@ struct QRegAlloc {
 
 	void Prologue();
 	void BlockBoundary();
-	void RegionBoundary();
+	void RegionBoundary(u64 live_globals = qir::InstGBr::ALL_LIVE);
 
-	void AllocOp(qir::Inst *ins);
+	void AllocOp(qir::Inst *ins, qir::VMemFaultSite **fault = nullptr);
+	qir::VMemFaultSite *RecordFaultSite();
 	void CallOp(bool use_globals = true);
 
 	static constexpr u16 frame_size{ArchTraits::spillframe_size};
@@ -71,6 +72,8 @@ struct QRegAlloc {
 	u16 frame_cur{0};
 
 	u16 n_vregs{0};
+	u32 n_spills{0}; // frame slot traffic, globals are not counted
+	u32 n_fills{0};
 	std::array<RTrack, MAX_VREGS> vregs{};
 	std::array<RTrack *, N_PREGS> p2v{nullptr};
 };
@@ -111,8 +114,11 @@ qir::RegN QRegAlloc::AllocPReg(RegMask desire, RegMask avoid)
 
 void QRegAlloc::EmitSpill(RTrack *v)
 {
-	if (!v->is_global && (v->spill_offs == RTrack::NO_SPILL)) {
-		AllocFrameSlot(v);
+	if (!v->is_global) {
+		if (v->spill_offs == RTrack::NO_SPILL) {
+			AllocFrameSlot(v);
+		}
+		n_spills++;
 	}
 	auto pgpr = qir::VOperand::MakePGPR(v->type, v->p);
 	qb.Create_mov(qir::VOperand::MakeSlot(v->is_global, v->type, v->spill_offs), pgpr);
@@ -121,6 +127,7 @@ void QRegAlloc::EmitSpill(RTrack *v)
 void QRegAlloc::EmitFill(RTrack *v)
 {
 	assert(v->spill_offs != RTrack::NO_SPILL);
+	n_fills += !v->is_global;
 	auto pgpr = qir::VOperand::MakePGPR(v->type, v->p);
 	qb.Create_mov(pgpr, qir::VOperand::MakeSlot(v->is_global, v->type, v->spill_offs));
 }
@@ -256,11 +263,15 @@ void QRegAlloc::BlockBoundary()
 	}
 }
 
-void QRegAlloc::RegionBoundary()
+void QRegAlloc::RegionBoundary(u64 live_globals)
 {
 	for (qir::RegN i = 0; i < n_vregs; ++i) {
 		auto vreg = &vregs[i];
 		if (vreg->is_global) {
+			if (i < 64 && !((live_globals >> i) & 1)) {
+				Release<false>(vreg); // dead at target, skip writeback
+				continue;
+			}
 			Spill(vreg);
 		} else {
 			Release<false>(vreg);
@@ -268,7 +279,21 @@ void QRegAlloc::RegionBoundary()
 	}
 }
 
-void QRegAlloc::AllocOp(qir::Inst *ins)
+// Dirty globals stay in registers across the access, QEmit announces them for fault recovery
+qir::VMemFaultSite *QRegAlloc::RecordFaultSite()
+{
+	auto site = region->GetArena()->New<qir::VMemFaultSite>();
+	for (int i = 0; i < n_vregs; ++i) {
+		auto *v = &vregs[i];
+		if (v->is_global && v->loc == RTrack::Location::REG && !v->spill_synced) {
+			assert(site->n_dirty < site->dirty.size());
+			site->dirty[site->n_dirty++] = FaultDirtyGlobal{v->spill_offs, v->p};
+		}
+	}
+	return site;
+}
+
+void QRegAlloc::AllocOp(qir::Inst *ins, qir::VMemFaultSite **fault)
 {
 	auto srcl = ins->inputs();
 	auto dstl = ins->outputs();
@@ -308,10 +333,14 @@ void QRegAlloc::AllocOp(qir::Inst *ins)
 	}
 
 	if (ins->GetFlags() & qir::Inst::Flags::SIDEEFF) {
-		for (int i = 0; i < n_vregs; ++i) {
-			auto *v = &vregs[i];
-			if (v->is_global) {
-				SyncSpill(v);
+		if (fault && region->HasFaultSites()) {
+			*fault = RecordFaultSite();
+		} else {
+			for (int i = 0; i < n_vregs; ++i) {
+				auto *v = &vregs[i];
+				if (v->is_global) {
+					SyncSpill(v);
+				}
 			}
 		}
 	}
@@ -417,7 +446,7 @@ public:
 	void visitInstGBr(qir::InstGBr *ins)
 	{
 		// has no voperands
-		ra->RegionBoundary();
+		ra->RegionBoundary(ins->live_globals);
 	}
 
 	void visitInstGBrind(qir::InstGBrind *ins)
@@ -428,12 +457,12 @@ public:
 
 	void visitInstVMLoad(qir::InstVMLoad *ins)
 	{
-		ra->AllocOp(ins);
+		ra->AllocOp(ins, &ins->fault);
 	}
 
 	void visitInstVMStore(qir::InstVMStore *ins)
 	{
-		ra->AllocOp(ins);
+		ra->AllocOp(ins, &ins->fault);
 	}
 
 	void visitInstHcall(qir::InstHcall *ins)
@@ -474,10 +503,14 @@ void QRegAlloc::Run()
 	}
 }
 
-void QRegAllocPass::run(qir::Region *region)
+void QRegAllocPass::run(qir::Region *region, CodegenProfile *prof)
 {
 	QRegAlloc ra(region);
 	ra.Run();
+	if (prof) {
+		prof->n_spills = ra.n_spills;
+		prof->n_fills = ra.n_fills;
+	}
 }
 
 } // namespace dbt::qcg
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "dbt/arena_objects.h"
+#include "dbt/qmc/compile.h"
 #include "dbt/qmc/ilist.h"
 #include "dbt/qmc/qir_ops.h"
 #include "dbt/qmc/runtime_stubs.h"
@@ -553,20 +554,31 @@ inline CondCode SwapCC(CondCode cc)
 }
 
 struct InstBrcc : InstWithOperands<0, 2> {
-	InstBrcc(CondCode cc_, VOperand s1, VOperand s2) : InstWithOperands(Op::_brcc, {}, {s1, s2}), cc(cc_)
+	InstBrcc(CondCode cc_, VOperand s1, VOperand s2, u32 gip_ = 0)
+	    : InstWithOperands(Op::_brcc, {}, {s1, s2}), cc(cc_), gip(gip_)
 	{
 	}
 
 	CondCode cc;
+	u32 gip; // guest branch address, for static prediction
 };
 
 struct InstGBr : InstNoOperands {
-	InstGBr(VOperand tpc_) : InstNoOperands(Op::_gbr), tpc(tpc_)
+	static constexpr u64 ALL_LIVE = ~(u64)0;
+
+	InstGBr(VOperand tpc_, u64 live_globals_ = ALL_LIVE)
+	    : InstNoOperands(Op::_gbr), tpc(tpc_), live_globals(live_globals_)
 	{
 		assert(tpc_.IsConst());
 	}
 
+	bool IsGlobalLive(RegN vreg) const
+	{
+		return vreg >= 64 || ((live_globals >> vreg) & 1);
+	}
+
 	VOperand tpc;
+	u64 live_globals; // globals live at tpc, dead ones need not be written back
 };
 
 struct InstGBrind : InstWithOperands<0, 1> {
@@ -582,24 +594,36 @@ struct InstHcall : InstWithOperands<0, 1> {
 	RuntimeStubId stub;
 };
 
+// Globals held in host registers at a vmload/vmstore, filled by QRA if the region has fault sites
+struct VMemFaultSite : InArena {
+	static constexpr u8 MAX_DIRTY = 16;
+
+	u8 n_dirty{};
+	std::array<FaultDirtyGlobal, MAX_DIRTY> dirty;
+};
+
 struct InstVMLoad : InstWithOperands<1, 1> {
-	InstVMLoad(VType sz_, VSign sgn_, VOperand d, VOperand ptr)
-	    : InstWithOperands(Op::_vmload, {d}, {ptr}), sz(sz_), sgn(sgn_)
+	InstVMLoad(VType sz_, VSign sgn_, VOperand d, VOperand ptr, u32 gip_)
+	    : InstWithOperands(Op::_vmload, {d}, {ptr}), sz(sz_), sgn(sgn_), gip(gip_)
 	{
 	}
 
 	VType sz;
 	VSign sgn;
+	u32 gip;
+	VMemFaultSite *fault{};
 };
 
 struct InstVMStore : InstWithOperands<0, 2> {
-	InstVMStore(VType sz_, VSign sgn_, VOperand ptr, VOperand val)
-	    : InstWithOperands(Op::_vmstore, {}, {ptr, val}), sz(sz_), sgn(sgn_)
+	InstVMStore(VType sz_, VSign sgn_, VOperand ptr, VOperand val, u32 gip_)
+	    : InstWithOperands(Op::_vmstore, {}, {ptr, val}), sz(sz_), sgn(sgn_), gip(gip_)
 	{
 	}
 
 	VType sz;
 	VSign sgn;
+	u32 gip;
+	VMemFaultSite *fault{};
 };
 
 struct InstSetcc : InstWithOperands<1, 2> {
@@ -761,6 +785,17 @@ struct Region : InArena {
 		return &vregs_info;
 	}
 
+	// vmload/vmstore don't sync guest state, QRA and QEmit record fault sites instead
+	bool HasFaultSites() const
+	{
+		return fault_sites;
+	}
+
+	void SetFaultSites(bool fault_sites_)
+	{
+		fault_sites = fault_sites_;
+	}
+
 private:
 	MemArena *arena;
 	IList<Block> blist;
@@ -769,6 +804,7 @@ private:
 
 	u32 inst_id_counter{0};
 	u32 bb_id_counter{0};
+	bool fault_sites{false};
 };
 
 MemArena *ArenaOf(Region *rn)
@@ -156,6 +156,9 @@ public:
 	{
 		printName(ins);
 		print(ins->tpc);
+		if (ins->live_globals != InstGBr::ALL_LIVE) {
+			ss << prop_sep << "live=" << std::hex << ins->live_globals << std::dec;
+		}
 	}
 
 	void visitInstGBrind(InstGBrind *ins)
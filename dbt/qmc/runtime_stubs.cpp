@@ -1,4 +1,5 @@
 #include "dbt/qmc/runtime_stubs.h"
+#include <cstring>
 
 namespace dbt
 {
@@ -17,5 +18,29 @@ RuntimeStubTab RuntimeStubTab::Create()
 }
 
 const RuntimeStubTab RuntimeStubTab::g_tab = RuntimeStubTab::Create();
+RuntimeStubTab const *RuntimeStubTab::g_jit_tab = nullptr;
+
+void RuntimeStubTab::EmitJumpVeneer(u8 *mem, uptr to)
+{
+	// jmpq *2(%rip); ud2; .quad to
+	static constexpr u8 jmp_ind[] = {0xff, 0x25, 0x02, 0x00, 0x00, 0x00, 0x0f, 0x0b};
+	static_assert(JIT_VENEER_SIZE == sizeof(jmp_ind) + sizeof(uptr));
+	memcpy(mem, jmp_ind, sizeof(jmp_ind));
+	memcpy(mem + sizeof(jmp_ind), &to, sizeof(uptr));
+}
+
+void RuntimeStubTab::EmitJITVeneers(u8 *mem)
+{
+	table_t tab;
+	for (size_t i = 0; i < tab.size(); ++i) {
+		u8 *v = mem + i * JIT_VENEER_SIZE;
+		EmitJumpVeneer(v, g_tab.data[i]);
+		tab[i] = (uptr)v;
+	}
+	if (!g_jit_tab || g_jit_tab->data != tab) {
+		delete g_jit_tab;
+		g_jit_tab = new RuntimeStubTab(tab);
+	}
+}
 
 } // namespace dbt
@@ -35,6 +35,19 @@ struct RuntimeStubTab {
 		return &g_tab;
 	}
 
+	// Stubs for JIT code: veneers next to the code pool are in rel32 reach, absolute stubs otherwise
+	static RuntimeStubTab const *GetJIT()
+	{
+		return g_jit_tab ? g_jit_tab : &g_tab;
+	}
+
+	static constexpr size_t JIT_VENEER_SIZE = 16;
+	static constexpr size_t JIT_VENEERS_SIZE = JIT_VENEER_SIZE * to_underlying(RuntimeStubId::Count);
+	// Emits "jmp *stub" veneers at mem, GetJIT() returns them afterwards
+	static void EmitJITVeneers(u8 *mem);
+	// Emits a single "jmp *to" veneer of JIT_VENEER_SIZE bytes
+	static void EmitJumpVeneer(u8 *mem, uptr to);
+
 	uptr operator[](RuntimeStubId id) const
 	{
 		return data[to_underlying(id)];
@@ -49,6 +62,7 @@ private:
 	using table_t = std::array<uptr, to_underlying(RuntimeStubId::Count)>;
 
 	static const RuntimeStubTab g_tab;
+	static RuntimeStubTab const *g_jit_tab;
 	RuntimeStubTab(table_t data_) : data(data_) {}
 	static RuntimeStubTab Create();
 
@@ -0,0 +1,99 @@
+#include "dbt/tcache/guestsyms.h"
+#include "dbt/qmc/compile.h"
+
+#include <vector>
+
+#include <elf.h>
+#include <unistd.h>
+
+namespace dbt
+{
+
+bool guestsyms::enabled{false};
+std::map<u32, guestsyms::Symbol> guestsyms::symbols;
+
+std::vector<guestsyms::Function> guestsyms::ReadFunctions(int elf_fd)
+{
+	Elf32_Ehdr ehdr;
+	if (pread(elf_fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)) {
+		Panic("can't read elf header");
+	}
+	std::vector<Elf32_Shdr> shtab(ehdr.e_shnum);
+	ssize_t shtab_sz = sizeof(Elf32_Shdr) * shtab.size();
+	if (pread(elf_fd, shtab.data(), shtab_sz, ehdr.e_shoff) != shtab_sz) {
+		Panic("can't read shtab");
+	}
+
+	auto read_section = [elf_fd](Elf32_Shdr const &shdr) {
+		std::vector<char> data(shdr.sh_size);
+		if (pread(elf_fd, data.data(), data.size(), shdr.sh_offset) != (ssize_t)data.size()) {
+			Panic("can't read section");
+		}
+		return data;
+	};
+
+	std::vector<Function> res;
+	for (auto const &shdr : shtab) {
+		if (shdr.sh_type != SHT_SYMTAB || shdr.sh_link >= shtab.size()) {
+			continue;
+		}
+		auto symdata = read_section(shdr);
+		auto strtab = read_section(shtab[shdr.sh_link]);
+		auto *syms = (Elf32_Sym const *)symdata.data();
+
+		for (size_t i = 0; i < symdata.size() / sizeof(Elf32_Sym); ++i) {
+			auto const &sym = syms[i];
+			if (ELF32_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_shndx == SHN_UNDEF ||
+			    sym.st_name >= strtab.size()) {
+				continue;
+			}
+			res.push_back({sym.st_value, sym.st_size, &strtab[sym.st_name]});
+		}
+	}
+	return res;
+}
+
+void guestsyms::Load(std::vector<Function> const &funcs)
+{
+	if (!enabled) {
+		return;
+	}
+	for (auto const &f : funcs) {
+		if (f.size != 0) {
+			symbols.insert({f.addr, Symbol{f.addr + f.size, f.name}});
+		}
+	}
+	log_guestsyms("loaded %zu guest symbols", symbols.size());
+}
+
+std::map<u32, guestsyms::Symbol>::const_iterator guestsyms::Find(u32 ip)
+{
+	auto it = symbols.upper_bound(ip);
+	if (it == symbols.begin() || ip >= (--it)->second.end) {
+		return symbols.end();
+	}
+	return it;
+}
+
+std::string_view guestsyms::FunctionName(u32 ip)
+{
+	auto it = Find(ip);
+	return it == symbols.end() ? std::string_view{} : it->second.name;
+}
+
+std::string guestsyms::MakeName(u32 ip)
+{
+	auto name = MakeAotSymbol(ip);
+	auto it = Find(ip);
+	if (it == symbols.end()) {
+		return name;
+	}
+	std::stringstream ss;
+	ss << name << " " << it->second.name;
+	if (ip != it->first) {
+		ss << "+0x" << std::hex << ip - it->first;
+	}
+	return ss.str();
+}
+
+} // namespace dbt
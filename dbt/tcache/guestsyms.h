@@ -0,0 +1,53 @@
+#pragma once
+
+#include "dbt/util/common.h"
+#include "dbt/util/logger.h"
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dbt
+{
+LOG_STREAM(guestsyms);
+
+// Guest .symtab functions, they name translated code in profiles. Loaded only if some user enabled it.
+struct guestsyms {
+	static void Enable()
+	{
+		enabled = true;
+	}
+	static bool IsEnabled()
+	{
+		return enabled;
+	}
+
+	struct Function {
+		u32 addr;
+		u32 size;
+		std::string name;
+	};
+	// Defined functions of the elf .symtab, read once for all users
+	static std::vector<Function> ReadFunctions(int elf_fd);
+	static void Load(std::vector<Function> const &funcs);
+
+	// Enclosing function, empty if unknown
+	static std::string_view FunctionName(u32 ip);
+	// _x<ip> with the enclosing function and offset
+	static std::string MakeName(u32 ip);
+
+private:
+	guestsyms() = delete;
+
+	struct Symbol {
+		u32 end;
+		std::string name;
+	};
+	static std::map<u32, Symbol>::const_iterator Find(u32 ip);
+
+	static bool enabled;
+	static std::map<u32, Symbol> symbols;
+};
+
+} // namespace dbt
@@ -1,5 +1,6 @@
 #include "dbt/tcache/objprof.h"
 #include "dbt/aot/aot.h"
+#include "dbt/tcache/sharedcode.h"
 #include "dbt/util/fsmanager.h"
 #include <fcntl.h>
 
@@ -67,6 +68,10 @@ void objprof::Announce(int elf_fd, bool jit_mode)
 	auto csum = FileChecksum::FromFile(elf_fd);
 	auto path = MakeCachePath(csum, ".prof");
 
+	if (jit_mode && sharedcode::IsEnabled()) {
+		sharedcode::Announce(MakeCachePath(csum, sharedcode::GetFileExtension().c_str()), csum);
+	}
+
 	auto &pfile = elf_prof;
 	pfile.fsize = 64_MB;
 
@@ -137,6 +142,7 @@ objprof::PageData *objprof::GetOrCreatePageData(u32 pageno)
 
 void objprof::UpdateProfile()
 {
+	DBT_TCACHE_LOCK(); // guest threads may still be running
 	auto &tmap = tcache::tcache_map;
 
 	for (auto it = tmap.begin(); it != tmap.end();) {
@@ -0,0 +1,185 @@
+#include "dbt/tcache/perfmap.h"
+#include "dbt/tcache/guestsyms.h"
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace dbt
+{
+
+FILE *perfmap::map_file{};
+FILE *perfmap::dump_file{};
+void *perfmap::dump_marker{};
+u64 perfmap::code_index{};
+std::mutex perfmap::lock;
+
+static constexpr char const *MAP_PATH_FMT = "/tmp/perf-%d.map";
+static constexpr char const *DUMP_PATH_FMT = "/tmp/jit-%d.dump";
+
+// tools/perf/Documentation/jitdump-specification.txt
+static constexpr u32 JITDUMP_MAGIC = 0x4A695444;
+static constexpr u32 JITDUMP_VERSION = 1;
+static constexpr u32 JIT_CODE_LOAD = 0;
+
+struct JitDumpHeader {
+	u32 magic;
+	u32 version;
+	u32 total_size;
+	u32 elf_mach;
+	u32 pad1;
+	u32 pid;
+	u64 timestamp;
+	u64 flags;
+};
+
+struct JitCodeLoad {
+	u32 id;
+	u32 total_size;
+	u64 timestamp;
+	u32 pid;
+	u32 tid;
+	u64 vma;
+	u64 code_addr;
+	u64 code_size;
+	u64 code_index;
+};
+
+// perf record -k mono
+static u64 Timestamp()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+FILE *perfmap::OpenFile(char const *fmt)
+{
+	char path[64];
+	snprintf(path, sizeof(path), fmt, getpid());
+	FILE *f = fopen(path, "w+");
+	if (!f) {
+		Panic(std::string("perfmap: can't open ") + path);
+	}
+	log_perfmap("writing %s", path);
+	return f;
+}
+
+FILE *perfmap::CloneFile(FILE *from, char const *fmt)
+{
+	FILE *f = OpenFile(fmt);
+	char buf[64 * 1024];
+	off_t offs = 0;
+	for (ssize_t rc; (rc = pread(fileno(from), buf, sizeof(buf), offs)) > 0; offs += rc) {
+		fwrite(buf, 1, rc, f);
+	}
+	fflush(f);
+	fclose(from);
+	return f;
+}
+
+void perfmap::MapDumpMarker()
+{
+	// perf record learns the dump path from this mmap event
+	long page = sysconf(_SC_PAGESIZE);
+	dump_marker = mmap(nullptr, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(dump_file), 0);
+	if (dump_marker == MAP_FAILED) {
+		Panic("perfmap: can't map jitdump marker");
+	}
+}
+
+void perfmap::WriteDumpHeader()
+{
+	JitDumpHeader hdr{};
+	hdr.magic = JITDUMP_MAGIC;
+	hdr.version = JITDUMP_VERSION;
+	hdr.total_size = sizeof(hdr);
+	hdr.elf_mach = EM_X86_64;
+	hdr.pid = getpid();
+	hdr.timestamp = Timestamp();
+	fwrite(&hdr, sizeof(hdr), 1, dump_file);
+	fflush(dump_file);
+}
+
+void perfmap::Init(bool map, bool jitdump)
+{
+	if (map || jitdump) {
+		guestsyms::Enable();
+	}
+	if (map) {
+		map_file = OpenFile(MAP_PATH_FMT);
+	}
+	if (jitdump) {
+		dump_file = OpenFile(DUMP_PATH_FMT);
+		WriteDumpHeader();
+		MapDumpMarker();
+	}
+}
+
+void perfmap::Destroy()
+{
+	std::lock_guard lk(lock);
+	if (map_file) {
+		fclose(map_file);
+		map_file = nullptr;
+	}
+	if (dump_file) {
+		munmap(dump_marker, sysconf(_SC_PAGESIZE));
+		fclose(dump_file);
+		dump_file = nullptr;
+	}
+}
+
+void perfmap::ResetAfterFork()
+{
+	std::lock_guard lk(lock);
+	if (map_file) {
+		map_file = CloneFile(map_file, MAP_PATH_FMT);
+	}
+	if (dump_file) {
+		munmap(dump_marker, sysconf(_SC_PAGESIZE));
+		dump_file = CloneFile(dump_file, DUMP_PATH_FMT);
+		u32 pid = getpid();
+		auto pid_offs = offsetof(JitDumpHeader, pid);
+		if (pwrite(fileno(dump_file), &pid, sizeof(pid), pid_offs) != sizeof(pid)) {
+			Panic("perfmap: can't update jitdump header");
+		}
+		MapDumpMarker();
+	}
+}
+
+void perfmap::AnnounceCode(u32 ip, void const *code, size_t size)
+{
+	if (!IsEnabled() || size == 0) {
+		return;
+	}
+	std::lock_guard lk(lock);
+	auto name = guestsyms::MakeName(ip);
+
+	if (map_file) {
+		fprintf(map_file, "%lx %zx %s\n", (uptr)code, size, name.c_str());
+		fflush(map_file);
+	}
+	if (dump_file) {
+		JitCodeLoad rec{};
+		rec.id = JIT_CODE_LOAD;
+		rec.total_size = sizeof(rec) + name.size() + 1 + size;
+		rec.timestamp = Timestamp();
+		rec.pid = getpid();
+		rec.tid = syscall(SYS_gettid);
+		rec.vma = rec.code_addr = (uptr)code;
+		rec.code_size = size;
+		rec.code_index = code_index++;
+		fwrite(&rec, sizeof(rec), 1, dump_file);
+		fwrite(name.c_str(), name.size() + 1, 1, dump_file);
+		fwrite(code, size, 1, dump_file);
+		fflush(dump_file);
+	}
+}
+
+} // namespace dbt
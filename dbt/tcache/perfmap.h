@@ -0,0 +1,45 @@
+#pragma once
+
+#include "dbt/util/common.h"
+#include "dbt/util/logger.h"
+
+#include <cstdio>
+#include <mutex>
+
+namespace dbt
+{
+LOG_STREAM(perfmap);
+
+// Translated code described for linux perf: /tmp/perf-<pid>.map and /tmp/jit-<pid>.dump with code bytes
+// for "perf inject --jit". Names come from guestsyms. Both are append-only: perf resolves samples at
+// report time, entries of flushed code name the samples taken before the flush. Addresses reused after
+// a flush are ambiguous in the perf map, jitdump loads are timestamped.
+struct perfmap {
+	static void Init(bool map, bool jitdump);
+	static void Destroy();
+
+	static bool IsEnabled()
+	{
+		return map_file || dump_file;
+	}
+
+	static void AnnounceCode(u32 ip, void const *code, size_t size);
+	// The child continues with copies of the parent's files named by its own pid
+	static void ResetAfterFork();
+
+private:
+	perfmap() = delete;
+
+	static FILE *OpenFile(char const *fmt);
+	static FILE *CloneFile(FILE *from, char const *fmt);
+	static void MapDumpMarker();
+	static void WriteDumpHeader();
+
+	static FILE *map_file;
+	static FILE *dump_file;
+	static void *dump_marker;
+	static u64 code_index;
+	static std::mutex lock;
+};
+
+} // namespace dbt
@@ -0,0 +1,224 @@
+#include "dbt/tcache/sampleprof.h"
+#include "dbt/guest/rv32_cpu.h"
+#include "dbt/qmc/compile.h"
+#include "dbt/tcache/guestsyms.h"
+#include "dbt/tcache/tcache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <sched.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace dbt
+{
+
+thread_local sampleprof::Activity sampleprof::activity{};
+bool sampleprof::profiling{false};
+std::string sampleprof::path;
+std::array<sampleprof::Buffer, 2> sampleprof::bufs;
+std::atomic<u32> sampleprof::cur{0};
+std::atomic<bool> sampleprof::buf_full{false};
+std::atomic<u64> sampleprof::n_lost{0};
+std::map<std::string, u64> sampleprof::folded;
+std::map<std::string, u64> sampleprof::flat;
+std::map<std::pair<std::string, std::string>, u64> sampleprof::call_edges;
+
+void sampleprof::Handler(int signo, siginfo_t *sinfo, void *uctx_raw)
+{
+	auto uc = (ucontext_t *)uctx_raw;
+	uptr hpc = uc->uc_mcontext.gregs[REG_RIP];
+	tcache::RecordHotSample(hpc);
+	if (!profiling) {
+		return;
+	}
+	Sample s{.hpc = hpc, .gip = 0, .gra = 0, .act = activity};
+	// Guest registers in CPUState are synced at region boundaries
+	if (auto state = CPUState::Current()) {
+		s.gip = state->ip;
+		s.gra = state->gpr[1];
+	}
+	Record(s);
+}
+
+void sampleprof::Record(Sample const &s)
+{
+	auto &b = bufs[cur.load(std::memory_order_acquire)];
+	u32 idx = b.cnt.fetch_add(1, std::memory_order_relaxed);
+	if (idx >= BUF_SAMPLES) {
+		n_lost.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	b.samples[idx] = s;
+	b.ready[idx].store(true, std::memory_order_release);
+	if (idx == BUF_SAMPLES - 1) {
+		buf_full.store(true, std::memory_order_release);
+	}
+}
+
+void sampleprof::StartTimer()
+{
+	struct sigaction sa {};
+	sa.sa_sigaction = Handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, nullptr)) {
+		Panic("failed to set SIGPROF handler");
+	}
+	itimerval itv{};
+	itv.it_interval.tv_usec = SAMPLE_PERIOD_US;
+	itv.it_value = itv.it_interval;
+	if (setitimer(ITIMER_PROF, &itv, nullptr)) {
+		Panic("failed to set ITIMER_PROF");
+	}
+}
+
+void sampleprof::EnableProfile(std::string const &path_)
+{
+	path = path_;
+	profiling = true;
+	guestsyms::Enable();
+	StartTimer();
+}
+
+void sampleprof::ResetAfterFork()
+{
+	if (!profiling) {
+		return;
+	}
+	// Interval timers are not inherited by the child
+	path += "." + std::to_string(getpid());
+	for (auto &b : bufs) {
+		for (auto &r : b.ready) {
+			r.store(false, std::memory_order_relaxed);
+		}
+		b.cnt.store(0, std::memory_order_relaxed);
+	}
+	buf_full.store(false, std::memory_order_relaxed);
+	n_lost.store(0, std::memory_order_relaxed);
+	folded.clear();
+	flat.clear();
+	call_edges.clear();
+	StartTimer();
+}
+
+void sampleprof::Flush()
+{
+	if (!profiling) {
+		return;
+	}
+	DBT_TCACHE_LOCK();
+	u32 const c = cur.load(std::memory_order_relaxed);
+	cur.store(c ^ 1, std::memory_order_release);
+	buf_full.store(false, std::memory_order_relaxed);
+	// Handlers that still see the old buffer count their samples as lost from now on
+	auto &b = bufs[c];
+	u32 n = std::min(b.cnt.exchange(BUF_SAMPLES, std::memory_order_acq_rel), BUF_SAMPLES);
+
+	tcache::CodeIndex index;
+	auto const func_or_ip = [](u32 ip) {
+		auto fn = guestsyms::FunctionName(ip);
+		return fn.empty() ? MakeAotSymbol(ip) : std::string(fn);
+	};
+
+	for (u32 i = 0; i < n; ++i) {
+		// Claimed by a handler that is still writing it
+		while (!b.ready[i].load(std::memory_order_acquire)) {
+			sched_yield();
+		}
+		b.ready[i].store(false, std::memory_order_relaxed);
+		auto const &s = b.samples[i];
+		std::optional<u32> region;
+		char const *cat;
+		if (auto tb = index.Lookup(s.hpc)) {
+			region = tb->ip;
+			cat = "jit";
+		} else if (region = index.LookupAOT(s.hpc); region) {
+			cat = "aot";
+		} else {
+			static constexpr char const *act_names[] = {"other",   "dispatch", "stub",
+								    "compile", "syscall",  "interp"};
+			cat = act_names[to_underlying(s.act)];
+		}
+
+		std::string stack = cat;
+		std::string leaf = cat;
+		if (region) {
+			leaf = guestsyms::MakeName(*region);
+			auto callee = func_or_ip(*region);
+			if (s.gra) {
+				auto caller = func_or_ip(s.gra - 4);
+				if (caller != callee) {
+					call_edges[{caller, callee}]++;
+				}
+				stack += ";" + caller;
+			}
+			stack += ";" + leaf;
+		}
+		folded[stack]++;
+		flat[leaf]++;
+	}
+	b.cnt.store(0, std::memory_order_release);
+}
+
+void sampleprof::WriteProfile()
+{
+	auto open = [](char const *ext) {
+		auto fpath = path + ext;
+		FILE *f = fopen(fpath.c_str(), "w");
+		if (!f) {
+			Panic("can't write " + fpath);
+		}
+		return f;
+	};
+	auto sorted = [](auto const &m) {
+		std::vector<std::pair<u64, typename std::decay_t<decltype(m)>::key_type>> res;
+		for (auto const &[k, n] : m) {
+			res.push_back({n, k});
+		}
+		std::sort(res.begin(), res.end(), std::greater{});
+		return res;
+	};
+
+	// flamegraph.pl and speedscope input
+	FILE *f = open(".folded");
+	for (auto const &[stack, n] : folded) {
+		fprintf(f, "%s %lu\n", stack.c_str(), n);
+	}
+	fclose(f);
+
+	u64 total = 0;
+	for (auto const &e : flat) {
+		total += e.second;
+	}
+	f = open(".flat");
+	fprintf(f, "%lu samples, %lu lost\n\n%10s %7s  %s\n", total, n_lost.load(), "samples", "%",
+		"location");
+	for (auto const &[n, leaf] : sorted(flat)) {
+		fprintf(f, "%10lu %6.2f%%  %s\n", n, 100.0 * n / total, leaf.c_str());
+	}
+	fprintf(f, "\n%10s %7s  %s\n", "samples", "%", "guest call edge (caller from ra)");
+	for (auto const &[n, edge] : sorted(call_edges)) {
+		fprintf(f, "%10lu %6.2f%%  %s -> %s\n", n, 100.0 * n / total, edge.first.c_str(),
+			edge.second.c_str());
+	}
+	fclose(f);
+	log_sampleprof("%lu samples written to %s.{folded,flat}", total, path.c_str());
+}
+
+void sampleprof::Destroy()
+{
+	if (!profiling) {
+		return;
+	}
+	itimerval itv{};
+	setitimer(ITIMER_PROF, &itv, nullptr);
+	Flush();
+	WriteProfile();
+	profiling = false;
+}
+
+} // namespace dbt
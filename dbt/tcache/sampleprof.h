@@ -0,0 +1,96 @@
+#pragma once
+
+#include "dbt/util/common.h"
+#include "dbt/util/logger.h"
+
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <map>
+#include <string>
+
+namespace dbt
+{
+LOG_STREAM(sampleprof);
+
+// SIGPROF sampling of the host pc, feeds hot code re-layout and the built-in profiler. Profile samples
+// are attributed to translated regions and guest symbols, or to the dbt activity of the thread.
+struct sampleprof {
+	enum class Activity : u8 {
+		OTHER,
+		DISPATCH,
+		TRANSLATED, // running translated code or runtime stubs called from it
+		COMPILE,
+		SYSCALL,
+		INTERP,
+	};
+
+	static void StartTimer();
+	// Writes <path>.folded and <path>.flat at Destroy
+	static void EnableProfile(std::string const &path);
+	static void Destroy();
+	// Forked child writes <path>.<pid>.*, the timer is re-armed
+	static void ResetAfterFork();
+
+	static bool NeedsFlush()
+	{
+		return buf_full.load(std::memory_order_relaxed);
+	}
+	// Resolves recorded samples, must be called before tcache drops translated code
+	static void Flush();
+
+	static Activity SetActivity(Activity a)
+	{
+		auto prev = activity;
+		activity = a;
+		return prev;
+	}
+
+	struct ScopedActivity {
+		explicit ScopedActivity(Activity a) : prev(SetActivity(a)) {}
+		~ScopedActivity()
+		{
+			SetActivity(prev);
+		}
+
+	private:
+		Activity prev;
+	};
+
+private:
+	sampleprof() = delete;
+
+	struct Sample {
+		uptr hpc;
+		u32 gip;
+		u32 gra;
+		Activity act;
+	};
+
+	static void Handler(int signo, siginfo_t *sinfo, void *uctx_raw);
+	static void Record(Sample const &s);
+	static void WriteProfile();
+
+	static constexpr u32 SAMPLE_PERIOD_US = 1000;
+	static constexpr u32 BUF_SAMPLES = 16 * 1024;
+
+	static thread_local Activity activity;
+	static bool profiling;
+	static std::string path;
+	struct Buffer {
+		std::array<Sample, BUF_SAMPLES> samples;
+		std::array<std::atomic<bool>, BUF_SAMPLES> ready; // written by the handler
+		std::atomic<u32> cnt;
+	};
+	// Handlers record to bufs[cur], Flush switches cur and resolves the other one
+	static std::array<Buffer, 2> bufs;
+	static std::atomic<u32> cur;
+	static std::atomic<bool> buf_full;
+	static std::atomic<u64> n_lost;
+
+	static std::map<std::string, u64> folded; // stack separated by ;
+	static std::map<std::string, u64> flat;
+	static std::map<std::pair<std::string, std::string>, u64> call_edges;
+};
+
+} // namespace dbt
@@ -0,0 +1,126 @@
+#include "dbt/tcache/sharedcode.h"
+#include "dbt/guest/rv32_native.h"
+#include "dbt/qmc/qcg/arch_traits.h"
+#include "dbt/util/fsmanager.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sched.h>
+
+namespace dbt
+{
+
+bool sharedcode::enabled{false};
+sharedcode::FileHeader *sharedcode::fmap{};
+
+std::string sharedcode::GetFileExtension()
+{
+	u64 fp = NativeFunctions::Fingerprint();
+	fp = (fp ^ config::zero_membase) * 0x100000001b3ull;
+	fp = (fp ^ config::dump_trace) * 0x100000001b3ull;
+	char buf[32];
+	snprintf(buf, sizeof(buf), ".%016llx.jitcode", (unsigned long long)fp);
+	return buf;
+}
+
+void sharedcode::Announce(std::string const &path, FileChecksum const &csum)
+{
+	auto [ptr, created] = fsmanager::OpenSharedCacheFile(path.c_str(), FILE_SIZE);
+	auto *hdr = (FileHeader *)ptr;
+
+	if (created) {
+		hdr->csum = csum;
+		__atomic_store_n(&hdr->magic, MAGIC, __ATOMIC_RELEASE);
+	} else {
+		// Creator initializes header after the file lock is released
+		while (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MAGIC) {
+			sched_yield();
+		}
+		if (hdr->csum != csum) {
+			Panic("bad checksum " + path);
+		}
+	}
+	fmap = hdr;
+	log_sharedcode("attached %s, code used: %lu", path.c_str(),
+		       __atomic_load_n(&hdr->code_used, __ATOMIC_RELAXED));
+}
+
+void sharedcode::Destroy()
+{
+	if (!fmap) {
+		return;
+	}
+	if (munmap(fmap, FILE_SIZE) != 0) {
+		Panic();
+	}
+	fmap = nullptr;
+}
+
+// FNV-1a
+u64 sharedcode::GuestHash(u8 const *ptr, u32 size)
+{
+	u64 h = 0xcbf29ce484222325ull;
+	for (u32 i = 0; i < size; ++i) {
+		h = (h ^ ptr[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+std::span<u8 const> sharedcode::Lookup(u32 ip, u8 *vmem)
+{
+	auto *index = GetIndex();
+	u32 const mask = (1u << INDEX_BITS) - 1;
+
+	for (u32 i = 0, pos = (ip >> 2) & mask; i <= mask; ++i, pos = (pos + 1) & mask) {
+		auto &e = index[pos];
+		u32 state = __atomic_load_n(&e.state, __ATOMIC_ACQUIRE);
+		if (state == EMPTY) {
+			break;
+		}
+		if (state != READY || e.ip != ip) {
+			continue;
+		}
+		if (rounddown(e.gip_end - 1, mmu::PAGE_SIZE) != rounddown(ip, mmu::PAGE_SIZE) ||
+		    GuestHash(vmem + ip, e.gip_end - ip) != e.ghash) {
+			continue;
+		}
+		log_sharedcode("hit %08x", ip);
+		return {(u8 const *)fmap + CODE_OFFS + e.code_offs, e.code_size};
+	}
+	return {};
+}
+
+void sharedcode::Publish(u32 ip, u32 gip_end, u8 *vmem, std::span<u8 const> code)
+{
+	// BranchSlots and loop headers are aligned relative to the start of fragment
+	u64 sz = roundup(code.size(), qcg::ArchTraits::CODE_ALIGN);
+	u64 offs = __atomic_fetch_add(&fmap->code_used, sz, __ATOMIC_RELAXED);
+	if (offs + sz > CODE_SIZE) {
+		log_sharedcode("code area is full");
+		return;
+	}
+
+	auto *index = GetIndex();
+	u32 const mask = (1u << INDEX_BITS) - 1;
+
+	for (u32 i = 0, pos = (ip >> 2) & mask; i <= mask; ++i, pos = (pos + 1) & mask) {
+		auto &e = index[pos];
+		u32 state = EMPTY;
+		if (!__atomic_compare_exchange_n(&e.state, &state, BUSY, false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_RELAXED)) {
+			continue;
+		}
+		memcpy((u8 *)fmap + CODE_OFFS + offs, code.data(), code.size());
+		e.ip = ip;
+		e.gip_end = gip_end;
+		e.code_size = code.size();
+		e.code_offs = offs;
+		e.ghash = GuestHash(vmem + ip, gip_end - ip);
+		__atomic_store_n(&e.state, READY, __ATOMIC_RELEASE);
+		log_sharedcode("published %08x", ip);
+		return;
+	}
+	log_sharedcode("index is full");
+}
+
+} // namespace dbt
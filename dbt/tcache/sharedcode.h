@@ -0,0 +1,77 @@
+#pragma once
+
+#include "dbt/tcache/objprof.h"
+#include "dbt/util/logger.h"
+
+#include <span>
+
+namespace dbt
+{
+LOG_STREAM(sharedcode);
+
+// Relocatable translations published to a file under the cache dir, shared by all processes running
+// the same elf. Fragments are copied to the private code_pool before use, so BranchSlots are patched
+// only in the process-local copy.
+struct sharedcode {
+	static void Enable()
+	{
+		enabled = true;
+	}
+	static bool IsEnabled()
+	{
+		return enabled;
+	}
+
+	// Translations depend on codegen options, processes with different ones use different files
+	static std::string GetFileExtension();
+	static void Announce(std::string const &path, FileChecksum const &csum);
+	static void Destroy();
+
+	static bool IsAttached()
+	{
+		return fmap != nullptr;
+	}
+
+	// Returned code is valid only if guest code in [ip, gip_end) is unchanged, it's verified here
+	static std::span<u8 const> Lookup(u32 ip, u8 *vmem);
+	static void Publish(u32 ip, u32 gip_end, u8 *vmem, std::span<u8 const> code);
+
+private:
+	sharedcode() = delete;
+
+	struct Entry {
+		u32 state; // EMPTY, BUSY, READY
+		u32 ip;
+		u32 gip_end;
+		u32 code_size;
+		u64 code_offs;
+		u64 ghash;
+	};
+
+	struct FileHeader {
+		u32 magic;
+		FileChecksum csum;
+		u64 code_used;
+	};
+
+	static constexpr u32 EMPTY = 0, BUSY = 1, READY = 2;
+	static constexpr u32 MAGIC = 0x53434442;
+
+	static constexpr u32 INDEX_BITS = 18;
+	static constexpr size_t INDEX_OFFS = mmu::PAGE_SIZE;
+	static constexpr size_t CODE_OFFS = INDEX_OFFS + (sizeof(Entry) << INDEX_BITS);
+	static constexpr size_t CODE_SIZE = 256_MB;
+	static constexpr size_t FILE_SIZE = CODE_OFFS + CODE_SIZE;
+
+	static u64 GuestHash(u8 const *ptr, u32 size);
+
+	static Entry *GetIndex()
+	{
+		return (Entry *)((u8 *)fmap + INDEX_OFFS);
+	}
+
+	static bool enabled;
+	static FileHeader *fmap;
+};
+
+} // namespace dbt
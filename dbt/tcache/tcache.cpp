@@ -1,5 +1,16 @@
 #include "dbt/tcache/tcache.h"
+#include "dbt/aot/aot.h"
+#include "dbt/guest/rv32_cpu.h"
 #include "dbt/qmc/qcg/jitabi.h"
+#include "dbt/qmc/runtime_stubs.h"
+#include "dbt/tcache/sampleprof.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
+#include <dlfcn.h>
 
 namespace dbt
 {
@@ -10,99 +21,747 @@ tcache::MapType tcache::tcache_map{};
 MemArena tcache::code_pool{};
 MemArena tcache::tb_pool{};
 std::multimap<u32, jitabi::ppoint::BranchSlot *> tcache::link_map;
+std::map<uptr, tcache::FaultSite> tcache::fault_sites;
+std::vector<FaultDirtyGlobal> tcache::fault_dirty;
+std::set<tcache::L1BrindCache *> tcache::brind_caches{&l1_brind_cache};
+std::map<u32, u32> tcache::code_page_writes;
+std::set<u32> tcache::interp_pages;
+std::atomic<bool> tcache::is_shared{false};
+std::recursive_mutex tcache::mtx;
+AOTTabHeader const *tcache::aot_tab{};
+u8 *tcache::aot_base{};
+u8 *tcache::aot_text_end{};
+bool tcache::aot_precise_faults{false};
+std::set<u32> tcache::aot_invalid_pages{};
+std::multimap<u32, u32> tcache::aot_page_regions{};
+std::pair<u64, u64> tcache::aot_code_pages{};
+bool tcache::aot_dropped{false};
+std::array<uptr, tcache::HOT_SAMPLES> tcache::hot_samples;
+std::atomic<u32> tcache::hot_samples_cnt{0};
+std::atomic<bool> tcache::hot_samples_ready{false};
+bool tcache::hot_sampling{false};
+std::map<void *, void *> tcache::far_veneers;
+std::list<tcache::RetiredPools> tcache::retired_pools;
+std::set<tcache::ThreadEpoch *> tcache::thread_epochs;
+std::atomic<u64> tcache::flush_epoch{0};
+
+struct tcache::ThreadEpoch {
+	u64 seen{0};
+	bool registered{false};
+
+	void Register()
+	{
+		seen = flush_epoch.load(std::memory_order_relaxed);
+		if (!registered) {
+			thread_epochs.insert(this);
+			registered = true;
+		}
+	}
+
+	~ThreadEpoch()
+	{
+		if (registered) {
+			DBT_TCACHE_LOCK();
+			thread_epochs.erase(this);
+		}
+	}
+};
+thread_local tcache::ThreadEpoch tcache::thread_epoch;
+
+void tcache::ClearL1Caches()
+{
+	for (auto &e : l1_cache) {
+		e.store(nullptr, std::memory_order_relaxed);
+	}
+	for (auto c : brind_caches) {
+		c->fill({0, nullptr});
+	}
+}
 
 void tcache::Init()
 {
-	l1_cache.fill(nullptr);
-	l1_brind_cache.fill({0, nullptr});
+	ClearL1Caches();
 	tcache_map.clear();
+	InitPools();
+	EmitStubVeneers();
+}
+
+void tcache::InitPools()
+{
 	tb_pool.Init(TB_POOL_SIZE, PROT_READ | PROT_WRITE);
 	code_pool.Init(CODE_POOL_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+	host_hugepages(code_pool.BaseAddr(), CODE_POOL_SIZE);
+	host_prefault(code_pool.BaseAddr(), CODE_POOL_PREFAULT);
+}
+
+void tcache::EmitStubVeneers()
+{
+	assert(code_pool.GetUsedSize() == 0);
+	auto mem = code_pool.Allocate(RuntimeStubTab::JIT_VENEERS_SIZE, RuntimeStubTab::JIT_VENEER_SIZE);
+	RuntimeStubTab::EmitJITVeneers((u8 *)mem);
 }
 
 void tcache::Destroy()
 {
 	log_tcache("Destroy tcache, code_pool size: %zu", code_pool.GetUsedSize());
 
-	l1_cache.fill(nullptr);
-	l1_brind_cache.fill({0, nullptr});
+	ClearL1Caches();
 	tcache_map.clear();
 	tb_pool.Destroy();
 	code_pool.Destroy();
+	far_veneers.clear();
+	retired_pools.clear();
+	fault_sites.clear();
+	fault_dirty.clear();
+	aot_tab = nullptr;
+	aot_invalid_pages.clear();
+	aot_page_regions.clear();
+	aot_dropped = false;
 }
 
 void tcache::Invalidate()
 {
-	l1_cache.fill(nullptr);
-	l1_brind_cache.fill({0, nullptr});
+	DBT_TCACHE_LOCK();
+	stat_tcache_invalidate.Add();
+	sampleprof::Flush();
+	ClearL1Caches();
 	tcache_map.clear();
-	tb_pool.Reset();
-	code_pool.Reset();
+	if (IsShared()) {
+		RetirePools();
+	} else {
+		tb_pool.Reset();
+		code_pool.Reset();
+		fault_sites.clear();
+		fault_dirty.clear();
+	}
+	EmitStubVeneers();
+	far_veneers.clear();
 	link_map.clear();
+	ResetHotSamples();
+	// aot code may be linked to flushed code_pool, drop it
+	aot_tab = nullptr;
+	aot_page_regions.clear();
+	flush_epoch.fetch_add(1, std::memory_order_release);
+}
+
+// Threads stay in the retired code until their next safepoint, the pools are reused after that
+void tcache::RetirePools()
+{
+	u64 const epoch = flush_epoch.load(std::memory_order_relaxed);
+	u64 min_seen = epoch;
+	for (auto te : thread_epochs) {
+		min_seen = std::min(min_seen, te->seen);
+	}
+	auto reusable = std::find_if(retired_pools.begin(), retired_pools.end(),
+				     [min_seen](auto const &r) { return r.epoch < min_seen; });
+
+	auto &retiring = retired_pools.emplace_back();
+	retiring.epoch = epoch;
+	swap(retiring.code, code_pool);
+	swap(retiring.tbs, tb_pool);
+
+	if (reusable == retired_pools.end()) {
+		if (retired_pools.size() > MAX_RETIRED_POOLS) {
+			Panic("tcache flush: guest threads don't leave the retired code");
+		}
+		log_tcache("tcache flush: allocate new pools, %zu retired", retired_pools.size());
+		InitPools();
+		return;
+	}
+	swap(reusable->code, code_pool);
+	swap(reusable->tbs, tb_pool);
+	retired_pools.erase(reusable);
+	code_pool.Reset();
+	tb_pool.Reset();
+
+	auto base = (uptr)code_pool.BaseAddr();
+	fault_sites.erase(fault_sites.lower_bound(base), fault_sites.lower_bound(base + CODE_POOL_SIZE));
+	std::vector<FaultDirtyGlobal> dirty;
+	for (auto &[hpc, fs] : fault_sites) {
+		auto it = fault_dirty.begin() + fs.dirty_idx;
+		fs.dirty_idx = dirty.size();
+		dirty.insert(dirty.end(), it, it + fs.n_dirty);
+	}
+	fault_dirty = std::move(dirty);
+}
+
+tcache::RetiredPools *tcache::FindRetiredPools(uptr hpc)
+{
+	for (auto &r : retired_pools) {
+		if (hpc - (uptr)r.code.BaseAddr() < r.code.GetUsedSize()) {
+			return &r;
+		}
+	}
+	return nullptr;
+}
+
+u64 tcache::SharedSafepoint(L1BrindCache *cache)
+{
+	u64 epoch = flush_epoch.load(std::memory_order_acquire);
+	if (likely(thread_epoch.registered && thread_epoch.seen == epoch)) {
+		return epoch;
+	}
+	DBT_TCACHE_LOCK();
+	// Entries cached before the flush might point to the retired code
+	cache->fill({0, nullptr});
+	thread_epoch.Register();
+	return thread_epoch.seen;
 }
 
 void tcache::InvalidatePage(u32 pvaddr)
 {
 	assert(rounddown(pvaddr, mmu::PAGE_SIZE) == pvaddr);
-	for (auto it = link_map.upper_bound(pvaddr); it->first < pvaddr + mmu::PAGE_SIZE;) {
-		it->second->LinkLazyJIT();
+	DBT_TCACHE_LOCK();
+	stat_tcache_invalidate_page.Add();
+	u32 const pend = pvaddr + mmu::PAGE_SIZE;
+	for (auto it = link_map.lower_bound(pvaddr); it != link_map.end() && it->first < pend;) {
+		UnlinkBranch(it->second);
 		it = link_map.erase(it);
 	}
-	for (auto it = tcache_map.upper_bound(pvaddr); it->first < pvaddr + mmu::PAGE_SIZE;) {
+	for (auto it = tcache_map.lower_bound(pvaddr); it != tcache_map.end() && it->first < pend;) {
 		it = tcache_map.erase(it);
 	}
+	if (aot_tab) {
+		aot_invalid_pages.insert(pvaddr);
+		if (!aot_dropped && pvaddr >= aot_code_pages.first && pvaddr < aot_code_pages.second) {
+			DropAOTRegions();
+		}
+	}
+	// Aot regions starting on earlier pages
+	auto [rlo, rhi] = aot_page_regions.equal_range(pvaddr);
+	for (auto it = rlo; it != rhi; ++it) {
+		ForgetRegion(it->second);
+	}
+	aot_page_regions.erase(rlo, rhi);
 	for (auto &e : l1_cache) {
-		if (rounddown(e->ip, mmu::PAGE_SIZE) == pvaddr) {
-			e = nullptr;
+		auto tb = e.load(std::memory_order_relaxed);
+		if (tb && rounddown(tb->ip, mmu::PAGE_SIZE) == pvaddr) {
+			e.store(nullptr, std::memory_order_relaxed);
+		}
+	}
+	// Only gip is reset, concurrent readers may still jump to the stale code
+	for (auto c : brind_caches) {
+		for (auto &e : *c) {
+			if (rounddown(e.gip, mmu::PAGE_SIZE) == pvaddr) {
+				__atomic_store_n(&e.gip, 0, __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+// Liveness the aot image elides writebacks by is computed over all of its guest code, so a rewrite of
+// any page may revive a register some region exit didn't write back
+void tcache::DropAOTRegions()
+{
+	log_tcache("aot code is rewritten, fall back to jit");
+	aot_dropped = true;
+	// Static links from aot code are dropped too, even for regions that were never materialized
+	for (u64 i = 0; i < aot_tab->n_sym; ++i) {
+		u32 gip = aot_tab->sym[i].gip;
+		auto it = tcache_map.find(gip);
+		if (it != tcache_map.end() &&
+		    (uptr)it->second->tcode.ptr - (uptr)aot_base >= (uptr)(aot_text_end - aot_base)) {
+			continue; // retranslated by jit
+		}
+		ForgetRegion(gip);
+	}
+	aot_page_regions.clear();
+}
+
+void tcache::ForgetRegion(u32 ip)
+{
+	auto [lo, hi] = link_map.equal_range(ip);
+	for (auto it = lo; it != hi; ++it) {
+		UnlinkBranch(it->second);
+	}
+	link_map.erase(lo, hi);
+	tcache_map.erase(ip);
+	auto &l1e = l1_cache[l1hash(ip)];
+	if (auto tb = l1e.load(std::memory_order_relaxed); tb && tb->ip == ip) {
+		l1e.store(nullptr, std::memory_order_relaxed);
+	}
+	for (auto c : brind_caches) {
+		if (auto &e = (*c)[l1hash(ip)]; e.gip == ip) {
+			__atomic_store_n(&e.gip, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void tcache::InvalidateRange(u32 gaddr, u32 len)
+{
+	DBT_TCACHE_LOCK();
+	u64 const end = (u64)gaddr + len;
+	for (auto it = tcache_map.lower_bound(gaddr); it != tcache_map.end() && it->first < end;) {
+		u32 page = rounddown(it->first, mmu::PAGE_SIZE);
+		InvalidatePage(page);
+		u32 next = page + mmu::PAGE_SIZE;
+		if (next == 0) {
+			break;
+		}
+		it = tcache_map.lower_bound(next);
+	}
+	// New contents get another chance to be translated
+	auto erase_range = [gaddr, end](auto &c) {
+		auto last = end > std::numeric_limits<u32>::max() ? c.end() : c.lower_bound(end);
+		c.erase(c.lower_bound(gaddr), last);
+	};
+	erase_range(code_page_writes);
+	erase_range(interp_pages);
+}
+
+bool tcache::PrepareTranslation(u32 gip)
+{
+	u32 const page = rounddown(gip, mmu::PAGE_SIZE);
+	DBT_TCACHE_LOCK();
+	if (interp_pages.contains(page)) {
+		return false;
+	}
+	// Protect before the code is read, a concurrent write then waits for the translation in the handler
+	mmu::ProtectCodePage(page);
+	return true;
+}
+
+void tcache::OnCodePageWrite(u32 pvaddr)
+{
+	log_tcache("guest write to code page %08x", pvaddr);
+	InvalidatePage(pvaddr);
+	if (++code_page_writes[pvaddr] == SMC_INTERP_THRESHOLD) {
+		log_tcache("code page %08x is rewritten too often, interpret it", pvaddr);
+		interp_pages.insert(pvaddr);
+	}
+}
+
+bool tcache::HandleCodeWrite(u32 gaddr)
+{
+	u32 const page = rounddown(gaddr, mmu::PAGE_SIZE);
+	DBT_TCACHE_LOCK();
+	if (mmu::UnprotectCodePage(page)) {
+		OnCodePageWrite(page);
+		return true;
+	}
+	// Another thread has unprotected it already, or it's a guest fault
+	return mmu::IsGuestWritable(page);
+}
+
+void tcache::PrepareCodeWrite(u32 gaddr, u32 len)
+{
+	if (len == 0) {
+		return;
+	}
+	DBT_TCACHE_LOCK();
+	u64 const end = (u64)gaddr + len;
+	for (u64 page = rounddown(gaddr, mmu::PAGE_SIZE); page < end; page += mmu::PAGE_SIZE) {
+		if (mmu::UnprotectCodePage(page)) {
+			OnCodePageWrite(page);
+		}
+	}
+}
+
+void tcache::RecordHotSample(uptr hpc)
+{
+	if (!hot_sampling || hpc - (uptr)code_pool.BaseAddr() >= code_pool.GetUsedSize()) {
+		return;
+	}
+	u32 idx = hot_samples_cnt.fetch_add(1, std::memory_order_relaxed);
+	if (idx < HOT_SAMPLES) {
+		hot_samples[idx] = hpc;
+		if (idx == HOT_SAMPLES - 1) {
+			hot_samples_ready.store(true, std::memory_order_release);
+		}
+	}
+}
+
+void tcache::EnableHotSampling()
+{
+	hot_sampling = true;
+	sampleprof::StartTimer();
+}
+
+void tcache::ResetHotSamples()
+{
+	hot_samples_ready.store(false, std::memory_order_relaxed);
+	hot_samples_cnt.store(0, std::memory_order_relaxed);
+}
+
+std::vector<u32> tcache::CollectHotRegions()
+{
+	DBT_TCACHE_LOCK();
+	CodeIndex index;
+	std::unordered_map<u32, u32> hits;
+	for (auto hpc : hot_samples) {
+		if (auto tb = index.Lookup(hpc)) {
+			hits[tb->ip]++;
+		}
+	}
+	ResetHotSamples();
+
+	std::vector<std::pair<u32, u32>> ranked; // hits, ip
+	for (auto [ip, n] : hits) {
+		if (n >= HOT_MIN_HITS && !tcache_map.at(ip)->flags.is_hot) {
+			ranked.push_back({n, ip});
+		}
+	}
+	std::sort(ranked.begin(), ranked.end(), std::greater{});
+	// Regions covering 90% of samples
+	u32 covered = 0;
+	for (size_t i = 0; i < ranked.size(); ++i) {
+		if (i == HOT_MAX_REGIONS || covered >= HOT_SAMPLES * 9 / 10) {
+			ranked.resize(i);
+			break;
+		}
+		covered += ranked[i].first;
+	}
+
+	// Chaining observed through linked BranchSlots, slot addresses belong to the source regions
+	std::unordered_map<u32, u32> hot_hits;
+	for (auto [n, ip] : ranked) {
+		hot_hits[ip] = n;
+	}
+	std::unordered_map<u32, std::vector<u32>> succs;
+	for (auto [tgt_ip, slot] : link_map) {
+		auto src = index.Lookup((uptr)slot);
+		if (src && src->ip != tgt_ip && hot_hits.contains(src->ip) && hot_hits.contains(tgt_ip)) {
+			succs[src->ip].push_back(tgt_ip);
+		}
+	}
+
+	// Greedy chains: the hottest unplaced region, then its hottest unplaced successor
+	std::vector<u32> order;
+	std::set<u32> placed;
+	for (auto [n, head] : ranked) {
+		for (u32 ip = head; !placed.contains(ip);) {
+			order.push_back(ip);
+			placed.insert(ip);
+			u32 best = ip, best_hits = 0;
+			for (auto s : succs[ip]) {
+				if (!placed.contains(s) && hot_hits[s] > best_hits) {
+					best = s;
+					best_hits = hot_hits[s];
+				}
+			}
+			ip = best;
 		}
 	}
-	for (auto &e : l1_brind_cache) {
-		if (rounddown(e.gip, mmu::PAGE_SIZE) == pvaddr) {
-			e = {0, 0};
+	log_tcache("hot relayout: %zu regions cover %u of %u samples", order.size(), covered, HOT_SAMPLES);
+	return order;
+}
+
+tcache::CodeIndex::CodeIndex()
+{
+	for (auto const &e : tcache_map) {
+		auto ptr = (uptr)e.second->tcode.ptr;
+		if (ptr - (uptr)code_pool.BaseAddr() < code_pool.GetUsedSize()) {
+			tbs.push_back(e.second);
 		}
 	}
+	std::sort(tbs.begin(), tbs.end(), [](auto a, auto b) { return a->tcode.ptr < b->tcode.ptr; });
+	if (aot_tab) {
+		for (u64 i = 0; i < aot_tab->n_sym; ++i) {
+			aot_syms.push_back({(uptr)aot_base + aot_tab->sym[i].aot_vaddr, aot_tab->sym[i].gip});
+		}
+		std::sort(aot_syms.begin(), aot_syms.end());
+	}
+}
+
+TBlock *tcache::CodeIndex::Lookup(uptr hpc) const
+{
+	auto it = std::upper_bound(tbs.begin(), tbs.end(), hpc,
+				   [](uptr p, TBlock *tb) { return p < (uptr)tb->tcode.ptr; });
+	if (it == tbs.begin()) {
+		return nullptr;
+	}
+	auto tb = *--it;
+	return hpc - (uptr)tb->tcode.ptr < tb->tcode.size ? tb : nullptr;
+}
+
+std::optional<u32> tcache::CodeIndex::LookupAOT(uptr hpc) const
+{
+	auto it = std::upper_bound(aot_syms.begin(), aot_syms.end(), std::make_pair(hpc, ~(u32)0));
+	if (it == aot_syms.begin()) {
+		return std::nullopt;
+	}
+	// aottab has no sizes, check the pc is in the aot image at least
+	Dl_info info;
+	if (!dladdr((void *)hpc, &info) || info.dli_fbase != aot_base) {
+		return std::nullopt;
+	}
+	return (--it)->second;
+}
+
+void tcache::EvictRegions(std::span<u32 const> ips)
+{
+	DBT_TCACHE_LOCK();
+	assert(!IsShared());
+	std::vector<std::pair<uptr, uptr>> evicted; // [begin, end) of the code
+	for (auto ip : ips) {
+		auto tb = tcache_map.at(ip);
+		evicted.push_back({(uptr)tb->tcode.ptr, (uptr)tb->tcode.ptr + tb->tcode.size});
+	}
+	std::sort(evicted.begin(), evicted.end());
+	// Slots of the evicted code must not be patched later
+	std::erase_if(link_map, [&evicted](auto const &e) {
+		auto slot = (uptr)e.second;
+		auto it = std::upper_bound(evicted.begin(), evicted.end(), std::make_pair(slot, ~(uptr)0));
+		return it != evicted.begin() && slot < std::prev(it)->second;
+	});
+	for (auto ip : ips) {
+		ForgetRegion(ip);
+	}
 }
 
 void tcache::Insert(TBlock *tb)
 {
+	DBT_TCACHE_LOCK();
 	tcache_map.insert({tb->ip, tb});
-	l1_cache[l1hash(tb->ip)] = tb;
+	l1_cache[l1hash(tb->ip)].store(tb, std::memory_order_release);
 }
 
-TBlock *tcache::LookupUpperBound(u32 gip)
+void tcache::RegisterBrindCache(L1BrindCache *cache)
 {
-	auto it = tcache_map.upper_bound(gip);
-	if (it == tcache_map.end()) {
-		return nullptr;
+	DBT_TCACHE_LOCK();
+	cache->fill({0, nullptr});
+	brind_caches.insert(cache);
+}
+
+void tcache::UnregisterBrindCache(L1BrindCache *cache)
+{
+	DBT_TCACHE_LOCK();
+	brind_caches.erase(cache);
+}
+
+void tcache::LinkBranch(jitabi::ppoint::BranchSlot *slot, TBlock *tgt)
+{
+	DBT_TCACHE_LOCK();
+	// The slot's code was flushed while the calling thread was in it
+	if (FindRetiredPools((uptr)slot)) {
+		stat_tcache_link_rejected.Add();
+		return;
+	}
+	if (!slot->Link(tgt->tcode.ptr, IsShared())) {
+		auto veneer = GetFarVeneer(tgt->tcode.ptr);
+		if (veneer == nullptr || !slot->Link(veneer, IsShared())) {
+			stat_tcache_link_rejected.Add();
+			return;
+		}
+	}
+	stat_tcache_link.Add();
+	tgt->flags.is_segment_entry |= slot->flags.cross_segment;
+	link_map.insert({tgt->ip, slot});
+}
+
+void tcache::UnlinkBranch(jitabi::ppoint::BranchSlot *slot)
+{
+	bool const in_pool = (uptr)slot - (uptr)code_pool.BaseAddr() < code_pool.GetUsedSize();
+	if (IsShared() || !in_pool) {
+		slot->LinkLazyAOT(offsetof(CPUState, stub_tab), IsShared());
+	} else {
+		slot->LinkLazyJIT();
+	}
+}
+
+void *tcache::GetFarVeneer(void *to)
+{
+	auto [it, inserted] = far_veneers.insert({to, nullptr});
+	if (inserted) {
+		// No flush here, the slot being linked would be retired
+		constexpr auto sz = RuntimeStubTab::JIT_VENEER_SIZE;
+		auto mem = code_pool.Allocate(sz, sz);
+		if (mem == nullptr) {
+			far_veneers.erase(it);
+			return nullptr;
+		}
+		RuntimeStubTab::EmitJumpVeneer((u8 *)mem, (uptr)to);
+		it->second = mem;
 	}
 	return it->second;
 }
 
+void tcache::SetShared()
+{
+	DBT_TCACHE_LOCK();
+	is_shared.store(true, std::memory_order_relaxed);
+	// The calling guest thread is in translated code and hasn't passed a shared safepoint yet
+	if (CPUState::Current()) {
+		thread_epoch.Register();
+	}
+}
+
+std::optional<u32> tcache::UpperBoundIp(u32 gip)
+{
+	DBT_TCACHE_LOCK();
+	std::optional<u32> res;
+	if (auto it = tcache_map.upper_bound(gip); it != tcache_map.end()) {
+		res = it->first;
+	}
+	if (aot_tab) {
+		if (auto sym = FindAOTSymbol(gip, true); sym && (!res || sym->gip < *res)) {
+			res = sym->gip;
+		}
+	}
+	return res;
+}
+
 TBlock *tcache::LookupFull(u32 gip)
 {
 	auto it = tcache_map.find(gip);
 	if (likely(it != tcache_map.end())) {
 		return it->second;
 	}
+	if (aot_tab) {
+		return LookupAOTTab(gip);
+	}
 	return nullptr;
 }
 
+void tcache::AttachAOTTab(AOTTabHeader const *tab, u8 *l_addr, u8 *text_end)
+{
+	DBT_TCACHE_LOCK();
+	assert(std::is_sorted(&tab->sym[0], &tab->sym[tab->n_sym],
+			      [](auto const &a, auto const &b) { return a.gip < b.gip; }));
+	aot_tab = tab;
+	aot_base = l_addr;
+	aot_text_end = text_end;
+	aot_precise_faults = tab->precise_faults;
+	aot_invalid_pages.clear();
+	aot_page_regions.clear();
+	aot_dropped = false;
+	aot_code_pages = {~(u64)0, 0};
+	for (u64 i = 0; i < tab->n_sym; ++i) {
+		auto [pbegin, pend] = AOTRegionPages(&tab->sym[i]);
+		aot_code_pages.first = std::min(aot_code_pages.first, pbegin);
+		aot_code_pages.second = std::max(aot_code_pages.second, pend);
+	}
+}
+
+void tcache::RecordAOTLinks(std::span<jitabi::ppoint::BranchSlot *const> slots)
+{
+	DBT_TCACHE_LOCK();
+	for (auto slot : slots) {
+		link_map.insert({(u32)slot->gip, slot});
+	}
+}
+
+TBlock *tcache::LookupAOTTab(u32 gip)
+{
+	auto sym = FindAOTSymbol(gip, false);
+	return sym ? MaterializeAOT(sym) : nullptr;
+}
+
+AOTSymbol const *tcache::FindAOTSymbol(u32 gip, bool upper_bound)
+{
+	if (aot_dropped) {
+		return nullptr;
+	}
+	auto const *begin = &aot_tab->sym[0];
+	auto const *end = &aot_tab->sym[aot_tab->n_sym];
+
+	for (;;) {
+		auto cmp = [](AOTSymbol const &sym, u32 val) { return sym.gip < val; };
+		auto *sym = std::lower_bound(begin, end, upper_bound ? gip + 1 : gip, cmp);
+		if (sym == end || (!upper_bound && sym->gip != gip)) {
+			return nullptr;
+		}
+		if (likely(!IsAOTRegionInvalid(sym))) {
+			return sym;
+		}
+		if (!upper_bound) {
+			return nullptr;
+		}
+		gip = sym->gip;
+	}
+}
+
+std::pair<u64, u64> tcache::AOTRegionPages(AOTSymbol const *sym)
+{
+	u64 const end = std::max((u64)sym->gip_end, (u64)sym->gip + 1);
+	return {rounddown(sym->gip, mmu::PAGE_SIZE), roundup(end, mmu::PAGE_SIZE)};
+}
+
+bool tcache::IsAOTRegionInvalid(AOTSymbol const *sym)
+{
+	auto [pbegin, pend] = AOTRegionPages(sym);
+	auto it = aot_invalid_pages.lower_bound(pbegin);
+	return it != aot_invalid_pages.end() && *it < pend;
+}
+
+TBlock *tcache::MaterializeAOT(AOTSymbol const *sym)
+{
+	auto it = tcache_map.find(sym->gip);
+	if (it != tcache_map.end()) {
+		return it->second;
+	}
+
+	auto *tb = AllocateTBlock();
+	if (!aot_tab) {
+		// tcache was flushed
+		return nullptr;
+	}
+	tb->ip = sym->gip;
+	tb->tcode = TBlock::TCode{aot_base + sym->aot_vaddr, 0};
+	auto [pbegin, pend] = AOTRegionPages(sym);
+	for (u64 page = pbegin; page < pend; page += mmu::PAGE_SIZE) {
+		mmu::ProtectCodePage(page);
+		aot_page_regions.insert({(u32)page, sym->gip});
+	}
+	Insert(tb);
+	return tb;
+}
+
 TBlock *tcache::AllocateTBlock()
 {
+	DBT_TCACHE_LOCK();
 	auto *res = tb_pool.Allocate<TBlock>();
 	if (res == nullptr) {
 		Invalidate();
+		res = tb_pool.Allocate<TBlock>();
 	}
 	return new (res) TBlock{};
 }
 
 void *tcache::AllocateCode(size_t code_sz, u16 align)
 {
+	DBT_TCACHE_LOCK();
 	void *res = code_pool.Allocate(code_sz, align);
 	if (res == nullptr) {
 		Invalidate();
+		res = code_pool.Allocate(code_sz, align);
 	}
 	return res;
 }
 
+void tcache::RecordFaultSite(uptr hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty)
+{
+	DBT_TCACHE_LOCK();
+	fault_sites.insert({hpc, FaultSite{gip, (u32)fault_dirty.size(), (u32)dirty.size()}});
+	fault_dirty.insert(fault_dirty.end(), dirty.begin(), dirty.end());
+}
+
+bool tcache::IsTranslatedCode(uptr hpc)
+{
+	return hpc - (uptr)code_pool.BaseAddr() < CODE_POOL_SIZE ||
+	       hpc - (uptr)aot_base < (uptr)(aot_text_end - aot_base);
+}
+
+bool tcache::RecoverFaultState(CPUState *state, uptr hpc, u64 const *hregs)
+{
+	DBT_TCACHE_LOCK();
+	if (hpc - (uptr)aot_base < (uptr)(aot_text_end - aot_base)) {
+		return aot_precise_faults;
+	}
+	if (hpc - (uptr)code_pool.BaseAddr() >= code_pool.GetUsedSize() && !FindRetiredPools(hpc)) {
+		return false;
+	}
+	auto it = fault_sites.find(hpc);
+	if (it == fault_sites.end()) {
+		return true; // relocatable code syncs guest state before accesses
+	}
+	auto const &fs = it->second;
+	state->ip = fs.gip;
+	for (u32 i = 0; i < fs.n_dirty; ++i) {
+		auto const &d = fault_dirty[fs.dirty_idx + i];
+		*(u32 *)((u8 *)state + d.state_offs) = hregs[d.hreg];
+	}
+	return true;
+}
+
 } // namespace dbt
@@ -2,22 +2,41 @@
 
 #include "dbt/arena.h"
 #include "dbt/mmu.h"
+#include "dbt/qmc/compile.h"
 #include "dbt/tcache/cflow_dump.h"
 #include "dbt/util/logger.h"
+#include "dbt/util/stats.h"
 
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <list>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
 
 namespace dbt
 {
 LOG_STREAM(tcache);
+STAT_COUNTER(tcache_l1_miss);
+STAT_COUNTER(tcache_miss);
+STAT_COUNTER(tcache_link);
+STAT_COUNTER(tcache_link_rejected);
+STAT_COUNTER(tcache_invalidate);
+STAT_COUNTER(tcache_invalidate_page);
+
+struct CPUState;
 
 namespace jitabi::ppoint
 {
 struct BranchSlot;
 } // namespace jitabi::ppoint
 
+struct AOTTabHeader;
+struct AOTSymbol;
+
 struct alignas(8) TBlock {
 	struct TCode {
 		void *ptr{nullptr};
@@ -29,65 +48,150 @@ struct alignas(8) TBlock {
 	struct {
 		bool is_brind_target : 1 {false};
 		bool is_segment_entry : 1 {false};
+		bool is_hot : 1 {false};
 	} flags;
 };
 
+// Serializes tcache updates, lookups through l1_cache are lock-free
+#define DBT_TCACHE_LOCK() std::lock_guard lk(dbt::tcache::mtx)
+
 struct tcache {
 	static void Init();
 	static void Destroy();
 	static void Invalidate();
 	static void Insert(TBlock *tb);
 	static void InvalidatePage(u32 pvaddr);
+	// Guest mapping is removed or replaced
+	static void InvalidateRange(u32 gaddr, u32 len);
+
+	// Self-modifying code: pages are write-protected before translation, a guest write drops their
+	// translations. Returns false for pages rewritten too often, they are interpreted instead.
+	static bool PrepareTranslation(u32 gip);
+	// Write fault in guest memory, returns true if the write can be restarted
+	static bool HandleCodeWrite(u32 gaddr);
+	// The host kernel fails with EFAULT on protected pages, call before syscalls writing guest memory
+	static void PrepareCodeWrite(u32 gaddr, u32 len);
 
 	static ALWAYS_INLINE TBlock *LookupFast(u32 ip)
 	{
-		auto *tb = l1_cache[l1hash(ip)];
-		return (tb->ip == ip) ? tb : nullptr;
+		auto *tb = l1_cache[l1hash(ip)].load(std::memory_order_acquire);
+		return (tb != nullptr && tb->ip == ip) ? tb : nullptr;
 	}
 
 	static TBlock *Lookup(u32 ip)
 	{
-		auto hash = l1hash(ip);
-		auto *tb = l1_cache[hash];
-		if (tb != nullptr && tb->ip == ip)
+		if (auto *tb = LookupFast(ip)) {
 			return tb;
-		tb = LookupFull(ip);
+		}
+		stat_tcache_l1_miss.Add();
+		DBT_TCACHE_LOCK();
+		auto *tb = LookupFull(ip);
 		if (tb != nullptr)
-			l1_cache[hash] = tb;
+			l1_cache[l1hash(ip)].store(tb, std::memory_order_release);
+		else
+			stat_tcache_miss.Add();
 		return tb;
 	}
 
-	static TBlock *LookupUpperBound(u32 gip);
+	// Entry of the next region after gip, aot regions are not materialized for that
+	static std::optional<u32> UpperBoundIp(u32 gip);
+
+	// Entries are materialized lazily on lookup miss, table is used in-place
+	static void AttachAOTTab(AOTTabHeader const *tab, u8 *l_addr, u8 *text_end);
+	// Slots linked to aot regions by LinkAOTObject, SMC unlinks them as runtime links
+	static void RecordAOTLinks(std::span<jitabi::ppoint::BranchSlot *const> slots);
 
-	static void CacheBrind(TBlock *tb)
+	struct BrindCacheEntry {
+		u32 gip;
+		void *code;
+	};
+	static constexpr u32 L1_CACHE_BITS = 12;
+	using L1BrindCache = std::array<BrindCacheEntry, 1u << L1_CACHE_BITS>;
+
+	// Written only by the owning thread, others may only invalidate entries
+	static void CacheBrind(L1BrindCache *cache, TBlock *tb)
 	{
-		l1_brind_cache[l1hash(tb->ip)] = {tb->ip, tb->tcode.ptr};
+		(*cache)[l1hash(tb->ip)] = {tb->ip, tb->tcode.ptr};
 		if (unlikely(!tb->flags.is_brind_target)) {
+			DBT_TCACHE_LOCK();
 			cflow_dump::RecordBrindEntry(tb->ip);
+			tb->flags.is_brind_target = true;
 		}
-		tb->flags.is_brind_target = true;
 	}
 
-	static void RecordLink(jitabi::ppoint::BranchSlot *slot, TBlock *tgt, bool cross_segment)
+	static void RegisterBrindCache(L1BrindCache *cache);
+	static void UnregisterBrindCache(L1BrindCache *cache);
+
+	// Links slot to tgt, might leave it lazy if patching is unsafe
+	static void LinkBranch(jitabi::ppoint::BranchSlot *slot, TBlock *tgt);
+	// Back to the lazy form, slots out of code_pool call the link stub through stub_tab
+	static void UnlinkBranch(jitabi::ppoint::BranchSlot *slot);
+
+	// Code might be executed by several threads, non-atomic patching is forbidden and flushed pools are
+	// reused only after every guest thread has passed a safepoint
+	static void SetShared();
+	static bool IsShared()
 	{
-		tgt->flags.is_segment_entry |= cross_segment;
-		link_map.insert({tgt->ip, slot});
+		return is_shared.load(std::memory_order_relaxed);
 	}
 
+	// Called by the dispatcher loop, the thread holds no pointers into translated code except its branch
+	// slot and cache. Returns the flush epoch, code obtained before the epoch changes might be retired
+	static ALWAYS_INLINE u64 Safepoint(L1BrindCache *cache)
+	{
+		if (likely(!IsShared())) {
+			return flush_epoch.load(std::memory_order_relaxed);
+		}
+		return SharedSafepoint(cache);
+	}
+	static u64 GetFlushEpoch()
+	{
+		return flush_epoch.load(std::memory_order_acquire);
+	}
+
+	// Hot code re-layout: JIT code is sampled by sampleprof, hot regions are retranslated back to back
+	static void EnableHotSampling();
+	// Called from the SIGPROF handler
+	static void RecordHotSample(uptr hpc);
+	static bool HotSamplesReady()
+	{
+		return hot_samples_ready.load(std::memory_order_relaxed);
+	}
+	// Returns hot region ips ordered along observed chaining, resets the samples
+	static std::vector<u32> CollectHotRegions();
+	// Drops the translations at ips, branches to them are relinked lazily. Not for shared code
+	static void EvictRegions(std::span<u32 const> ips);
+
+	// Host pc to translated region in code_pool and the aot image, valid while tcache is locked
+	struct CodeIndex {
+		CodeIndex();
+		// nullptr if hpc is not in code_pool
+		TBlock *Lookup(uptr hpc) const;
+		std::optional<u32> LookupAOT(uptr hpc) const;
+
+	private:
+		std::vector<TBlock *> tbs; // sorted by tcode.ptr
+		std::vector<std::pair<uptr, u32>> aot_syms; // sorted host address, gip
+	};
+
 	static void *AllocateCode(size_t sz, u16 align);
 	static TBlock *AllocateTBlock();
 
-	static constexpr u32 L1_CACHE_BITS = 12;
-	using L1Cache = std::array<TBlock *, 1u << L1_CACHE_BITS>;
+	// Guest memory accesses of non-relocatable code, the state is not synced before them
+	static void RecordFaultSite(uptr hpc, u32 gip, std::span<FaultDirtyGlobal const> dirty);
+	// Makes CPUState precise if hpc is in translated code, hregs are indexed by host register id
+	static bool RecoverFaultState(CPUState *state, uptr hpc, u64 const *hregs);
+	// Lock-free for signal handlers, hpc is in code_pool or the aot image
+	static bool IsTranslatedCode(uptr hpc);
+
+	using L1Cache = std::array<std::atomic<TBlock *>, 1u << L1_CACHE_BITS>;
 	static L1Cache l1_cache;
 
-	struct BrindCacheEntry {
-		u32 gip;
-		void *code;
-	};
-	using L1BrindCache = std::array<BrindCacheEntry, 1u << L1_CACHE_BITS>;
+	// Main thread's cache, others allocate their own
 	static L1BrindCache l1_brind_cache;
 
+	static std::recursive_mutex mtx;
+
 	static ALWAYS_INLINE u32 l1hash(u32 ip)
 	{
 		return (ip >> 2) & ((1ull << L1_CACHE_BITS) - 1);
@@ -98,6 +202,15 @@ private:
 	friend struct objprof;
 
 	static TBlock *LookupFull(u32 ip);
+	static TBlock *LookupAOTTab(u32 ip);
+	static AOTSymbol const *FindAOTSymbol(u32 gip, bool upper_bound);
+	static TBlock *MaterializeAOT(AOTSymbol const *sym);
+	// Guest pages [begin, end) an aot region is translated from, SMC in any of them drops it
+	static std::pair<u64, u64> AOTRegionPages(AOTSymbol const *sym);
+	static bool IsAOTRegionInvalid(AOTSymbol const *sym);
+	// Drops the region at ip from lookups, branches to it are relinked lazily
+	static void ForgetRegion(u32 ip);
+	static void DropAOTRegions();
 
 	using MapType = std::map<u32, TBlock *>;
 	static MapType tcache_map;
@@ -106,9 +219,72 @@ private:
 	static MemArena tb_pool;
 
 	static constexpr size_t CODE_POOL_SIZE = 128 * 1024 * 1024;
+	static constexpr size_t CODE_POOL_PREFAULT = 8 * 1024 * 1024;
 	static MemArena code_pool;
+	static void InitPools();
+	// Link stub veneers at the start of code_pool, rel32 calls from JIT code always reach them
+	static void EmitStubVeneers();
+	// JIT slots reach targets out of rel32 range (aot code) through veneers in code_pool
+	static std::map<void *, void *> far_veneers;
+	static void *GetFarVeneer(void *to);
+
+	// Pools flushed while the code is shared, other threads might still execute them
+	struct RetiredPools {
+		MemArena code;
+		MemArena tbs;
+		u64 epoch;
+	};
+	static constexpr size_t MAX_RETIRED_POOLS = 4;
+	static std::list<RetiredPools> retired_pools;
+	static void RetirePools();
+	static RetiredPools *FindRetiredPools(uptr hpc);
+
+	// Guest threads executing shared code, registered on their first safepoint
+	struct ThreadEpoch;
+	static std::set<ThreadEpoch *> thread_epochs;
+	static thread_local ThreadEpoch thread_epoch;
+	static std::atomic<u64> flush_epoch;
+	static u64 SharedSafepoint(L1BrindCache *cache);
+
+	static constexpr u32 HOT_SAMPLES = 4096;
+	static constexpr u32 HOT_MIN_HITS = 2;
+	static constexpr u32 HOT_MAX_REGIONS = 1024;
+	static std::array<uptr, HOT_SAMPLES> hot_samples;
+	static std::atomic<u32> hot_samples_cnt;
+	static std::atomic<bool> hot_samples_ready;
+	static bool hot_sampling;
+	static void ResetHotSamples();
 
 	static std::multimap<u32, jitabi::ppoint::BranchSlot *> link_map;
+
+	struct FaultSite {
+		u32 gip;
+		u32 dirty_idx;
+		u32 n_dirty;
+	};
+	static std::map<uptr, FaultSite> fault_sites;
+	static std::vector<FaultDirtyGlobal> fault_dirty;
+	static std::set<L1BrindCache *> brind_caches;
+
+	static constexpr u32 SMC_INTERP_THRESHOLD = 8;
+	static std::map<u32, u32> code_page_writes;
+	static std::set<u32> interp_pages;
+	static void OnCodePageWrite(u32 pvaddr);
+	static std::atomic<bool> is_shared;
+
+	static void ClearL1Caches();
+
+	static AOTTabHeader const *aot_tab;
+	static u8 *aot_base;
+	// Kept after flush, threads might still execute the aot code
+	static u8 *aot_text_end;
+	static bool aot_precise_faults;
+	static std::set<u32> aot_invalid_pages;
+	// Guest page to materialized aot regions translated from it
+	static std::multimap<u32, u32> aot_page_regions;
+	// Guest pages [begin, end) of all aot regions, SMC in them drops the whole image
+	static std::pair<u64, u64> aot_code_pages;
+	static bool aot_dropped;
 };
 
 } // namespace dbt
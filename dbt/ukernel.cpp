@@ -1,11 +1,24 @@
 #include "dbt/ukernel.h"
 #include "dbt/execute.h"
+#include "dbt/guest/rv32_native.h"
 #include "dbt/mmu.h"
+#include "dbt/tcache/guestsyms.h"
 #include "dbt/tcache/objprof.h"
+#include "dbt/tcache/perfmap.h"
+#include "dbt/tcache/sampleprof.h"
 #include "dbt/util/fsmanager.h"
+#include "dbt/util/stats.h"
+#include "dbt/util/uringio.h"
 #include <alloca.h>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "dbt/ukernel_syscalls.h"
 
@@ -13,17 +26,22 @@ extern "C" {
 #include <elf.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <linux/futex.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <linux/unistd.h>
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/random.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 };
@@ -40,18 +58,91 @@ struct ukernel::ElfImage {
 	uabi_ulong brk{};
 };
 
+// Memoised PathResolution results and host base paths of dirfds. Namespace-modifying syscalls
+// (unlinkat, renameat2, symlinkat, chdir) are not implemented, they must Flush() the cache once added.
+struct PathCache {
+	static constexpr int ABS_DIRFD = -1; // absolute paths, AT_FDCWD is negative too
+	static constexpr size_t MAX_ENTRIES = 4096;
+
+	struct Dir {
+		std::string base; // with trailing '/'
+		std::unordered_map<std::string, std::string> resolved;
+	};
+
+	Dir *GetDir(int dirfd);
+
+	void ForgetDirfd(int dirfd)
+	{
+		std::lock_guard lk(lock);
+		dirs.erase(dirfd);
+	}
+
+	void Flush()
+	{
+		std::lock_guard lk(lock);
+		dirs.clear();
+	}
+
+	std::mutex lock;
+	std::unordered_map<int, Dir> dirs;
+};
+
+static constexpr uabi_ulong UABI_SIG_DFL = 0, UABI_SIG_IGN = 1;
+
+struct uabi_sigaction {
+	uabi_ulong handler;
+	uabi_ulong flags;
+	u64 mask;
+};
+
+// riscv32 rt_sigframe: siginfo followed by ucontext, the layout is visible to guest handlers
+struct uabi_rt_sigframe {
+	struct {
+		i32 signo;
+		i32 errno_;
+		i32 code;
+		u32 addr; // _sigfault
+		u8 _pad[112];
+	} info;
+	struct alignas(16) {
+		u32 uc_flags;
+		u32 uc_link;
+		u32 uc_stack[3];
+		u32 uc_sigmask[2];
+		u8 _unused[120];
+		alignas(16) u32 sc_regs[32]; // pc, x1..x31
+		alignas(16) u8 sc_fpregs[528];
+	} uc;
+};
+static_assert(offsetof(uabi_rt_sigframe, uc) == 128 && sizeof(uabi_rt_sigframe) == 944);
+
 struct ukernel::Process {
 	ElfImage elf_image{}; // boot, not related to ld
 
 	std::unique_ptr<uthread> main_thread{};
 
 	std::string fsroot;
+	PathCache path_cache{};
 	int exe_fd{-1};
 	uabi_ulong brk{};
+	std::mutex mm_lock{}; // brk and mmu state
+
+	std::atomic<bool> exiting{false};
+	int exit_code{};
+
+	std::mutex threads_lock{};
+	std::condition_variable threads_cv{}; // a thread exited or exit_group is issued
+	u32 n_threads{};
+
+	std::mutex sig_lock{};
+	std::array<uabi_sigaction, 64> sigactions{};
+	uabi_ulong sigreturn_tramp{}; // guest handlers return here
+
+	bool is_tenant{}; // shares the host process with other guests
 };
 
 struct uthread {
-	uthread() : state(this)
+	uthread() : state(this), tid(syscall(SYS_gettid))
 	{
 		if (CPUState::Current() != nullptr) {
 			Panic("uthread is already active in this host thread");
@@ -65,22 +156,168 @@ struct uthread {
 		if (CPUState::Current() != &state) {
 			Panic("uthread dies within a different host thread");
 		}
+		if (l1_brind_cache) {
+			tcache::UnregisterBrindCache(l1_brind_cache.get());
+		}
 		CPUState::SetCurrent(nullptr);
 	}
 
+	void InitBrindCache()
+	{
+		l1_brind_cache = std::make_unique<tcache::L1BrindCache>();
+		tcache::RegisterBrindCache(l1_brind_cache.get());
+		state.l1_brind_cache = l1_brind_cache.get();
+	}
+
 	CPUState state;
 	// per-thread/task OS data
-	bool terminating{};
+	std::atomic<bool> terminating{};
 	int termination_code{};
+
+	pid_t tid{};
+	bool resume_at_ip{}; // state replaced by rt_sigreturn
+	struct {
+		int signo;
+		int code;
+		u32 addr;
+	} fault{};
+	uabi_ulong clear_child_tid{};
+	uabi_ulong robust_list{};
+	std::unique_ptr<tcache::L1BrindCache> l1_brind_cache{};
 };
 
-ukernel::Process ukernel::process{};
+static ukernel::Process main_process{};
+thread_local ukernel::Process *ukernel::process{&main_process};
 
 static void DebugTrap(CPUState *state)
 {
 	state->DumpTrace("ebreak");
 }
 
+// Boot once, then fork a warmed child per connection when the guest reaches the marker
+static struct {
+	std::string sock_path{};
+	bool on_ebreak{};
+	int read_fd{-1};
+	bool armed{};
+} fork_server;
+
+void ukernel::SetForkServer(char const *sock_path, char const *marker)
+{
+	fork_server.sock_path = sock_path;
+	if (!strcmp(marker, "ebreak")) {
+		fork_server.on_ebreak = true;
+	} else if (!strncmp(marker, "read:", 5)) {
+		fork_server.read_fd = atoi(marker + 5);
+	} else {
+		Panic("unknown fork-server marker");
+	}
+	if (fork_server.sock_path.size() >= sizeof(sockaddr_un::sun_path)) {
+		Panic("fork-server socket path is too long");
+	}
+	fork_server.armed = true;
+}
+
+// Returns in the forked child with the connection installed as guest stdin/stdout
+static void RunForkServer()
+{
+	fork_server.armed = false;
+	if (tcache::IsShared()) {
+		Panic("fork-server marker reached in multithreaded guest");
+	}
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0) {
+		Panic("fork-server: socket failed");
+	}
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, fork_server.sock_path.c_str());
+	unlink(addr.sun_path);
+	if (bind(sfd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(sfd, SOMAXCONN) < 0) {
+		Panic("fork-server: failed to listen");
+	}
+	uringio::Drain();
+	signal(SIGCHLD, SIG_IGN); // children are reaped automatically
+	log_ukernel("fork-server: listening on %s", addr.sun_path);
+
+	while (true) {
+		int cfd = accept4(sfd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			Panic("fork-server: accept failed");
+		}
+		pid_t pid = fork();
+		if (pid < 0) {
+			Panic("fork-server: fork failed");
+		}
+		if (pid > 0) {
+			log_ukernel("fork-server: forked %d", pid);
+			close(cfd);
+			continue;
+		}
+
+		close(sfd);
+		signal(SIGCHLD, SIG_DFL);
+		uringio::ResetAfterFork();
+		perfmap::ResetAfterFork();
+		sampleprof::ResetAfterFork();
+		stats::ResetAfterFork();
+		dup2(cfd, STDIN_FILENO);
+		dup2(cfd, STDOUT_FILENO);
+		if (fork_server.read_fd >= 0) {
+			dup2(cfd, fork_server.read_fd);
+			ukernel::process->path_cache.ForgetDirfd(fork_server.read_fd);
+		}
+		if (cfd != fork_server.read_fd && cfd > STDERR_FILENO) {
+			close(cfd);
+		}
+		ukernel::process->main_thread->tid = syscall(SYS_gettid);
+		return;
+	}
+}
+
+// Builds rt_sigframe on the guest stack and enters the handler as the kernel does
+static void DeliverFaultSignal(CPUState *state)
+{
+	auto const &fault = state->GetUThread()->fault;
+	uabi_sigaction act;
+	{
+		std::lock_guard lk(ukernel::process->sig_lock);
+		auto &sa = ukernel::process->sigactions[fault.signo - 1];
+		act = sa;
+		if (act.flags & SA_RESETHAND) {
+			sa.handler = UABI_SIG_DFL;
+		}
+	}
+	if (act.handler == UABI_SIG_DFL || act.handler == UABI_SIG_IGN) {
+		state->DumpTrace("signal");
+		log_ukernel("\tfault:guest: pc=%08x, si_addr=%08x", state->ip, fault.addr);
+		Panic("Memory fault in guest address space. See logs for more details");
+	}
+
+	u32 frame_addr = rounddown(state->gpr[2] - (u32)sizeof(uabi_rt_sigframe), 16);
+	auto frame = (uabi_rt_sigframe *)mmu::g2h(frame_addr);
+	memset(frame, 0, sizeof(*frame));
+	frame->info.signo = fault.signo;
+	frame->info.code = fault.code;
+	frame->info.addr = fault.addr;
+	frame->uc.sc_regs[0] = state->ip;
+	for (int i = 1; i < 32; ++i) {
+		frame->uc.sc_regs[i] = state->gpr[i];
+	}
+
+	log_ukernel("deliver signal %d at pc=%08x to %08x", fault.signo, state->ip, act.handler);
+	state->gpr[1] = ukernel::process->sigreturn_tramp;
+	state->gpr[2] = frame_addr;
+	state->gpr[10] = fault.signo;
+	state->gpr[11] = frame_addr + offsetof(uabi_rt_sigframe, info);
+	state->gpr[12] = frame_addr + offsetof(uabi_rt_sigframe, uc);
+	state->ip = act.handler;
+}
+
 void ukernel::Execute()
 {
 	auto *state = CPUState::Current();
@@ -88,24 +325,30 @@ void ukernel::Execute()
 
 	while (!ut->terminating) {
 		dbt::Execute(state);
-		assert(!ut->terminating);
+		if (ut->terminating) { // exit syscalls or exit_group from another thread
+			break;
+		}
 		switch (state->trapno) {
 		case rv32::TrapCode::EBREAK:
 			log_ukernel("ebreak");
-			DebugTrap(state);
-			state->ip += 4; // TODO:
-			break;
-		case rv32::TrapCode::ECALL:
+			if (fork_server.armed && fork_server.on_ebreak) {
+				RunForkServer();
+			} else {
+				DebugTrap(state);
+			}
 			state->ip += 4; // TODO:
-			ukernel::Syscall(state);
 			break;
 		case rv32::TrapCode::ILLEGAL_INSN:
 			log_ukernel("illegal instruction at %08x", state->ip);
 			EnqueueTermination(1);
 			break;
+		case rv32::TrapCode::PAGE_FAULT:
+			DeliverFaultSignal(state);
+			break;
 		default:
 			unreachable("no handle for trap");
 		}
+		state->trapno = rv32::TrapCode::NONE;
 	}
 }
 
@@ -116,6 +359,22 @@ void ukernel::InitMainThread(CPUState *state, ElfImage *elf)
 	state->ip = elf->entry;
 }
 
+// Translated code doesn't sync guest registers before memory accesses, take them from the host context
+static bool RecoverFaultState(CPUState *state, ucontext_t *uc)
+{
+	if constexpr (config::use_interp) {
+		return true;
+	}
+	static constexpr int hreg_map[16] = {REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP,
+					     REG_RSI, REG_RDI, REG_R8,	REG_R9,	 REG_R10, REG_R11,
+					     REG_R12, REG_R13, REG_R14, REG_R15};
+	std::array<u64, 16> hregs;
+	for (size_t i = 0; i < hregs.size(); ++i) {
+		hregs[i] = uc->uc_mcontext.gregs[hreg_map[i]];
+	}
+	return tcache::RecoverFaultState(state, uc->uc_mcontext.gregs[REG_RIP], hregs.data());
+}
+
 static void dbt_sigaction_memory(int signo, siginfo_t *sinfo, void *uctx_raw)
 {
 	auto uc = static_cast<ucontext_t *>(uctx_raw);
@@ -132,9 +391,46 @@ static void dbt_sigaction_memory(int signo, siginfo_t *sinfo, void *uctx_raw)
 	}
 	auto g_faddr = mmu::h2g(sinfo->si_addr);
 
-	state->DumpTrace("signal");
+	// Write to a page with translated code, restart it once translations are dropped
+	bool is_write = uc->uc_mcontext.gregs[REG_ERR] & 2;
+	if (signo == SIGSEGV && sinfo->si_code == SEGV_ACCERR && is_write) {
+		if (tcache::HandleCodeWrite(g_faddr)) {
+			return;
+		}
+	}
+
+	// Faults in runtime code or llvm-aot code have no precise guest state
+	if (!RecoverFaultState(state, uc)) {
+		state->DumpTrace("signal");
+		log_ukernel("\tfault:guest: pc=%08x, si_addr=%08x", state->ip, g_faddr);
+		Panic("Memory fault in guest address space. See logs for more details");
+	}
 	log_ukernel("\tfault:guest: pc=%08x, si_addr=%08x", state->ip, g_faddr);
-	Panic("Memory fault in guest address space. See logs for more details");
+
+	// SA_NODEFER: the mask is not restored by siglongjmp
+	state->GetUThread()->fault = {signo, sinfo->si_code, g_faddr};
+	state->trapno = rv32::TrapCode::PAGE_FAULT;
+	RaiseTrap();
+}
+
+// Sent to the main thread by exit_group, interrupts blocking syscalls
+static int const SIG_KICK = SIGRTMIN;
+
+static void dbt_sigaction_kick(int signo, siginfo_t *sinfo, void *uctx_raw)
+{
+	auto state = CPUState::Current();
+	if (state == nullptr || !ukernel::process->exiting) {
+		return;
+	}
+	auto ut = state->GetUThread();
+	ut->termination_code = ukernel::process->exit_code;
+	ut->terminating = true;
+	// The dispatcher stops on the pending trap, translated code without syscalls is left right away
+	state->trapno = rv32::TrapCode::ECALL;
+	auto uc = static_cast<ucontext_t *>(uctx_raw);
+	if (tcache::IsTranslatedCode(uc->uc_mcontext.gregs[REG_RIP])) {
+		RaiseTrap();
+	}
 }
 
 // TODO: emulate signals
@@ -144,11 +440,17 @@ void ukernel::InitSignals(CPUState *state)
 	sigset_t sset;
 
 	sigfillset(&sset);
-	sa.sa_flags = SA_SIGINFO;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sa.sa_sigaction = dbt_sigaction_memory;
 
 	sigaction(SIGSEGV, &sa, nullptr);
 	sigaction(SIGBUS, &sa, nullptr);
+
+	// No SA_RESTART: blocking syscalls return EINTR and the thread notices termination
+	// SA_NODEFER: the handler may leave translated code by siglongjmp
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sa.sa_sigaction = dbt_sigaction_kick;
+	sigaction(SIG_KICK, &sa, nullptr);
 }
 
 // demo-kernel for debugging
@@ -182,7 +484,7 @@ void ukernel::SyscallDemo(CPUState *state)
 static int HandleSpecialPath(char const *path, char *resolved)
 {
 	if (!strcmp(path, "/proc/self/exe")) {
-		sprintf(resolved, "/proc/self/fd/%d", ukernel::process.exe_fd);
+		sprintf(resolved, "/proc/self/fd/%d", ukernel::process->exe_fd);
 		log_ukernel("exe_fd: %s", resolved);
 		return 1;
 	}
@@ -195,7 +497,37 @@ void ukernel::SetFSRoot(const char *fsroot_)
 	if (!realpath(fsroot_, buf)) {
 		Panic("failed to resolve fsroot");
 	}
-	process.fsroot = std::string(buf) + "/";
+	process->fsroot = std::string(buf) + "/";
+}
+
+PathCache::Dir *PathCache::GetDir(int dirfd)
+{
+	if (auto it = dirs.find(dirfd); it != dirs.end()) {
+		return &it->second;
+	}
+
+	char buf[PATH_MAX];
+	if (dirfd == ABS_DIRFD) {
+		buf[0] = 0;
+	} else if (dirfd == AT_FDCWD) {
+		if (!getcwd(buf, sizeof(buf) - 1)) {
+			return nullptr;
+		}
+	} else {
+		char fdpath[64];
+		sprintf(fdpath, "/proc/self/fd/%d", dirfd);
+		auto len = readlink(fdpath, buf, sizeof(buf) - 2);
+		if (len < 0) {
+			return nullptr;
+		}
+		buf[len] = 0;
+	}
+	auto &dir = dirs[dirfd];
+	dir.base = buf;
+	if (dirfd != ABS_DIRFD && dir.base.back() != '/') {
+		dir.base += '/';
+	}
+	return &dir;
 }
 
 static int PathResolution(int dirfd, char const *path, char *resolved)
@@ -203,23 +535,25 @@ static int PathResolution(int dirfd, char const *path, char *resolved)
 	char rp_buf[PATH_MAX];
 
 	log_ukernel("start path resolution: %s", path);
-	auto const &fsroot = ukernel::process.fsroot;
+	auto const &fsroot = ukernel::process->fsroot;
+	auto &cache = ukernel::process->path_cache;
+	std::lock_guard lk(cache.lock);
+
+	auto dir = path[0] == '/' ? cache.GetDir(PathCache::ABS_DIRFD)
+				  : (dirfd >= 0 || dirfd == AT_FDCWD) ? cache.GetDir(dirfd) : nullptr;
+	if (!dir) {
+		log_ukernel("bad dirfd");
+		return -1;
+	}
+	if (auto it = dir->resolved.find(path); it != dir->resolved.end()) {
+		strcpy(resolved, it->second.c_str());
+		return 0;
+	}
 
 	if (path[0] == '/') {
 		snprintf(rp_buf, sizeof(rp_buf), "%s/%s", fsroot.c_str(), path);
 	} else {
-		if (dirfd == AT_FDCWD) {
-			getcwd(rp_buf, sizeof(rp_buf));
-		} else {
-			char fdpath[64];
-			sprintf(fdpath, "/proc/self/fd/%d", dirfd);
-			if (readlink(fdpath, rp_buf, sizeof(rp_buf)) < 0) {
-				log_ukernel("bad dirfd");
-				return -1;
-			}
-		}
-		size_t pref_sz = strlen(rp_buf);
-		strncpy(rp_buf + pref_sz, path, sizeof(rp_buf) - pref_sz);
+		snprintf(rp_buf, sizeof(rp_buf), "%s%s", dir->base.c_str(), path);
 	}
 	if (strncmp(rp_buf, fsroot.c_str(), fsroot.length())) {
 		Panic("escaped fsroot");
@@ -232,7 +566,7 @@ static int PathResolution(int dirfd, char const *path, char *resolved)
 	// TODO: make it preceise, resolve "/.." and symlinks
 	if (!realpath(rp_buf, resolved)) {
 		log_ukernel("unresolved path %s", rp_buf);
-		return -1;
+		return -1; // not cached, the file may appear later
 	}
 	if (strncmp(resolved, fsroot.c_str(), fsroot.length())) {
 		Panic("escaped fsroot");
@@ -242,6 +576,10 @@ static int PathResolution(int dirfd, char const *path, char *resolved)
 		strcpy(resolved, path);
 	}
 
+	if (dir->resolved.size() >= PathCache::MAX_ENTRIES) {
+		dir->resolved.clear();
+	}
+	dir->resolved.emplace(path, resolved);
 	return 0;
 }
 
@@ -288,7 +626,13 @@ static uabi_long linux_close(uabi_uint fd)
 	if (fd < 3) { // TODO: split file descriptors
 		return 0;
 	}
-	return rcerrno(close(fd));
+	ukernel::process->path_cache.ForgetDirfd(fd);
+	int err = uringio::Sync(fd, true);
+	int rc = close(fd);
+	if (err) {
+		return -err;
+	}
+	return rcerrno(rc);
 }
 
 static uabi_long uerrno(int e)
@@ -296,6 +640,13 @@ static uabi_long uerrno(int e)
 	return e;
 }
 
+// Required only for buffers filled by the host kernel: its writes to write-protected code pages fail with
+// EFAULT instead of faulting. Stores from ukernel code fault and go through tcache::HandleCodeWrite
+static inline void PrepareUserWrite(void __user *buf, uabi_size_t len)
+{
+	tcache::PrepareCodeWrite(mmu::h2g(buf), len);
+}
+
 static uabi_long linux_llseek(uabi_uint fd, uabi_ulong offset_high, uabi_ulong offset_low,
 			      loff_t __user *result, uabi_uint whence)
 {
@@ -309,14 +660,46 @@ static uabi_long linux_llseek(uabi_uint fd, uabi_ulong offset_high, uabi_ulong o
 
 static uabi_long linux_read(uabi_uint fd, char __user *buf, uabi_size_t count)
 {
+	if (unlikely(fork_server.armed) && (int)fd == fork_server.read_fd) {
+		RunForkServer();
+	}
+	PrepareUserWrite(buf, count);
 	return rcerrno(read(fd, buf, count));
 }
 
 static uabi_long linux_write(uabi_uint fd, const char __user *buf, uabi_size_t count)
 {
+	// stderr stays synchronous, so nothing is lost if the guest crashes
+	if (uringio::IsEnabled() && fd != STDERR_FILENO) {
+		// The ring buffer copy would fault on a bad guest buffer, the host write returns EFAULT
+		if (!mmu::IsGuestMapped(mmu::h2g((void *)buf), count, PROT_READ)) {
+			return -EFAULT;
+		}
+		return rcerrno(uringio::Write(fd, buf, count));
+	}
+	// Buffered stdout goes first, the output might be merged by 2>&1
+	uringio::Drain();
 	return rcerrno(write(fd, buf, count));
 }
 
+static uabi_long linux_pread64(uabi_uint fd, char __user *buf, uabi_size_t count, uabi_ulong pos_low,
+			       uabi_ulong pos_high)
+{
+	off_t pos = ((u64)pos_high << 32) | pos_low;
+	PrepareUserWrite(buf, count);
+	return rcerrno(pread(fd, buf, count, pos));
+}
+
+static uabi_long linux_fsync(uabi_uint fd)
+{
+	int err = uringio::Sync(fd, false);
+	int rc = fsync(fd);
+	if (err) {
+		return -err;
+	}
+	return rcerrno(rc);
+}
+
 static uabi_long linux_readlinkat(uabi_int dfd, const char __user *path, char __user *buf, uabi_int bufsiz)
 {
 	char pathbuf[PATH_MAX];
@@ -327,6 +710,7 @@ static uabi_long linux_readlinkat(uabi_int dfd, const char __user *path, char __
 	} else {
 		pathbuf[0] = 0;
 	}
+	PrepareUserWrite(buf, bufsiz);
 	return rcerrno(readlinkat(dfd, pathbuf, buf, bufsiz));
 }
 
@@ -335,18 +719,66 @@ using uabi_stat64 = struct stat;
 static uabi_long linux_fstat64(uabi_uint fd, uabi_stat64 __user *statbuf)
 {
 	// TODO: verify!!!
+	PrepareUserWrite(statbuf, sizeof(*statbuf));
 	return rcerrno(fstatat(fd, "", statbuf, 0));
 }
 
-static uabi_long linux_set_tid_address(uabi_int __user *tidptr)
+static uabi_long linux_set_tid_address(uabi_ulong tidptr)
 {
-	int h_tidptr;
-	long rc = syscall(SYS_set_tid_address, &h_tidptr);
-	if (rc < 0) {
-		return -errno;
+	// Cleared by ukernel::ThreadExit, not by the host
+	auto ut = CPUState::Current()->GetUThread();
+	ut->clear_child_tid = tidptr;
+	return ut->tid;
+}
+
+static uabi_long linux_gettid()
+{
+	return CPUState::Current()->GetUThread()->tid;
+}
+
+struct uabi_robust_list_head {
+	uabi_ulong next;
+	uabi_long futex_offset;
+	uabi_ulong list_op_pending;
+};
+
+static uabi_long linux_set_robust_list(uabi_ulong head, uabi_size_t len)
+{
+	if (len != sizeof(uabi_robust_list_head)) {
+		return -EINVAL;
 	}
-	*tidptr = h_tidptr;
-	return rc;
+	CPUState::Current()->GetUThread()->robust_list = head;
+	return 0;
+}
+
+static uabi_long linux_futex_time64(u32 __user *uaddr, uabi_int op, u32 val, uabi_ulong utime,
+				    uabi_ulong uaddr2, u32 val3)
+{
+	void *h_utime;
+	switch (op & FUTEX_CMD_MASK) {
+	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
+	case FUTEX_LOCK_PI:
+	case FUTEX_WAIT_REQUEUE_PI:
+		// uabi__kernel_timespec matches the host timespec
+		h_utime = utime ? mmu::g2h(utime) : nullptr;
+		break;
+	default: // val2
+		h_utime = (void *)(uptr)utime;
+	}
+	void *h_uaddr2 = uaddr2 ? mmu::g2h(uaddr2) : nullptr;
+	return rcerrno(syscall(SYS_futex, uaddr, op, val, h_utime, h_uaddr2, val3));
+}
+
+static uabi_long linux_clone(uabi_ulong flags, uabi_ulong newsp, uabi_ulong ptid, uabi_ulong tls,
+			     uabi_ulong ctid)
+{
+	constexpr uabi_ulong thread_flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD;
+	if ((flags & thread_flags) != thread_flags) {
+		log_ukernel("clone: only threads are supported, flags=%08x", flags);
+		return -ENOSYS;
+	}
+	return ukernel::CloneThread(flags, newsp, ptid, tls, ctid);
 }
 
 static uabi_long linux_exit(uabi_int error_code)
@@ -357,20 +789,58 @@ static uabi_long linux_exit(uabi_int error_code)
 
 static uabi_long linux_exit_group(uabi_int error_code)
 {
-	return linux_exit(error_code);
+	ukernel::EnqueueGroupTermination(error_code);
+	return 0;
 }
 
-static uabi_long linux_rt_sigaction(int, const struct uabi_sigaction __user *, struct sigaction __user *,
-				    uabi_size_t)
+// Guest handlers are invoked only for memory faults, other signals are not emulated yet
+static uabi_long linux_rt_sigaction(uabi_int sig, uabi_ulong act, uabi_ulong oact, uabi_size_t sigsetsize)
 {
-	log_ukernel("TODO: support signals");
+	if (sig < 1 || sig > 64 || sig == SIGKILL || sig == SIGSTOP) {
+		return -EINVAL;
+	}
+	auto p = ukernel::process;
+	std::lock_guard lk(p->sig_lock);
+	auto &sa = p->sigactions[sig - 1];
+	if (oact) {
+		*(uabi_sigaction *)mmu::g2h(oact) = sa;
+	}
+	if (act) {
+		sa = *(uabi_sigaction *)mmu::g2h(act);
+		log_ukernel("rt_sigaction: sig=%d handler=%08x", sig, sa.handler);
+	}
+	if (!p->sigreturn_tramp && sa.handler > UABI_SIG_IGN) {
+		// li a7, __NR_rt_sigreturn; ecall
+		static constexpr u32 tramp[2] = {0x08b00893, 0x00000073};
+		std::lock_guard lk_mm(p->mm_lock);
+		void *page = mmu::mmap(0, mmu::PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE);
+		if (page == MAP_FAILED) {
+			return -ENOMEM;
+		}
+		memcpy(page, tramp, sizeof(tramp));
+		p->sigreturn_tramp = mmu::h2g(page);
+	}
 	return 0;
 }
 
+static uabi_long linux_rt_sigreturn()
+{
+	auto state = CPUState::Current();
+	auto frame = (uabi_rt_sigframe *)mmu::g2h(state->gpr[2]);
+	for (int i = 1; i < 32; ++i) {
+		state->gpr[i] = frame->uc.sc_regs[i];
+	}
+	state->ip = frame->uc.sc_regs[0];
+	state->GetUThread()->resume_at_ip = true;
+	log_ukernel("rt_sigreturn to %08x", state->ip);
+	return state->gpr[10];
+}
+
 using uabi_new_utsname = struct utsname;
 
 static uabi_long linux_uname(uabi_new_utsname __user *name)
 {
+	PrepareUserWrite(name, sizeof(*name));
 	uabi_long rc = uname(name);
 	strcpy(name->machine, "riscv32");
 	return rcerrno(rc);
@@ -435,7 +905,8 @@ static uabi_long linux_sysinfo(struct uabi_sysinfo __user *info)
 
 static uabi_long linux_brk(uabi_ulong newbrk)
 {
-	auto &brk = ukernel::process.brk;
+	std::lock_guard lk(ukernel::process->mm_lock);
+	auto &brk = ukernel::process->brk;
 
 	if (newbrk <= brk) {
 		log_ukernel("do_sys_brk: newbrk is too small: %08x %08x", newbrk, brk);
@@ -461,28 +932,36 @@ static uabi_long linux_brk(uabi_ulong newbrk)
 
 static uabi_long linux_munmap(uabi_ulong gaddr, uabi_size_t len)
 {
-	// TODO: implement in mmu
+	std::lock_guard lk(ukernel::process->mm_lock);
 	log_ukernel("munmap addr: %x", mmu::g2h(gaddr));
-	return rcerrno(munmap(mmu::g2h(gaddr), len));
+	uabi_long rc = rcerrno(mmu::munmap(gaddr, len));
+	if (rc == 0) {
+		tcache::InvalidateRange(gaddr, len);
+	}
+	return rc;
 }
 
 static uabi_long linux_mmap2(uabi_ulong gaddr, uabi_size_t len, uabi_ulong prot, uabi_ulong flags,
 			     uabi_uint fd, uabi_ulong off)
 {
 	// TODO: file maps in mmu
+	std::lock_guard lk(ukernel::process->mm_lock);
 	void *ret = mmu::mmap(gaddr, len, prot, flags, fd, off);
 	if (ret == MAP_FAILED) {
 		return uerrno(-errno);
 	}
 	uabi_long rc = mmu::h2g(ret);
+	if (flags & MAP_FIXED) {
+		tcache::InvalidateRange(rc, len);
+	}
 	log_ukernel("mmap addr: %x", rc);
 	return rc;
 }
 
 static uabi_long linux_mprotect(uabi_ulong start, uabi_size_t len, uabi_ulong prot)
 {
-	// TODO: implement in mmu
-	return rcerrno(mprotect(mmu::g2h(start), len, prot));
+	std::lock_guard lk(ukernel::process->mm_lock);
+	return rcerrno(mmu::mprotect(start, len, prot));
 }
 
 using uabi_pid_t = uabi_int;
@@ -518,6 +997,7 @@ static uabi_long linux_prlimit64(uabi_pid_t pid, uabi_uint resource,
 
 static uabi_long linux_getrandom(char __user *buf, uabi_size_t count, uabi_uint flags)
 {
+	PrepareUserWrite(buf, count);
 	return rcerrno(getrandom(buf, count, flags));
 }
 
@@ -534,6 +1014,7 @@ static uabi_long linux_statx(uabi_int dfd, const char __user *path, unsigned fla
 	} else {
 		pathbuf[0] = 0;
 	}
+	PrepareUserWrite(buffer, sizeof(*buffer));
 	return rcerrno(statx(dfd, pathbuf, flags, mask, buffer));
 }
 
@@ -553,8 +1034,23 @@ static uabi_long linux_clock_gettime64(clockid_t which_clock, uabi__kernel_times
 
 } // namespace ukernel_syscall
 
+void ukernel::SyscallDirect(CPUState *state)
+{
+	ukernel::Syscall(state);
+	auto ut = state->GetUThread();
+	if (unlikely(ut->terminating)) {
+		state->trapno = rv32::TrapCode::ECALL;
+		RaiseTrap();
+	}
+	if (unlikely(ut->resume_at_ip)) {
+		ut->resume_at_ip = false;
+		RaiseTrap(); // no trap pending, dispatch continues at the restored ip
+	}
+}
+
 void ukernel::Syscall(CPUState *state)
 {
+	sampleprof::ScopedActivity act(sampleprof::Activity::SYSCALL);
 #ifdef DBT_LINUX_GUEST
 	ukernel::SyscallLinux(state);
 #else
@@ -568,12 +1064,19 @@ void ukernel::Syscall(CPUState *state)
 	X(linux_llseek)                                                                                      \
 	X(linux_read)                                                                                        \
 	X(linux_write)                                                                                       \
+	X(linux_pread64)                                                                                     \
+	X(linux_fsync)                                                                                       \
 	X(linux_readlinkat)                                                                                  \
 	X(linux_fstat64)                                                                                     \
 	X(linux_set_tid_address)                                                                             \
+	X(linux_gettid)                                                                                      \
+	X(linux_set_robust_list)                                                                             \
+	X(linux_futex_time64)                                                                                \
+	X(linux_clone)                                                                                       \
 	X(linux_exit)                                                                                        \
 	X(linux_exit_group)                                                                                  \
 	X(linux_rt_sigaction)                                                                                \
+	X(linux_rt_sigreturn)                                                                                \
 	X(linux_uname)                                                                                       \
 	X(linux_getuid)                                                                                      \
 	X(linux_geteuid)                                                                                     \
@@ -589,7 +1092,7 @@ void ukernel::Syscall(CPUState *state)
 	X(linux_statx)                                                                                       \
 	X(linux_clock_gettime64)
 
-#define SKIPPED_SYSCALLS(X) X(linux_set_robust_list)
+#define SKIPPED_SYSCALLS(X) X(linux_clone3)
 
 void ukernel::SyscallLinux(CPUState *state)
 {
@@ -600,6 +1103,11 @@ void ukernel::SyscallLinux(CPUState *state)
 					 (uabi_long)state->gpr[16]};
 	uabi_long syscallno = state->gpr[17];
 
+	// Buffered writes become visible before anything else the guest can observe
+	if (syscallno != to_underlying(SyscallID::linux_write)) {
+		uringio::Drain();
+	}
+
 	auto dump_syscall = [state, syscallno](char const *name) {
 		log_ukernel("%s (no=%d)\t ip=%08x", name, syscallno, state->ip);
 	};
@@ -659,9 +1167,12 @@ void ukernel::InitElfMappings(const char *path, ElfImage *elf)
 	}
 
 	LoadElf(fd, elf);
-	objprof::Announce(fd, true);
-	process.exe_fd = fd;
-	process.brk = elf->brk;
+	// Tenants run the same elf, TenantsExecute announced it already
+	if (!process->is_tenant) {
+		AnnounceElf(fd, true);
+	}
+	process->exe_fd = fd;
+	process->brk = elf->brk;
 
 	static constexpr u32 stk_size = 8_MB; // switch to 32 * mmu::PAGE_SIZE if debugging
 #if 0
@@ -674,35 +1185,92 @@ void ukernel::InitElfMappings(const char *path, ElfImage *elf)
 				  PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED);
 #endif
 	elf->stack_start = mmu::h2g(stk_ptr) + stk_size;
+
+	static constexpr u32 stk_prefault = 256_KB;
+	mmu::Prefault(elf->stack_start - stk_prefault, stk_prefault);
 }
 
 void ukernel::MainThreadBoot(int argv_n, char **argv)
 {
-	process.main_thread = std::make_unique<uthread>();
+	process->main_thread = std::make_unique<uthread>();
 	auto state = CPUState::Current();
 
-	auto *elf = &process.elf_image;
+	auto *elf = &process->elf_image;
 
 	assert(argv_n > 0);
-	std::string elf_path = process.fsroot + '/' + argv[0];
+	std::string elf_path = process->fsroot + '/' + argv[0];
 	InitElfMappings(elf_path.c_str(), elf);
 
 #ifdef DBT_LINUX_GUEST
 	InitAVectors(elf, argv_n, argv);
 #endif
 	InitMainThread(state, elf);
+	process->n_threads = 1;
+	if (tcache::IsShared()) {
+		process->main_thread->InitBrindCache();
+	}
 }
 
 int ukernel::MainThreadExecute()
 {
 	auto state = CPUState::Current();
 	auto ut = state->GetUThread();
-	assert(ut == process.main_thread.get());
+	assert(ut == process->main_thread.get());
 	Execute();
 	assert(ut->terminating);
-	// TODO(threading): make it a single exit point
-	int rc = ut->termination_code;
-	(void)process.main_thread.release();
+	uringio::Drain();
+	if (!process->exiting) {
+		// Plain exit of the main thread, the process lives until the last thread exits
+		ThreadExit(ut);
+		ReleaseThread();
+		std::unique_lock lk(process->threads_lock);
+		process->threads_cv.wait(lk, [] { return process->n_threads == 0 || process->exiting; });
+	}
+	// Threads left after exit_group die with the process
+	int rc = process->exiting ? process->exit_code : ut->termination_code;
+	(void)process->main_thread.release();
+	return rc;
+}
+
+int ukernel::TenantsExecute(unsigned n_tenants, int argv_n, char **argv)
+{
+	if constexpr (config::zero_membase) {
+		Panic("tenants need a separate address space each, zero membase build allows only one");
+	}
+	tcache::SetShared();
+	auto const fsroot = process->fsroot;
+
+	// Process-wide state, set up once before tenants start
+	assert(argv_n > 0);
+	std::string elf_path = fsroot + '/' + argv[0];
+	int elf_fd = open(elf_path.c_str(), O_RDONLY);
+	if (elf_fd < 0) {
+		Panic("no such elf file");
+	}
+	AnnounceElf(elf_fd, true);
+	close(elf_fd);
+
+	std::vector<int> rcs(n_tenants);
+	std::vector<std::thread> tenants;
+	for (unsigned i = 0; i < n_tenants; ++i) {
+		tenants.emplace_back([&, i]() {
+			process = new Process(); // lives until the host process exits, as the main one
+			process->fsroot = fsroot;
+			process->is_tenant = true;
+			mmu::BindSpace(mmu::CreateSpace());
+			MainThreadBoot(argv_n, argv);
+			rcs[i] = MainThreadExecute();
+		});
+	}
+
+	int rc = 0;
+	for (unsigned i = 0; i < n_tenants; ++i) {
+		tenants[i].join();
+		log_ukernel("tenant %u exited with code=%d", i, rcs[i]);
+		if (rc == 0) {
+			rc = rcs[i];
+		}
+	}
 	return rc;
 }
 
@@ -711,9 +1279,193 @@ void ukernel::EnqueueTermination(int code)
 	auto ut = CPUState::Current()->GetUThread();
 	ut->terminating = true;
 	ut->termination_code = code;
-	log_ukernel("thread issued termination with code=%d", code);
-	// TODO(threading): issue a signal
-	assert(ut == process.main_thread.get());
+	log_ukernel("thread %d issued termination with code=%d", ut->tid, code);
+}
+
+void ukernel::EnqueueGroupTermination(int code)
+{
+	process->exit_code = code;
+	process->exiting = true;
+	EnqueueTermination(code);
+	{
+		std::lock_guard lk(process->threads_lock);
+		process->threads_cv.notify_all();
+	}
+
+	auto ut = CPUState::Current()->GetUThread();
+	auto main_ut = process->main_thread.get();
+	if (ut == main_ut) {
+		return;
+	}
+	// Kick the main thread until it returns from MainThreadExecute and the process exits
+	static constexpr uint KICK_ATTEMPTS = 100;
+	static constexpr uint KICK_PERIOD_US = 10000;
+	for (uint i = 0; i < KICK_ATTEMPTS; ++i) {
+		syscall(SYS_tgkill, getpid(), main_ut->tid, SIG_KICK);
+		usleep(KICK_PERIOD_US);
+	}
+	if (process->is_tenant) {
+		// Other tenants share the host process, the kill flag stops the main thread at a safepoint
+		log_ukernel("tenant main thread doesn't respond, thread %d exits", ut->tid);
+		return;
+	}
+	log_ukernel("main thread doesn't respond, exit from thread %d", ut->tid);
+	FlushOnExit();
+	fsmanager::Destroy();
+	_exit(code);
+}
+
+void ukernel::FlushOnExit()
+{
+	// Whoever comes first flushes, the other one waits for it to complete
+	static std::mutex lock;
+	static bool flushed = false;
+	std::lock_guard lk(lock);
+	if (flushed) {
+		return;
+	}
+	flushed = true;
+
+	objprof::UpdateProfile();
+	uringio::Destroy();
+	perfmap::Destroy();
+	sampleprof::Destroy();
+	stats::Destroy();
+	// The process leaves with _exit
+	fflush(nullptr);
+}
+
+bool ukernel::HasLiveThreads()
+{
+	std::lock_guard lk(process->threads_lock);
+	return process->n_threads != 0;
+}
+
+void ukernel::ReleaseThread()
+{
+	std::lock_guard lk(process->threads_lock);
+	process->n_threads--;
+	process->threads_cv.notify_all();
+}
+
+struct CloneArgs {
+	CPUState *parent;
+	ukernel::Process *process;
+	mmu::Space *space;
+	uabi_ulong flags, newsp, ptid, tls, ctid;
+	std::promise<pid_t> tid{};
+};
+
+uabi_long ukernel::CloneThread(uabi_ulong flags, uabi_ulong newsp, uabi_ulong ptid, uabi_ulong tls,
+			       uabi_ulong ctid)
+{
+	if (process->is_tenant) {
+		log_ukernel("clone: threads are not supported in tenant mode");
+		return -EAGAIN;
+	}
+	CloneArgs args{CPUState::Current(), process, mmu::CurrentSpace(), flags, newsp, ptid, tls, ctid};
+	auto tid = args.tid.get_future();
+
+	tcache::SetShared();
+	{
+		std::lock_guard lk(process->threads_lock);
+		process->n_threads++;
+	}
+
+	pthread_attr_t attr;
+	pthread_t thread;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int rc = pthread_create(&thread, &attr, ThreadMain, &args);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		ReleaseThread();
+		return -rc;
+	}
+	return tid.get();
+}
+
+void *ukernel::ThreadMain(void *arg)
+{
+	auto *args = (CloneArgs *)arg;
+	process = args->process;
+	mmu::BindSpace(args->space);
+	auto ut = std::make_unique<uthread>();
+	auto state = &ut->state;
+
+	ut->InitBrindCache();
+
+	// Parent's ip already points past ecall
+	state->gpr = args->parent->gpr;
+	state->ip = args->parent->ip;
+	state->gpr[10] = 0;
+	if (args->newsp) {
+		state->gpr[2] = args->newsp;
+	}
+	if (args->flags & CLONE_SETTLS) {
+		state->gpr[4] = args->tls;
+	}
+	if (args->flags & CLONE_CHILD_CLEARTID) {
+		ut->clear_child_tid = args->ctid;
+	}
+	if (args->flags & CLONE_CHILD_SETTID) {
+		*(u32 *)mmu::g2h(args->ctid) = ut->tid;
+	}
+	if (args->flags & CLONE_PARENT_SETTID) {
+		*(u32 *)mmu::g2h(args->ptid) = ut->tid;
+	}
+	log_ukernel("thread %d started at %08x", ut->tid, state->ip);
+	args->tid.set_value(ut->tid); // args is dead after this point
+
+	Execute();
+	ThreadExit(ut.get());
+	ut.reset();
+	ReleaseThread();
+	return nullptr;
+}
+
+static void HandleFutexDeath(uabi_ulong uaddr, pid_t tid)
+{
+	auto *futex = (u32 *)mmu::g2h(uaddr);
+	u32 val = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+	while ((val & FUTEX_TID_MASK) == (u32)tid) {
+		u32 nval = (val & FUTEX_WAITERS) | FUTEX_OWNER_DIED;
+		if (__atomic_compare_exchange_n(futex, &val, nval, false, __ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST)) {
+			if (val & FUTEX_WAITERS) {
+				syscall(SYS_futex, futex, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+			}
+			break;
+		}
+	}
+}
+
+// Same as the kernel does on thread exit: release robust futexes and wake the joiner
+void ukernel::ThreadExit(uthread *ut)
+{
+	if (ut->robust_list) {
+		auto head = (ukernel_syscall::uabi_robust_list_head *)mmu::g2h(ut->robust_list);
+		uabi_ulong pending = head->list_op_pending & ~1u;
+
+		uabi_ulong entry = head->next & ~1u;
+		for (u32 i = 0; entry != ut->robust_list && i < ROBUST_LIST_LIMIT; ++i) {
+			uabi_ulong next = *(uabi_ulong *)mmu::g2h(entry) & ~1u;
+			if (entry != pending) {
+				HandleFutexDeath(entry + head->futex_offset, ut->tid);
+			}
+			entry = next;
+		}
+		if (pending) {
+			HandleFutexDeath(pending + head->futex_offset, ut->tid);
+		}
+	}
+
+	if (ut->clear_child_tid) {
+		auto *ctid = (u32 *)mmu::g2h(ut->clear_child_tid);
+		__atomic_store_n(ctid, 0, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, ctid, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+	}
+	log_ukernel("thread %d exited", ut->tid);
 }
 
 void ukernel::ReproduceElfMappings(const char *path)
@@ -724,10 +1476,21 @@ void ukernel::ReproduceElfMappings(const char *path)
 		Panic("no such elf file");
 	}
 	LoadElf(fd, &elf);
-	objprof::Announce(fd, false);
+	AnnounceElf(fd, false);
 	close(fd);
 }
 
+// Process-wide state derived from the elf: symbols, profile and cached code
+void ukernel::AnnounceElf(int fd, bool jit_mode)
+{
+	if (NativeFunctions::IsEnabled() || guestsyms::IsEnabled()) {
+		auto funcs = guestsyms::ReadFunctions(fd);
+		NativeFunctions::BindSymbols(funcs);
+		guestsyms::Load(funcs);
+	}
+	objprof::Announce(fd, jit_mode);
+}
+
 void ukernel::LoadElf(int fd, ElfImage *elf)
 {
 	auto &ehdr = elf->ehdr;
@@ -780,7 +1543,7 @@ void ukernel::LoadElf(int fd, ElfImage *elf)
 		if (phdr->p_filesz != 0) {
 			u32 len = roundup(phdr->p_filesz + vaddr_po, mmu::PAGE_SIZE);
 			// shared flags
-			mmu::mmap(vaddr_ps, len, prot, MAP_FIXED | MAP_PRIVATE, fd,
+			mmu::mmap(vaddr_ps, len, prot, MAP_FIXED | MAP_PRIVATE | mmu::HotMapFlags(), fd,
 				  phdr->p_offset - vaddr_po);
 			if (phdr->p_memsz > phdr->p_filesz) {
 				auto bss_start = vaddr + phdr->p_filesz;
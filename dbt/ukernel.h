@@ -27,23 +27,41 @@ struct ukernel {
 	struct Process;
 
 	static void SetFSRoot(char const *fsroot_);
+	// marker: "ebreak" or "read:<fd>"
+	static void SetForkServer(char const *sock_path, char const *marker);
 
 	static void MainThreadBoot(int argv_n, char **argv);
 	static int MainThreadExecute();
+	// Run independent guest processes in host threads sharing the translation cache
+	static int TenantsExecute(unsigned n_tenants, int argv_n, char **argv);
 
 	static void ReproduceElfMappings(char const *path);
 
 	static void Execute();
+	// Called from translated code, unwinds only if the thread terminates
+	static void SyscallDirect(CPUState *state);
 	static void EnqueueTermination(int code);
+	static void EnqueueGroupTermination(int code);
+	// Writes out profiles and runtime stats, once per process
+	static void FlushOnExit();
+	// Guest threads still running, exit_group doesn't wait for them
+	static bool HasLiveThreads();
 
-	static Process process;
+	static uabi_long CloneThread(uabi_ulong flags, uabi_ulong newsp, uabi_ulong ptid, uabi_ulong tls,
+				     uabi_ulong ctid);
+
+	static thread_local Process *process;
 
 private:
 	static void InitElfMappings(char const *path, ElfImage *elf);
 	static void InitAVectors(ElfImage *elf, int argv_n, char **argv);
 	static void LoadElf(int elf_fd, ElfImage *elf);
+	static void AnnounceElf(int elf_fd, bool jit_mode);
 
 	static void InitMainThread(CPUState *state, ElfImage *elf);
+	static void *ThreadMain(void *arg);
+	static void ThreadExit(uthread *ut);
+	static void ReleaseThread();
 	static void InitSignals(CPUState *state);
 	static void Syscall(CPUState *state);
 	static void SyscallDemo(CPUState *state);
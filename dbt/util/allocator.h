@@ -7,4 +7,8 @@ namespace dbt
 
 void *host_mmap(void *addr, size_t len, int prot, int flags, int fd, __off_t offset);
 
+// No-ops unless enabled in mmu::Configure
+void host_hugepages(void *addr, size_t len);
+void host_prefault(void *addr, size_t len);
+
 } // namespace dbt
@@ -164,6 +164,38 @@ std::pair<void *, CacheState> OpenCacheFile(char const *path, size_t size, bool
 	return res;
 }
 
+static std::pair<void *, bool> Task_OpenSharedCacheFile(char const *path, size_t size)
+{
+	int fd;
+	if (fd = open(path, O_RDWR | O_CREAT, 0666); fd < 0) {
+		Panic(std::string("failed to open: ") + path);
+	}
+	xflock(fd, true, false);
+	bool const created = GetFileSize(fd) == 0;
+	if (created && ftruncate(fd, size) < 0) {
+		Panic();
+	}
+	if (GetFileSize(fd) != size) {
+		Panic(std::string("bad shared cache file size: ") + path);
+	}
+	xflock_unlock(fd);
+
+	void *fmap = host_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fmap == MAP_FAILED) {
+		Panic();
+	}
+	close(fd);
+	return std::make_pair(fmap, created);
+}
+
+std::pair<void *, bool> OpenSharedCacheFile(char const *path, size_t size)
+{
+	std::pair<void *, bool> res;
+	SendTask([&res, path, size]() { res = Task_OpenSharedCacheFile(path, size); });
+	log_fsmanager("open shared cache file: %s: %s", path, res.second ? "new" : "old");
+	return res;
+}
+
 char const *CacheStateToStr(CacheState s)
 {
 	switch (s) {
@@ -21,6 +21,9 @@ char const *CacheStateToStr(CacheState s);
 
 std::pair<void *, CacheState> OpenCacheFile(char const *path, size_t size, bool wmode);
 
+// Mapped writable by many processes at once, second is true if the file was just created
+std::pair<void *, bool> OpenSharedCacheFile(char const *path, size_t size);
+
 extern std::recursive_mutex dbtfslk;
 #define DBT_FS_LOCK() std::lock_guard lk(dbt::fsmanager::dbtfslk)
 
@@ -0,0 +1,239 @@
+#include "dbt/util/stats.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dbt
+{
+
+bool stats::enabled{false};
+std::atomic<stats::Shard *> stats::shards{};
+std::array<stats::Entry, stats::MAX_ENTRIES> stats::entries;
+u16 stats::n_entries{0};
+u16 stats::n_slots{stats::HIST_SLOTS}; // scratch for unregistered entries
+std::array<char, 256> stats::path;
+
+StatCounter::Setup::Setup(StatCounter &c)
+{
+	if (!c.slot) {
+		c.slot = stats::Register(c.name, stats::Kind::COUNTER);
+	}
+}
+
+StatHistogram::Setup::Setup(StatHistogram &h)
+{
+	if (!h.slot) {
+		h.slot = stats::Register(h.name, stats::Kind::HISTOGRAM);
+	}
+}
+
+// Runs during static initialization only
+u16 stats::Register(char const *name, Kind kind)
+{
+	u16 size = kind == Kind::COUNTER ? 1 : HIST_SLOTS;
+	if (n_entries == MAX_ENTRIES || n_slots + size > MAX_SLOTS) {
+		Panic("too many stats");
+	}
+	u16 slot = n_slots;
+	entries[n_entries++] = {name, slot, kind};
+	n_slots += size;
+	return slot;
+}
+
+stats::Shard *stats::NewShard()
+{
+	// Never freed, counts of exited threads remain in the total
+	shard = new Shard();
+	shard->next = shards.load(std::memory_order_relaxed);
+	while (!shards.compare_exchange_weak(shard->next, shard, std::memory_order_release)) {
+	}
+	return shard;
+}
+
+u64 stats::NowNs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+u64 stats::Sum(u16 slot)
+{
+	u64 res = 0;
+	for (auto s = shards.load(std::memory_order_acquire); s; s = s->next) {
+		res += s->v[slot].load(std::memory_order_relaxed);
+	}
+	return res;
+}
+
+// No stdio or allocations, it runs in a signal handler
+struct JsonWriter {
+	explicit JsonWriter(int fd_) : fd(fd_) {}
+	~JsonWriter()
+	{
+		Flush();
+	}
+
+	void Put(char const *str)
+	{
+		for (; *str; ++str) {
+			if (len == sizeof(buf)) {
+				Flush();
+			}
+			buf[len++] = *str;
+		}
+	}
+
+	void Put(u64 val)
+	{
+		char tmp[24];
+		char *p = tmp + sizeof(tmp);
+		*--p = 0;
+		do {
+			*--p = '0' + val % 10;
+			val /= 10;
+		} while (val);
+		Put(p);
+	}
+
+	void Key(char const *name)
+	{
+		Put("\"");
+		Put(name);
+		Put("\": ");
+	}
+
+private:
+	void Flush()
+	{
+		for (size_t offs = 0; offs < len;) {
+			ssize_t rc = write(fd, buf + offs, len - offs);
+			if (rc <= 0) {
+				break;
+			}
+			offs += rc;
+		}
+		len = 0;
+	}
+
+	int fd;
+	size_t len{0};
+	char buf[512];
+};
+
+void stats::Dump()
+{
+	int saved_errno = errno;
+	int fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		errno = saved_errno;
+		return;
+	}
+	{
+		JsonWriter w(fd);
+		u64 n_threads = 0;
+		for (auto s = shards.load(std::memory_order_acquire); s; s = s->next) {
+			n_threads++;
+		}
+		w.Put("{\n\t");
+		w.Key("threads");
+		w.Put(n_threads);
+
+		char const *sep = ",\n\t";
+		w.Put(sep);
+		w.Key("counters");
+		w.Put("{");
+		sep = "\n\t\t";
+		for (u16 i = 0; i < n_entries; ++i) {
+			auto const &e = entries[i];
+			if (e.kind == Kind::COUNTER) {
+				w.Put(sep);
+				w.Key(e.name);
+				w.Put(Sum(e.slot));
+				sep = ",\n\t\t";
+			}
+		}
+		w.Put("\n\t},\n\t");
+
+		w.Key("histograms");
+		w.Put("{");
+		sep = "\n\t\t";
+		for (u16 i = 0; i < n_entries; ++i) {
+			auto const &e = entries[i];
+			if (e.kind != Kind::HISTOGRAM) {
+				continue;
+			}
+			w.Put(sep);
+			w.Key(e.name);
+			w.Put("{");
+			w.Key("count");
+			w.Put(Sum(e.slot));
+			w.Put(", ");
+			w.Key("sum");
+			w.Put(Sum(e.slot + 1));
+			w.Put(", ");
+			w.Key("log2_buckets");
+			w.Put("[");
+			for (u16 b = 0; b < HIST_BUCKETS; ++b) {
+				w.Put(b ? ", " : "");
+				w.Put(Sum(e.slot + 2 + b));
+			}
+			w.Put("]}");
+			sep = ",\n\t\t";
+		}
+		w.Put("\n\t}\n}\n");
+	}
+	close(fd);
+	errno = saved_errno;
+}
+
+void stats::SignalHandler(int signo)
+{
+	Dump();
+}
+
+void stats::Init(char const *path_)
+{
+	if (strlen(path_) + 1 > path.size() - 16) { // room for .<pid>
+		Panic("stats path is too long");
+	}
+	strcpy(path.data(), path_);
+	enabled = true;
+
+	struct sigaction sa {};
+	sa.sa_handler = SignalHandler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, nullptr);
+}
+
+void stats::Destroy()
+{
+	if (!enabled) {
+		return;
+	}
+	signal(SIGUSR2, SIG_DFL);
+	Dump();
+	enabled = false;
+}
+
+void stats::ResetAfterFork()
+{
+	if (!enabled) {
+		return;
+	}
+	auto len = strlen(path.data());
+	snprintf(path.data() + len, path.size() - len, ".%d", getpid());
+	for (auto s = shards.load(std::memory_order_relaxed); s; s = s->next) {
+		for (auto &v : s->v) {
+			v.store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+} // namespace dbt
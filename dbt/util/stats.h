@@ -0,0 +1,153 @@
+#pragma once
+
+#include "dbt/util/common.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace dbt
+{
+
+// Counters and log2 histograms. Every thread updates its own shard, shards are summed on dump.
+// A disabled registry costs one branch per update.
+struct stats {
+	// Dumps json to path at Destroy and on SIGUSR2
+	static void Init(char const *path);
+	static void Destroy();
+	// The child counts from zero and writes <path>.<pid>
+	static void ResetAfterFork();
+
+	static ALWAYS_INLINE bool IsEnabled()
+	{
+		return enabled;
+	}
+
+	static ALWAYS_INLINE void Add(u16 slot, u64 n)
+	{
+		auto *s = shard;
+		if (unlikely(!s)) {
+			s = NewShard();
+		}
+		// Owner is the only writer, no need for a locked add
+		auto &v = s->v[slot];
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	static u64 NowNs();
+
+	enum class Kind : u8 {
+		COUNTER,
+		HISTOGRAM,
+	};
+	static u16 Register(char const *name, Kind kind);
+
+	// Bucket i holds values in [2^(i-1), 2^i), the last one is unbounded
+	static constexpr u16 HIST_BUCKETS = 32;
+	static constexpr u16 HIST_SLOTS = 2 + HIST_BUCKETS; // count, sum, buckets
+
+private:
+	stats() = delete;
+
+	static constexpr u16 MAX_SLOTS = 1024;
+	static constexpr u16 MAX_ENTRIES = 64;
+
+	struct Shard {
+		std::array<std::atomic<u64>, MAX_SLOTS> v{};
+		Shard *next{};
+	};
+
+	struct Entry {
+		char const *name;
+		u16 slot;
+		Kind kind;
+	};
+
+	static Shard *NewShard();
+	static u64 Sum(u16 slot);
+	static void Dump(); // async-signal-safe
+	static void SignalHandler(int signo);
+
+	static bool enabled;
+	static inline constinit thread_local Shard *shard{};
+	static std::atomic<Shard *> shards;
+	static std::array<Entry, MAX_ENTRIES> entries;
+	static u16 n_entries;
+	static u16 n_slots;
+	static std::array<char, 256> path;
+};
+
+struct StatCounter {
+	consteval StatCounter(char const *name_) : name(name_) {}
+
+	ALWAYS_INLINE void Add(u64 n = 1) const
+	{
+		if (unlikely(stats::IsEnabled())) {
+			stats::Add(slot, n);
+		}
+	}
+
+	struct Setup {
+		Setup(StatCounter &c);
+	};
+
+private:
+	char const *name;
+	u16 slot{}; // slot 0 is scratch until registered
+};
+
+struct StatHistogram {
+	consteval StatHistogram(char const *name_) : name(name_) {}
+
+	ALWAYS_INLINE void Record(u64 val) const
+	{
+		if (unlikely(stats::IsEnabled())) {
+			stats::Add(slot, 1);
+			stats::Add(slot + 1, val);
+			stats::Add(slot + 2 + std::min<u16>(std::bit_width(val), stats::HIST_BUCKETS - 1), 1);
+		}
+	}
+
+	// Records nanoseconds spent in the scope
+	struct ScopedTimer {
+		explicit ScopedTimer(StatHistogram const &h_) : h(h_)
+		{
+			if (unlikely(stats::IsEnabled())) {
+				start = stats::NowNs();
+			}
+		}
+		~ScopedTimer()
+		{
+			if (unlikely(stats::IsEnabled() && start)) {
+				h.Record(stats::NowNs() - start);
+			}
+		}
+
+	private:
+		StatHistogram const &h;
+		u64 start{};
+	};
+
+	struct Setup {
+		Setup(StatHistogram &h);
+	};
+
+private:
+	char const *name;
+	u16 slot{};
+};
+
+#define STAT_COUNTER(name)                                                                                   \
+	constinit inline StatCounter stat_##name{#name};                                                     \
+	namespace                                                                                            \
+	{                                                                                                    \
+	inline ::dbt::StatCounter::Setup setup_stat_##name{stat_##name};                                     \
+	}
+
+#define STAT_HISTOGRAM(name)                                                                                 \
+	constinit inline StatHistogram stat_##name{#name};                                                   \
+	namespace                                                                                            \
+	{                                                                                                    \
+	inline ::dbt::StatHistogram::Setup setup_stat_##name{stat_##name};                                   \
+	}
+
+} // namespace dbt
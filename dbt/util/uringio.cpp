@@ -0,0 +1,291 @@
+#include "dbt/util/uringio.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace dbt
+{
+
+int uringio::ring_fd{-1};
+u32 *uringio::sq_tail, *uringio::sq_mask, *uringio::sq_array;
+u32 *uringio::cq_head, *uringio::cq_tail, *uringio::cq_mask;
+io_uring_sqe *uringio::sqes;
+io_uring_cqe *uringio::cqes;
+void *uringio::sq_map, *uringio::cq_map;
+size_t uringio::sq_map_size, uringio::cq_map_size, uringio::sqes_size;
+
+std::mutex uringio::lock;
+uringio::Buffer uringio::bufs[2];
+unsigned uringio::cur;
+std::unordered_map<int, bool> uringio::async_fds;
+std::unordered_map<int, int> uringio::errors;
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+bool uringio::SetupRing()
+{
+	io_uring_params p{};
+	int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (fd < 0) {
+		log_uringio("io_uring_setup failed: %s", strerror(errno));
+		return false;
+	}
+	// Writes are issued at the current file position
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		log_uringio("no IORING_FEAT_RW_CUR_POS");
+		close(fd);
+		return false;
+	}
+
+	sq_map_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+	int mflags = MAP_SHARED | MAP_POPULATE;
+	sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, mflags, fd, IORING_OFF_SQ_RING);
+	cq_map = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, mflags, fd, IORING_OFF_CQ_RING);
+	sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, mflags, fd, IORING_OFF_SQES);
+	if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+		Panic("io_uring mmap failed");
+	}
+
+	auto sq = (u8 *)sq_map;
+	sq_tail = (u32 *)(sq + p.sq_off.tail);
+	sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+	sq_array = (u32 *)(sq + p.sq_off.array);
+	auto cq = (u8 *)cq_map;
+	cq_head = (u32 *)(cq + p.cq_off.head);
+	cq_tail = (u32 *)(cq + p.cq_off.tail);
+	cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	ring_fd = fd;
+	return true;
+}
+
+void uringio::UnmapRing()
+{
+	munmap(sqes, sqes_size);
+	munmap(cq_map, cq_map_size);
+	munmap(sq_map, sq_map_size);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+bool uringio::Init()
+{
+	if (!SetupRing()) {
+		return false;
+	}
+	for (auto &b : bufs) {
+		b = Buffer{.data = new u8[BUF_SIZE], .size = 0, .fd = -1, .inflight = false};
+	}
+	cur = 0;
+	log_uringio("enabled");
+	return true;
+}
+
+void uringio::Destroy()
+{
+	if (!IsEnabled()) {
+		return;
+	}
+	Drain();
+	for (auto [fd, err] : errors) {
+		log_uringio("async write to fd=%d failed at exit: %s", fd, strerror(err));
+	}
+	UnmapRing();
+	for (auto &b : bufs) {
+		delete[] b.data;
+		b.data = nullptr;
+	}
+}
+
+void uringio::ResetAfterFork()
+{
+	if (!IsEnabled()) {
+		return;
+	}
+	// Nothing is in flight, the parent drained before fork
+	async_fds.clear();
+	errors.clear();
+	UnmapRing();
+	if (!SetupRing()) {
+		Panic("failed to recreate io_uring after fork");
+	}
+}
+
+void uringio::Submit(Buffer *b)
+{
+	u32 tail = *sq_tail;
+	u32 idx = tail & *sq_mask;
+	auto sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = b->fd;
+	sqe->addr = (uptr)b->data;
+	sqe->len = b->size;
+	sqe->off = (u64)-1;
+	sqe->user_data = b - bufs;
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	b->inflight = true;
+	while (io_uring_enter(ring_fd, 1, 0, 0) < 0) {
+		if (errno != EINTR) {
+			Panic("io_uring_enter failed");
+		}
+	}
+}
+
+void uringio::Complete(Buffer *b, int res)
+{
+	if (res < 0) {
+		log_uringio("async write to fd=%d failed: %s", b->fd, strerror(-res));
+		errors.insert({b->fd, -res});
+	} else {
+		// Short write, finish it synchronously to keep the order
+		for (size_t done = res; done < b->size;) {
+			auto rc = write(b->fd, b->data + done, b->size - done);
+			if (rc < 0) {
+				errors.insert({b->fd, errno});
+				break;
+			}
+			if (rc == 0) {
+				errors.insert({b->fd, ENOSPC});
+				break;
+			}
+			done += rc;
+		}
+	}
+	b->size = 0;
+	b->inflight = false;
+}
+
+void uringio::Reap(bool wait)
+{
+	while (true) {
+		u32 head = *cq_head;
+		if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			auto cqe = &cqes[head & *cq_mask];
+			Complete(&bufs[cqe->user_data], cqe->res);
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			return; // at most one write is in flight
+		}
+		if (!wait) {
+			return;
+		}
+		if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			Panic("io_uring_enter failed");
+		}
+	}
+}
+
+void uringio::Flush()
+{
+	auto &other = bufs[cur ^ 1];
+	if (other.inflight) {
+		Reap(true);
+	}
+	Submit(&bufs[cur]);
+	cur ^= 1;
+}
+
+void uringio::DrainLocked()
+{
+	if (bufs[cur].size) {
+		Flush();
+	}
+	if (bufs[cur ^ 1].inflight) {
+		Reap(true);
+	}
+}
+
+void uringio::Drain()
+{
+	if (!IsEnabled()) {
+		return;
+	}
+	std::lock_guard lk(lock);
+	DrainLocked();
+}
+
+int uringio::Sync(int fd, bool closing)
+{
+	if (!IsEnabled()) {
+		return 0;
+	}
+	std::lock_guard lk(lock);
+	DrainLocked();
+	if (closing) {
+		async_fds.erase(fd);
+	}
+	auto it = errors.find(fd);
+	if (it == errors.end()) {
+		return 0;
+	}
+	int err = it->second;
+	errors.erase(it);
+	return err;
+}
+
+// Pipes, sockets and ttys might block or fail in ways the guest must see right away
+bool uringio::IsAsyncFd(int fd, int fl)
+{
+	struct stat st;
+	return (fl & O_ACCMODE) != O_RDONLY && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+ssize_t uringio::Write(int fd, void const *buf, size_t count)
+{
+	std::lock_guard lk(lock);
+
+	if (auto it = errors.find(fd); unlikely(it != errors.end())) {
+		errno = it->second;
+		errors.erase(it);
+		return -1;
+	}
+	if (bufs[cur ^ 1].inflight) {
+		Reap(false);
+	}
+
+	auto fd_it = async_fds.find(fd);
+	if (fd_it == async_fds.end()) {
+		int fl = fcntl(fd, F_GETFL);
+		if (fl < 0) {
+			return -1; // not cached, the guest may open it later
+		}
+		fd_it = async_fds.insert({fd, IsAsyncFd(fd, fl)}).first;
+	}
+	if (!fd_it->second || count > BUF_SIZE) {
+		DrainLocked();
+		return write(fd, buf, count);
+	}
+
+	auto b = &bufs[cur];
+	if (b->size && (b->fd != fd || b->size + count > BUF_SIZE)) {
+		Flush();
+		b = &bufs[cur];
+	}
+	memcpy(b->data + b->size, buf, count);
+	b->size += count;
+	b->fd = fd;
+
+	// Coalesce only behind a write in flight, otherwise submit right away
+	if (!bufs[cur ^ 1].inflight) {
+		Flush();
+	}
+	return count;
+}
+
+} // namespace dbt
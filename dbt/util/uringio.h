@@ -0,0 +1,75 @@
+#pragma once
+
+#include "dbt/util/common.h"
+#include "dbt/util/logger.h"
+
+#include <mutex>
+#include <unordered_map>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace dbt
+{
+LOG_STREAM(uringio);
+
+// Guest writes coalesced in a double buffer and submitted through io_uring. Only one write is in flight,
+// so the order is preserved. Any other guest-visible I/O must Drain() first. Only regular files go
+// through the ring, a failed write is reported by the next write, fsync or close of the same fd.
+struct uringio {
+	// Returns false if the host has no usable io_uring, I/O remains synchronous then
+	static bool Init();
+	static void Destroy();
+
+	static bool IsEnabled()
+	{
+		return ring_fd >= 0;
+	}
+
+	// buf must be readable, the caller checks guest buffers
+	static ssize_t Write(int fd, void const *buf, size_t count);
+	static void Drain();
+	// Drains and returns the errno of a failed write to fd, or 0. Close forgets the fd
+	static int Sync(int fd, bool closing);
+
+	// The ring is shared with the parent after fork, the child sets up its own one
+	static void ResetAfterFork();
+
+private:
+	uringio() = delete;
+
+	static constexpr unsigned RING_ENTRIES = 4;
+	static constexpr size_t BUF_SIZE = 64_KB;
+
+	struct Buffer {
+		u8 *data;
+		size_t size;
+		int fd;
+		bool inflight;
+	};
+
+	static bool SetupRing();
+	static void UnmapRing();
+	static void Submit(Buffer *b);
+	static void Reap(bool wait);
+	static void Complete(Buffer *b, int res);
+	static void Flush();
+	static void DrainLocked();
+	static bool IsAsyncFd(int fd, int fl);
+
+	static int ring_fd;
+	static u32 *sq_tail, *sq_mask, *sq_array;
+	static u32 *cq_head, *cq_tail, *cq_mask;
+	static io_uring_sqe *sqes;
+	static io_uring_cqe *cqes;
+	static void *sq_map, *cq_map;
+	static size_t sq_map_size, cq_map_size, sqes_size;
+
+	static std::mutex lock;
+	static Buffer bufs[2];
+	static unsigned cur;
+	static std::unordered_map<int, bool> async_fds; // validated fds, true for regular files
+	static std::unordered_map<int, int> errors;      // fd to errno of a failed async write
+};
+
+} // namespace dbt